@@ -0,0 +1,188 @@
+// Sort an array of records by key, generated once per record type and
+// comparison so every comparison is inlined. Define these before each
+// #include of this file:
+//   KEY_SORT_NAME         name of the generated function
+//   KEY_SORT_T            record type
+//   KEY_SORT_PREFIX(r)    uint64_t whose order agrees with the full key
+//                         (e.g. key_prefix_casefold(r->name))
+//   KEY_SORT_LESS(a, b)   nonzero if record *a sorts before *b
+// This gives
+//   static int KEY_SORT_NAME(KEY_SORT_T* arr, size_t n);
+// which sorts small (prefix, index) entries instead of the records, so
+// most comparisons are one integer compare and each record is moved once
+// at the end. Records with equal keys keep their order. Returns 0 if the
+// entries can't be allocated, leaving arr unchanged.
+
+#if !defined(KEY_SORT_NAME) || !defined(KEY_SORT_T) || !defined(KEY_SORT_PREFIX) || !defined(KEY_SORT_LESS)
+#error "Define KEY_SORT_NAME, KEY_SORT_T, KEY_SORT_PREFIX and KEY_SORT_LESS before including key_sort.h"
+#endif
+
+#ifndef KEY_SORT_COMMON
+#define KEY_SORT_COMMON
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define KEY_SORT_CAT_(a, b) a##b
+#define KEY_SORT_CAT(a, b) KEY_SORT_CAT_(a, b)
+#define KEY_SORT_INSERTION 16  // Ranges this short are insertion sorted
+
+typedef struct {
+    uint64_t prefix;
+    size_t index;  // Position of the record in the input
+} KeySortEntry;
+
+// First 8 bytes of s, lowercased, packed big-endian so that comparing
+// the numbers compares the strings; shorter strings are padded with zeros
+static inline uint64_t key_prefix_casefold(const char* s) {
+    uint64_t key = 0;
+    int i = 0;
+    for (; i < 8 && s[i]; i++)
+        key = key << 8 | (unsigned char)tolower((unsigned char)s[i]);
+    return i ? key << (8 * (8 - i)) : 0;
+}
+
+// Case-insensitive comparison folding the same way as key_prefix_casefold
+static inline int key_casecmp(const char* a, const char* b) {
+    int x, y;
+    do {
+        x = tolower((unsigned char)*a++);
+        y = tolower((unsigned char)*b++);
+    } while (x && x == y);
+    return x - y;
+}
+
+#endif // KEY_SORT_COMMON
+
+#define KEY_SORT_FN(name) KEY_SORT_CAT(KEY_SORT_NAME, name)
+
+// Entry order: prefix, then the full key for prefix ties, then input position
+static inline int KEY_SORT_FN(_less)(const KeySortEntry* a, const KeySortEntry* b,
+                                     const KEY_SORT_T* arr) {
+    if (a->prefix != b->prefix)
+        return a->prefix < b->prefix;
+    if (KEY_SORT_LESS(&arr[a->index], &arr[b->index]))
+        return 1;
+    if (KEY_SORT_LESS(&arr[b->index], &arr[a->index]))
+        return 0;
+    return a->index < b->index;
+}
+
+static void KEY_SORT_FN(_sift)(KeySortEntry* e, size_t root, size_t n, const KEY_SORT_T* arr) {
+    KeySortEntry v = e[root];
+    size_t child;
+    while ((child = 2 * root + 1) < n) {
+        if (child + 1 < n && KEY_SORT_FN(_less)(&e[child], &e[child + 1], arr))
+            child++;
+        if (!KEY_SORT_FN(_less)(&v, &e[child], arr))
+            break;
+        e[root] = e[child];
+        root = child;
+    }
+    e[root] = v;
+}
+
+// Introsort on the entries: quicksort with a median-of-3 pivot, heapsort
+// when the recursion goes too deep, insertion sort for short ranges
+static void KEY_SORT_FN(_entries)(KeySortEntry* e, size_t n, int depth, const KEY_SORT_T* arr) {
+    while (n > KEY_SORT_INSERTION) {
+        if (depth-- == 0) {
+            for (size_t i = n / 2; i-- > 0;)
+                KEY_SORT_FN(_sift)(e, i, n, arr);
+            for (size_t end = n; end-- > 1;) {
+                KeySortEntry t = e[0];
+                e[0] = e[end];
+                e[end] = t;
+                KEY_SORT_FN(_sift)(e, 0, end, arr);
+            }
+            return;
+        }
+
+        // Median of first, middle and last ends up in the middle
+        KeySortEntry* lo = e;
+        KeySortEntry* mid = e + n / 2;
+        KeySortEntry* hi = e + n - 1;
+        KeySortEntry t;
+        if (KEY_SORT_FN(_less)(mid, lo, arr)) { t = *mid; *mid = *lo; *lo = t; }
+        if (KEY_SORT_FN(_less)(hi, mid, arr)) { t = *hi; *hi = *mid; *mid = t; }
+        if (KEY_SORT_FN(_less)(mid, lo, arr)) { t = *mid; *mid = *lo; *lo = t; }
+        KeySortEntry pivot = *mid;
+
+        // Hoare partition; entries are all distinct thanks to the index
+        size_t i = 0, j = n - 1;
+        while (1) {
+            while (KEY_SORT_FN(_less)(&e[i], &pivot, arr)) i++;
+            while (KEY_SORT_FN(_less)(&pivot, &e[j], arr)) j--;
+            if (i >= j)
+                break;
+            t = e[i];
+            e[i] = e[j];
+            e[j] = t;
+            i++;
+            j--;
+        }
+
+        // Recurse into the smaller side, loop on the bigger one
+        size_t left = j + 1;
+        if (left < n - left) {
+            KEY_SORT_FN(_entries)(e, left, depth, arr);
+            e += left;
+            n -= left;
+        } else {
+            KEY_SORT_FN(_entries)(e + left, n - left, depth, arr);
+            n = left;
+        }
+    }
+    for (size_t i = 1; i < n; i++) {
+        KeySortEntry v = e[i];
+        size_t j = i;
+        while (j > 0 && KEY_SORT_FN(_less)(&v, &e[j - 1], arr)) {
+            e[j] = e[j - 1];
+            j--;
+        }
+        e[j] = v;
+    }
+}
+
+static int KEY_SORT_NAME(KEY_SORT_T* arr, size_t n) {
+    if (n < 2)
+        return 1;
+    KeySortEntry* e = malloc(n * sizeof(KeySortEntry));
+    if (!e)
+        return 0;
+    for (size_t i = 0; i < n; i++) {
+        e[i].prefix = KEY_SORT_PREFIX(&arr[i]);
+        e[i].index = i;
+    }
+    int depth = 0;
+    for (size_t m = n; m; m >>= 1)
+        depth += 2;
+    KEY_SORT_FN(_entries)(e, n, depth, arr);
+
+    // Position i takes record e[i].index. Follow each cycle of that
+    // permutation with one spare record, marking slots done as we go.
+    for (size_t i = 0; i < n; i++) {
+        if (e[i].index == i)
+            continue;
+        KEY_SORT_T spare = arr[i];
+        size_t j = i;
+        while (e[j].index != i) {
+            size_t from = e[j].index;
+            arr[j] = arr[from];
+            e[j].index = j;
+            j = from;
+        }
+        arr[j] = spare;
+        e[j].index = j;
+    }
+    free(e);
+    return 1;
+}
+
+#undef KEY_SORT_FN
+#undef KEY_SORT_NAME
+#undef KEY_SORT_T
+#undef KEY_SORT_PREFIX
+#undef KEY_SORT_LESS
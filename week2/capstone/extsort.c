@@ -0,0 +1,669 @@
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+// Sort files bigger than memory: sort budget-sized runs in memory and
+// write them out, then merge the runs with a loser tree.
+// Ints use the LSD radix sort from sort_template.h; contact CSV lines
+// are sorted by name, ignoring case, with include/key_sort.h.
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#define SORT_T int
+#define SORT_SUFFIX _i32
+#define SORT_KEY_T uint32_t
+#define SORT_KEY(x) ((uint32_t)(x) ^ 0x80000000u)
+#include "sort_template.h"
+#pragma GCC diagnostic pop
+
+#define DEFAULT_BUDGET_MB 256
+#define MIN_BUFFER (1 << 20)  // Smallest read buffer per run while merging
+#define MAX_FANIN 512         // Runs merged at once; more take extra passes
+
+typedef enum { FORMAT_INT, FORMAT_CSV } Format;
+
+// A CSV line, NUL-terminated in place of its newline
+typedef struct {
+    const char* text;
+    size_t len;
+} Line;
+
+// Name field packed like key_prefix_casefold, stopping at the comma
+static uint64_t name_prefix(const char* s) {
+    uint64_t key = 0;
+    int i = 0;
+    for (; i < 8 && s[i] && s[i] != ','; i++)
+        key = key << 8 | (unsigned char)tolower((unsigned char)s[i]);
+    return i ? key << (8 * (8 - i)) : 0;
+}
+
+// Compare the name fields (up to the first comma), ignoring case
+static int name_casecmp(const char* a, const char* b) {
+    int x, y;
+    do {
+        x = *a == ',' ? 0 : tolower((unsigned char)*a);
+        y = *b == ',' ? 0 : tolower((unsigned char)*b);
+        a++;
+        b++;
+    } while (x && x == y);
+    return x - y;
+}
+
+#define KEY_SORT_NAME sort_lines
+#define KEY_SORT_T Line
+#define KEY_SORT_PREFIX(l) name_prefix((l)->text)
+#define KEY_SORT_LESS(a, b) (name_casecmp((a)->text, (b)->text) < 0)
+#include "include/key_sort.h"
+
+// ---------------------------------------------------------------
+// Statistics
+// ---------------------------------------------------------------
+
+typedef struct {
+    double seconds;
+    double sort_seconds;  // Part of seconds spent sorting in memory
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    int runs;             // Runs written: sorted runs, or merged ones
+} PhaseStats;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_size(uint64_t bytes) {
+    if (bytes >= (1ULL << 30)) printf("%8.2f GB", bytes / (double)(1ULL << 30));
+    else if (bytes >= (1ULL << 20)) printf("%8.2f MB", bytes / (double)(1ULL << 20));
+    else printf("%8.2f KB", bytes / 1024.0);
+}
+
+static void print_phase(const char* name, const PhaseStats* s) {
+    printf("%-15s %8.3f s  read ", name, s->seconds);
+    print_size(s->bytes_read);
+    printf("  wrote ");
+    print_size(s->bytes_written);
+    double mb = (s->bytes_read + s->bytes_written) / (double)(1 << 20);
+    printf("  %8.1f MB/s\n", s->seconds > 0 ? mb / s->seconds : 0.0);
+}
+
+// ---------------------------------------------------------------
+// Runs
+// ---------------------------------------------------------------
+
+typedef struct {
+    char** names;
+    int count;
+    int capacity;
+    const char* dir;
+    int next_id;
+} RunList;
+
+// Name a new temporary run file and remember it
+static const char* new_run(RunList* runs) {
+    if (runs->count == runs->capacity) {
+        int capacity = runs->capacity ? runs->capacity * 2 : 64;
+        char** names = realloc(runs->names, capacity * sizeof(char*));
+        if (!names) {
+            return NULL;
+        }
+        runs->names = names;
+        runs->capacity = capacity;
+    }
+    char* name = malloc(strlen(runs->dir) + 64);
+    if (!name) {
+        return NULL;
+    }
+    sprintf(name, "%s/extsort.%ld.%d", runs->dir, (long)getpid(), runs->next_id++);
+    runs->names[runs->count++] = name;
+    return name;
+}
+
+static void remove_runs(RunList* runs, int first, int count) {
+    if (count == 0) {
+        return;
+    }
+    for (int i = first; i < first + count; i++) {
+        remove(runs->names[i]);
+        free(runs->names[i]);
+    }
+    memmove(runs->names + first, runs->names + first + count,
+            (runs->count - first - count) * sizeof(char*));
+    runs->count -= count;
+}
+
+static FILE* open_output(const char* filename, size_t buffer) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        printf("Error: Can't create %s!\n", filename);
+        return NULL;
+    }
+    setvbuf(file, NULL, _IOFBF, buffer);
+    return file;
+}
+
+// Write n sorted ints to a run file (or straight to the output)
+static int write_ints(const char* filename, const int* values, size_t n, PhaseStats* stats) {
+    FILE* file = open_output(filename, MIN_BUFFER);
+    if (!file) {
+        return 0;
+    }
+    size_t written = fwrite(values, sizeof(int), n, file);
+    int ok = fclose(file) == 0 && written == n;
+    stats->bytes_written += written * sizeof(int);
+    if (!ok) {
+        printf("Error: Can't write %s!\n", filename);
+    }
+    return ok;
+}
+
+static int write_lines(const char* filename, const char* header, const Line* lines, size_t n,
+                       PhaseStats* stats) {
+    FILE* file = open_output(filename, MIN_BUFFER);
+    if (!file) {
+        return 0;
+    }
+    uint64_t bytes = 0;
+    if (header) {
+        fputs(header, file);
+        fputc('\n', file);
+        bytes += strlen(header) + 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        fwrite(lines[i].text, 1, lines[i].len, file);
+        fputc('\n', file);
+        bytes += lines[i].len + 1;
+    }
+    int ok = fclose(file) == 0;
+    stats->bytes_written += bytes;
+    if (!ok) {
+        printf("Error: Can't write %s!\n", filename);
+    }
+    return ok;
+}
+
+// Phase 1 for ints: fill half the budget, radix sort using the other
+// half as scratch, write the run. If everything fits in one run it goes
+// straight to the output.
+static int make_int_runs(FILE* in, const char* output, size_t budget, RunList* runs, PhaseStats* stats) {
+    size_t chunk = budget / (2 * sizeof(int));
+    int* values = malloc(chunk * sizeof(int));
+    int* scratch = malloc(chunk * sizeof(int));
+    if (!values || !scratch) {
+        printf("Error: Can't allocate %zu MB for sorting!\n", budget >> 20);
+        free(values);
+        free(scratch);
+        return 0;
+    }
+    int ok = 1;
+    size_t n;
+    while (ok && (n = fread(values, sizeof(int), chunk, in)) > 0) {
+        stats->bytes_read += n * sizeof(int);
+        double start = now_seconds();
+        radix_sort_lsd_i32(values, scratch, n);
+        stats->sort_seconds += now_seconds() - start;
+
+        // A file that fits in one run needs no merge
+        int c = n < chunk ? EOF : fgetc(in);
+        int last = c == EOF;
+        if (!last) {
+            ungetc(c, in);
+        }
+        const char* name = last && runs->count == 0 ? output : new_run(runs);
+        ok = name && write_ints(name, values, n, stats);
+        stats->runs++;
+        if (last) {
+            break;
+        }
+    }
+    if (ok && stats->runs == 0) {
+        ok = write_ints(output, values, 0, stats);  // Empty input, empty output
+    }
+    free(values);
+    free(scratch);
+    return ok;
+}
+
+// The first line is a header if it starts with the Name column
+static int is_header(const char* line) {
+    return strncmp(line, "Name,", 5) == 0 || strncmp(line, "name,", 5) == 0;
+}
+
+// Phase 1 for CSV: read lines into a text arena of most of the budget,
+// sort the line records, write the run; a partial last line is carried
+// over to the next run. The rest of the budget holds the line table and
+// the (prefix, index) entries sort_lines allocates, one of each per line.
+static int make_csv_runs(FILE* in, const char* output, size_t budget, char** header,
+                         RunList* runs, PhaseStats* stats) {
+    size_t arena_size = budget / 4 * 3;
+    size_t max_lines = (budget - arena_size) / (sizeof(Line) + sizeof(KeySortEntry));
+    char* arena = malloc(arena_size + 1);
+    Line* lines = malloc(max_lines * sizeof(Line));
+    if (!arena || !lines) {
+        printf("Error: Can't allocate %zu MB for sorting!\n", budget >> 20);
+        free(arena);
+        free(lines);
+        return 0;
+    }
+
+    int ok = 1, first = 1, eof = 0;
+    size_t used = 0;  // Bytes in the arena, the carried-over partial line first
+    while (ok && !eof) {
+        size_t got = fread(arena + used, 1, arena_size - used, in);
+        stats->bytes_read += got;
+        used += got;
+        eof = used < arena_size;
+
+        // Split into lines, keeping a trailing partial line unless at the end
+        size_t count = 0, pos = 0;
+        while (pos < used && count < max_lines) {
+            char* nl = memchr(arena + pos, '\n', used - pos);
+            if (!nl) {
+                if (!eof) break;
+                nl = arena + used;  // Last line without a newline
+            }
+            *nl = '\0';
+            size_t len = nl - (arena + pos);
+            if (len > 0 && arena[pos + len - 1] == '\r') {
+                arena[pos + --len] = '\0';
+            }
+            if (first && is_header(arena + pos)) {
+                *header = strdup(arena + pos);
+            } else if (len > 0) {
+                lines[count].text = arena + pos;
+                lines[count].len = len;
+                count++;
+            }
+            first = 0;
+            pos = nl - arena + 1;
+        }
+        if (pos >= used) {
+            pos = used;
+        } else {
+            eof = 0;  // Lines left over, because the line table filled up
+        }
+        if (count == 0 && pos == 0 && !eof) {
+            printf("Error: Line longer than the sort buffer!\n");
+            ok = 0;
+            break;
+        }
+
+        double start = now_seconds();
+        ok = sort_lines(lines, count);
+        stats->sort_seconds += now_seconds() - start;
+        if (!ok) {
+            printf("Error: Can't allocate sort keys!\n");
+            break;
+        }
+        int last = eof && runs->count == 0;
+        const char* name = last ? output : new_run(runs);
+        ok = name && write_lines(name, last ? *header : NULL, lines, count, stats);
+        stats->runs++;
+
+        // Keep the unprocessed tail for the next run
+        memmove(arena, arena + pos, used - pos);
+        used -= pos;
+    }
+    free(arena);
+    free(lines);
+    return ok;
+}
+
+// ---------------------------------------------------------------
+// Merge
+// ---------------------------------------------------------------
+
+// Buffered reader over one run. Each refill also asks the kernel to
+// start reading the next buffer's worth in the background.
+typedef struct {
+    FILE* file;
+    char* buf;
+    size_t cap, pos, end;
+    int eof;
+    int failed;        // Read error, or no memory for a long line
+    int done;          // No current record
+    int key;           // Current int
+    const char* text;  // Current line
+    size_t len;
+} RunReader;
+
+static size_t reader_refill(RunReader* r, PhaseStats* stats) {
+    memmove(r->buf, r->buf + r->pos, r->end - r->pos);
+    r->end -= r->pos;
+    r->pos = 0;
+    if (r->end == r->cap) {
+        // A full buffer with no newline: the line is longer than the
+        // merge buffer (phase 1 allows lines up to 3/4 of the budget)
+        char* bigger = realloc(r->buf, r->cap * 2);
+        if (!bigger) {
+            r->failed = r->eof = 1;
+            return 0;
+        }
+        r->buf = bigger;
+        r->cap *= 2;
+    }
+    size_t got = fread(r->buf + r->end, 1, r->cap - r->end, r->file);
+    r->end += got;
+    r->failed = r->failed || ferror(r->file);
+    r->eof = feof(r->file) || r->failed;
+    stats->bytes_read += got;
+    if (!r->eof) {
+        posix_fadvise(fileno(r->file), ftello(r->file), r->cap, POSIX_FADV_WILLNEED);
+    }
+    return got;
+}
+
+// Advance to the next record; sets done at the end of the run
+static void reader_next(RunReader* r, Format format, PhaseStats* stats) {
+    if (format == FORMAT_INT) {
+        if (r->end - r->pos < sizeof(int) && !r->eof) {
+            reader_refill(r, stats);
+        }
+        if (r->end - r->pos < sizeof(int)) {
+            r->done = 1;
+            return;
+        }
+        memcpy(&r->key, r->buf + r->pos, sizeof(int));
+        r->pos += sizeof(int);
+        return;
+    }
+    char* nl = memchr(r->buf + r->pos, '\n', r->end - r->pos);
+    while (!nl && !r->eof) {
+        size_t scanned = r->end - r->pos;
+        reader_refill(r, stats);
+        nl = memchr(r->buf + scanned, '\n', r->end - scanned);
+    }
+    if (!nl) {
+        r->done = 1;  // Runs always end lines with a newline
+        return;
+    }
+    *nl = '\0';
+    r->text = r->buf + r->pos;
+    r->len = nl - r->text;
+    r->pos = nl - r->buf + 1;
+}
+
+// Output collected in one big block per write
+typedef struct {
+    FILE* file;
+    char* buf;
+    size_t cap, used;
+    uint64_t written;
+    int failed;
+} BlockWriter;
+
+static void block_flush(BlockWriter* w) {
+    if (w->used && fwrite(w->buf, 1, w->used, w->file) != w->used) {
+        w->failed = 1;
+    }
+    w->written += w->used;
+    w->used = 0;
+}
+
+static inline void block_write(BlockWriter* w, const void* data, size_t len) {
+    if (w->used + len > w->cap) {
+        block_flush(w);
+        if (len > w->cap) {
+            w->failed |= fwrite(data, 1, len, w->file) != len;
+            w->written += len;
+            return;
+        }
+    }
+    memcpy(w->buf + w->used, data, len);
+    w->used += len;
+}
+
+typedef struct {
+    RunReader* readers;
+    int* tree;  // tree[0] is the winner, tree[1..k-1] the loser at each node
+    int k;
+    Format format;
+} LoserTree;
+
+// Exhausted runs lose to everything; equal keys go to the earlier run
+static int run_less(const LoserTree* t, int a, int b) {
+    const RunReader* x = &t->readers[a];
+    const RunReader* y = &t->readers[b];
+    if (x->done || y->done)
+        return !x->done || (y->done && a < b);
+    if (t->format == FORMAT_INT)
+        return x->key < y->key || (x->key == y->key && a < b);
+    int c = name_casecmp(x->text, y->text);
+    return c < 0 || (c == 0 && a < b);
+}
+
+// Play the matches below node; leaves are k..2k-1
+static int tree_build(LoserTree* t, int node) {
+    if (node >= t->k)
+        return node - t->k;
+    int left = tree_build(t, 2 * node);
+    int right = tree_build(t, 2 * node + 1);
+    if (run_less(t, right, left)) {
+        t->tree[node] = left;
+        return right;
+    }
+    t->tree[node] = right;
+    return left;
+}
+
+// After the winner's run advanced, replay its path to the root:
+// one comparison per level
+static void tree_replay(LoserTree* t) {
+    int winner = t->tree[0];
+    for (int node = (winner + t->k) / 2; node >= 1; node /= 2) {
+        if (run_less(t, t->tree[node], winner)) {
+            int loser = winner;
+            winner = t->tree[node];
+            t->tree[node] = loser;
+        }
+    }
+    t->tree[0] = winner;
+}
+
+// Merge runs [first, first + k) into output, with a header line for CSV
+static int merge_runs(RunList* runs, int first, int k, const char* output, const char* header,
+                      Format format, size_t budget, PhaseStats* stats) {
+    size_t buffer = budget / (k + 1);
+    LoserTree t = {calloc(k, sizeof(RunReader)), malloc(k * sizeof(int)), k, format};
+    BlockWriter out = {fopen(output, "wb"), malloc(buffer), buffer, 0, 0, 0};
+    int ok = t.readers && t.tree && out.buf;
+    if (!out.file) {
+        printf("Error: Can't create %s!\n", output);
+        ok = 0;
+    }
+    for (int i = 0; ok && i < k; i++) {
+        RunReader* r = &t.readers[i];
+        r->cap = buffer;
+        r->buf = malloc(buffer);
+        r->file = fopen(runs->names[first + i], "rb");
+        if (!r->buf || !r->file) {
+            printf("Error: Can't open run %s!\n", runs->names[first + i]);
+            ok = 0;
+            break;
+        }
+        setvbuf(r->file, NULL, _IONBF, 0);  // Our buffer is big enough
+        posix_fadvise(fileno(r->file), 0, 0, POSIX_FADV_SEQUENTIAL);
+        reader_next(r, format, stats);
+    }
+
+    if (ok) {
+        setvbuf(out.file, NULL, _IONBF, 0);
+        if (header) {
+            block_write(&out, header, strlen(header));
+            block_write(&out, "\n", 1);
+        }
+        t.tree[0] = tree_build(&t, 1);
+        while (!t.readers[t.tree[0]].done) {
+            RunReader* r = &t.readers[t.tree[0]];
+            if (format == FORMAT_INT) {
+                block_write(&out, &r->key, sizeof(int));
+            } else {
+                r->buf[r->pos - 1] = '\n';  // Put the newline back and copy the whole line
+                block_write(&out, r->text, r->len + 1);
+            }
+            reader_next(r, format, stats);
+            tree_replay(&t);
+        }
+        block_flush(&out);
+        stats->bytes_written += out.written;
+        for (int i = 0; i < k; i++) {
+            if (t.readers[i].failed) {
+                printf("Error: Can't read run %s!\n", runs->names[first + i]);
+                ok = 0;
+            }
+        }
+    }
+    if (out.file && (fclose(out.file) != 0 || out.failed)) {
+        printf("Error: Can't write %s!\n", output);
+        ok = 0;
+    }
+    for (int i = 0; t.readers && i < k; i++) {
+        if (t.readers[i].file) fclose(t.readers[i].file);
+        free(t.readers[i].buf);
+    }
+    free(t.readers);
+    free(t.tree);
+    free(out.buf);
+    return ok;
+}
+
+// Runs merged at once: every run and the output get a buffer of at least MIN_BUFFER
+static int merge_fanin(size_t budget) {
+    int fanin = (int)(budget / MIN_BUFFER) - 1;
+    if (fanin > MAX_FANIN) fanin = MAX_FANIN;
+    return fanin < 2 ? 2 : fanin;
+}
+
+// While there are more runs than one merge can take, merge consecutive
+// groups in passes, each result taking its group's place so that equal
+// keys keep their input order. The final merge writes the output.
+static int merge_all(RunList* runs, const char* output, const char* header, Format format,
+                     size_t budget, PhaseStats* stats) {
+    int fanin = merge_fanin(budget);
+    while (runs->count > fanin) {
+        for (int first = 0; first < runs->count; first++) {
+            int k = runs->count - first < fanin ? runs->count - first : fanin;
+            if (k < 2) {
+                break;
+            }
+            const char* target = new_run(runs);
+            if (!target || !merge_runs(runs, first, k, target, NULL, format, budget, stats)) {
+                return 0;
+            }
+            stats->runs++;
+            // Drop the inputs, then move the new run from the end into their place
+            remove_runs(runs, first, k);
+            char* merged = runs->names[runs->count - 1];
+            memmove(runs->names + first + 1, runs->names + first,
+                    (runs->count - 1 - first) * sizeof(char*));
+            runs->names[first] = merged;
+        }
+    }
+    if (!merge_runs(runs, 0, runs->count, output, header, format, budget, stats)) {
+        return 0;
+    }
+    stats->runs++;
+    remove_runs(runs, 0, runs->count);
+    return 1;
+}
+
+// ---------------------------------------------------------------
+// Command line
+// ---------------------------------------------------------------
+
+static void print_usage(const char* program) {
+    printf("Usage: %s [-m MB] [-t tmpdir] [-f int|csv] <input> <output>\n", program);
+    printf("Sorts a file of native-endian 32-bit ints, or a contact CSV\n");
+    printf("(Name,Phone,Email) by name ignoring case, using at most -m MB\n");
+    printf("of memory (default %d). Runs go to -t (default: the output's\n", DEFAULT_BUDGET_MB);
+    printf("directory). The format follows the extension unless -f is given.\n");
+}
+
+int main(int argc, char* argv[]) {
+    size_t budget = (size_t)DEFAULT_BUDGET_MB << 20;
+    const char* tmpdir = NULL;
+    int format = -1;
+    int i = 1;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "-m") == 0 && atol(argv[i + 1]) >= 4) {
+            budget = (size_t)atol(argv[i + 1]) << 20;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            tmpdir = argv[i + 1];
+        } else if (strcmp(argv[i], "-f") == 0 && strcmp(argv[i + 1], "int") == 0) {
+            format = FORMAT_INT;
+        } else if (strcmp(argv[i], "-f") == 0 && strcmp(argv[i + 1], "csv") == 0) {
+            format = FORMAT_CSV;
+        } else {
+            printf("Error: Bad option %s %s\n", argv[i], argv[i + 1]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - i != 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const char* input = argv[i];
+    const char* output = argv[i + 1];
+    if (format < 0) {
+        const char* dot = strrchr(input, '.');
+        format = dot && strcmp(dot, ".csv") == 0 ? FORMAT_CSV : FORMAT_INT;
+    }
+
+    // Runs default to the output's directory, which has room for the output
+    char dir[4096];
+    if (!tmpdir) {
+        snprintf(dir, sizeof(dir), "%s", output);
+        char* slash = strrchr(dir, '/');
+        if (slash) *slash = '\0';
+        else strcpy(dir, ".");
+        tmpdir = dir;
+    }
+
+    FILE* in = fopen(input, "rb");
+    if (!in) {
+        printf("Error: Can't open %s!\n", input);
+        return 1;
+    }
+    posix_fadvise(fileno(in), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    RunList runs = {NULL, 0, 0, tmpdir, 0};
+    PhaseStats gen = {0}, merge = {0};
+    char* header = NULL;
+    double start = now_seconds();
+    int ok = format == FORMAT_INT ? make_int_runs(in, output, budget, &runs, &gen)
+                                  : make_csv_runs(in, output, budget, &header, &runs, &gen);
+    fclose(in);
+    gen.seconds = now_seconds() - start;
+
+    if (ok && runs.count > 0) {
+        start = now_seconds();
+        ok = merge_all(&runs, output, header, format, budget, &merge);
+        merge.seconds = now_seconds() - start;
+    }
+    remove_runs(&runs, 0, runs.count);
+    free(runs.names);
+    free(header);
+    if (!ok) {
+        return 1;
+    }
+
+    printf("Runs: %d of up to %zu MB, sorted in %.3f s\n", gen.runs, budget >> 20, gen.sort_seconds);
+    print_phase("Run generation", &gen);
+    if (merge.runs) {
+        printf("Merges: %d, up to %d runs each\n", merge.runs, merge_fanin(budget));
+        print_phase("Merge", &merge);
+    }
+    PhaseStats total = {gen.seconds + merge.seconds, 0, gen.bytes_read + merge.bytes_read,
+                        gen.bytes_written + merge.bytes_written, 0};
+    print_phase("Total", &total);
+    return 0;
+}
@@ -0,0 +1,203 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+// Lower-bound search over sorted int arrays: every function finds the
+// first element that is not less than the key, so a key is present when
+// that element equals it.
+//   lower_bound_plain        textbook binary search, for comparison
+//   lower_bound_branchless   same probes, but the next range is picked
+//                            without a branch
+//   Eytzinger                the array stored in breadth-first tree order,
+//                            so the next four levels share a cache line
+//                            that can be prefetched early
+// The _batch versions walk SEARCH_BATCH queries down the array in
+// lockstep. Their loads don't depend on each other, so the CPU keeps
+// many cache misses in flight instead of waiting for one at a time.
+
+// Uses posix_memalign: define _POSIX_C_SOURCE 200809L before any #include.
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#define SEARCH_BATCH 16        // Queries walked down together
+#define EYTZINGER_ALIGN 64     // Cache line, so a prefetch covers 16 whole nodes
+
+#ifdef __GNUC__
+#define SEARCH_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define SEARCH_PREFETCH(p) ((void)0)
+#endif
+
+// ---------------------------------------------------------------
+// Sorted array
+// ---------------------------------------------------------------
+
+// Index of the first element >= key, or n if there is none.
+// lo + (hi - lo) / 2 can't overflow the way (left + right) / 2 does.
+static size_t lower_bound_plain(const int* arr, size_t n, int key) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (arr[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Same result as lower_bound_plain. The range only ever shrinks by half
+// its length, so the loop count depends on n alone and the one
+// comparison per level is folded into arithmetic (GCC turns the obvious
+// ternary back into a branch).
+static size_t lower_bound_branchless(const int* arr, size_t n, int key) {
+    if (n == 0) {
+        return 0;
+    }
+    const int* base = arr;
+    while (n > 1) {
+        size_t half = n / 2, next = (n - half) / 2;
+        // Both places the next probe can land (give or take one element)
+        SEARCH_PREFETCH(base + next);
+        SEARCH_PREFETCH(base + half + next);
+        base += (size_t)(base[half - 1] < key) * half;
+        n -= half;
+    }
+    return (size_t)(base - arr) + (*base < key);
+}
+
+// lower_bound_branchless for keys[0..count), results in out
+static void lower_bound_batch(const int* arr, size_t n, const int* keys, size_t count, size_t* out) {
+    const int* base[SEARCH_BATCH];
+    for (size_t start = 0; start < count; start += SEARCH_BATCH) {
+        size_t m = count - start < SEARCH_BATCH ? count - start : SEARCH_BATCH;
+        const int* k = keys + start;
+        if (n == 0) {
+            for (size_t i = 0; i < m; i++) out[start + i] = 0;
+            continue;
+        }
+        for (size_t i = 0; i < m; i++) base[i] = arr;
+        size_t len = n;
+        while (len > 1) {
+            size_t half = len / 2;
+            for (size_t i = 0; i < m; i++) {
+                base[i] += (size_t)(base[i][half - 1] < k[i]) * half;
+            }
+            len -= half;
+            // Fetch the next level for the whole group before reading any of it
+            for (size_t i = 0; i < m; i++) {
+                SEARCH_PREFETCH(base[i] + len / 2);
+            }
+        }
+        for (size_t i = 0; i < m; i++) {
+            out[start + i] = (size_t)(base[i] - arr) + (*base[i] < k[i]);
+        }
+    }
+}
+
+// ---------------------------------------------------------------
+// Eytzinger layout
+// ---------------------------------------------------------------
+
+// tree[1] is the root and node k has children 2k and 2k + 1; tree[0] is
+// unused. A search result is a node number, 0 meaning every element is
+// less than the key.
+typedef struct {
+    int* tree;
+    size_t n;
+} Eytzinger;
+
+// Fill tree in order from the sorted array; returns the next input index
+static size_t eytzinger_fill(int* tree, size_t n, const int* sorted, size_t i, size_t k) {
+    // Walk down the left spine iteratively and recurse only to the right,
+    // so the depth stays at the tree height
+    while (k <= n) {
+        i = eytzinger_fill(tree, n, sorted, i, 2 * k);
+        tree[k] = sorted[i++];
+        k = 2 * k + 1;
+    }
+    return i;
+}
+
+// Build from a sorted array. Returns NULL if memory runs out.
+static Eytzinger* eytzinger_create(const int* sorted, size_t n) {
+    Eytzinger* e = malloc(sizeof(Eytzinger));
+    if (!e) {
+        return NULL;
+    }
+    void* tree;
+    if (posix_memalign(&tree, EYTZINGER_ALIGN, (n + 1) * sizeof(int)) != 0) {
+        free(e);
+        return NULL;
+    }
+    e->tree = tree;
+    e->n = n;
+    e->tree[0] = 0;
+    eytzinger_fill(e->tree, n, sorted, 0, 1);
+    return e;
+}
+
+static void eytzinger_destroy(Eytzinger* e) {
+    if (e) {
+        free(e->tree);
+        free(e);
+    }
+}
+
+// The descent went right at every node less than the key and left at the
+// answer, then only right again: drop those trailing right turns (1 bits)
+// and the left turn (one 0 bit) to get back to the answer
+static inline size_t eytzinger_answer(size_t k) {
+#ifdef __GNUC__
+    return k >> (__builtin_ctzll(~(unsigned long long)k) + 1);
+#else
+    while (k & 1) k >>= 1;
+    return k >> 1;
+#endif
+}
+
+// Node holding the first element >= key, or 0 if there is none
+static size_t eytzinger_lower_bound(const Eytzinger* e, int key) {
+    const int* tree = e->tree;
+    size_t k = 1;
+    while (k <= e->n) {
+        // Node 16k starts the cache line holding its descendants four
+        // levels down; the prefetch lands before the loop gets there
+        SEARCH_PREFETCH(tree + 16 * k);
+        k = 2 * k + (tree[k] < key);
+    }
+    return eytzinger_answer(k);
+}
+
+// eytzinger_lower_bound for keys[0..count), results in out
+static void eytzinger_batch(const Eytzinger* e, const int* keys, size_t count, size_t* out) {
+    const int* tree = e->tree;
+    size_t n = e->n;
+    // Levels every search gets through; at most one partial level is left
+    int levels = 0;
+    while (((size_t)2 << levels) - 1 <= n) levels++;
+
+    size_t node[SEARCH_BATCH];
+    for (size_t start = 0; start < count; start += SEARCH_BATCH) {
+        size_t m = count - start < SEARCH_BATCH ? count - start : SEARCH_BATCH;
+        const int* k = keys + start;
+        for (size_t i = 0; i < m; i++) node[i] = 1;
+        for (int level = 0; level < levels; level++) {
+            for (size_t i = 0; i < m; i++) {
+                SEARCH_PREFETCH(tree + 16 * node[i]);
+            }
+            for (size_t i = 0; i < m; i++) {
+                node[i] = 2 * node[i] + (tree[node[i]] < k[i]);
+            }
+        }
+        for (size_t i = 0; i < m; i++) {
+            if (node[i] <= n) {
+                node[i] = 2 * node[i] + (tree[node[i]] < k[i]);
+            }
+            out[start + i] = eytzinger_answer(node[i]);
+        }
+    }
+}
+
+#endif // SEARCH_H
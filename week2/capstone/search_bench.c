@@ -0,0 +1,266 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "search.h"
+
+// Time the searches in search.h against plain binary search, from arrays
+// that fit in L1 up to ones far bigger than the last level cache.
+// The array holds the odd numbers 1, 3, 5, ... and the keys are random
+// in [0, 2n], so about half of them are present.
+
+#define DEFAULT_SIZES "1k,8k,64k,1M,16M,256M"
+#define DEFAULT_QUERIES 1000000
+#define DEFAULT_REPS 5
+#define MAX_LIST 32
+#define MAX_ELEMENTS ((size_t)INT32_MAX / 2)  // Largest n whose values fit in an int
+
+typedef struct {
+    const int* arr;
+    size_t n;
+    const Eytzinger* eytzinger;
+} SearchData;
+
+typedef struct {
+    const char* name;
+    void (*run)(const SearchData* data, const int* keys, size_t count, size_t* out);
+    int eytzinger;  // Results are tree nodes rather than array indexes
+} Method;
+
+static void run_plain(const SearchData* data, const int* keys, size_t count, size_t* out) {
+    for (size_t i = 0; i < count; i++) out[i] = lower_bound_plain(data->arr, data->n, keys[i]);
+}
+
+static void run_branchless(const SearchData* data, const int* keys, size_t count, size_t* out) {
+    for (size_t i = 0; i < count; i++) out[i] = lower_bound_branchless(data->arr, data->n, keys[i]);
+}
+
+static void run_branchless_batch(const SearchData* data, const int* keys, size_t count, size_t* out) {
+    lower_bound_batch(data->arr, data->n, keys, count, out);
+}
+
+static void run_eytzinger(const SearchData* data, const int* keys, size_t count, size_t* out) {
+    for (size_t i = 0; i < count; i++) out[i] = eytzinger_lower_bound(data->eytzinger, keys[i]);
+}
+
+static void run_eytzinger_batch(const SearchData* data, const int* keys, size_t count, size_t* out) {
+    eytzinger_batch(data->eytzinger, keys, count, out);
+}
+
+// The first method is the baseline for the speedup column
+static const Method methods[] = {
+    {"plain", run_plain, 0},
+    {"branchless", run_branchless, 0},
+    {"branchless-batch", run_branchless_batch, 0},
+    {"eytzinger", run_eytzinger, 1},
+    {"eytzinger-batch", run_eytzinger_batch, 1},
+};
+#define METHOD_COUNT (int)(sizeof(methods) / sizeof(methods[0]))
+
+// ---------------------------------------------------------------
+// Helpers
+// ---------------------------------------------------------------
+
+// Wall time from a monotonic clock
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// xorshift64*, as in time.c
+static inline uint64_t next_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Parse a count with an optional k, M or G suffix (powers of two here,
+// since the sizes are meant to line up with cache sizes)
+static int parse_count(const char* text, size_t* value) {
+    char* end;
+    double v = strtod(text, &end);
+    if (*end == 'k' || *end == 'K') { v *= 1 << 10; end++; }
+    else if (*end == 'm' || *end == 'M') { v *= 1 << 20; end++; }
+    else if (*end == 'g' || *end == 'G') { v *= 1 << 30; end++; }
+    if (end == text || *end != '\0' || v < 1) {
+        return 0;
+    }
+    *value = (size_t)v;
+    return 1;
+}
+
+static void print_bytes(char* text, size_t size, size_t bytes) {
+    if (bytes >= (size_t)1 << 30) snprintf(text, size, "%.1f GB", bytes / (double)(1 << 30));
+    else if (bytes >= (size_t)1 << 20) snprintf(text, size, "%.1f MB", bytes / (double)(1 << 20));
+    else snprintf(text, size, "%.1f KB", bytes / 1024.0);
+}
+
+static int column_width(const Method* method) {
+    int width = (int)strlen(method->name);
+    return width < 9 ? 9 : width;
+}
+
+// Value a result points at, or -1 when no element was >= the key
+static long long found_value(const SearchData* data, const Method* method, size_t result) {
+    if (method->eytzinger) {
+        return result ? data->eytzinger->tree[result] : -1;
+    }
+    return result < data->n ? data->arr[result] : -1;
+}
+
+// ---------------------------------------------------------------
+// Benchmark
+// ---------------------------------------------------------------
+
+// Time every method on one array size, printing a row and appending
+// to csv if given. Returns the number of methods that gave a wrong answer.
+static int benchmark_size(size_t n, size_t queries, int reps, uint64_t seed, FILE* csv) {
+    int* arr = malloc(n * sizeof(int));
+    int* keys = malloc(queries * sizeof(int));
+    size_t* out = malloc(queries * sizeof(size_t));
+    size_t* expected = malloc(queries * sizeof(size_t));
+    double* times = malloc(reps * sizeof(double));
+    Eytzinger* eytzinger = NULL;
+    if (arr && keys && out && expected && times) {
+        for (size_t i = 0; i < n; i++) arr[i] = (int)(2 * i + 1);
+        eytzinger = eytzinger_create(arr, n);
+    }
+    if (!eytzinger) {
+        printf("Error: Can't allocate memory for %zu elements!\n", n);
+        free(arr);
+        free(keys);
+        free(out);
+        free(expected);
+        free(times);
+        return 1;
+    }
+    uint64_t state = seed ? seed : 1;
+    for (size_t i = 0; i < queries; i++) keys[i] = (int)(next_random(&state) % (2 * n + 1));
+    SearchData data = {arr, n, eytzinger};
+    for (size_t i = 0; i < queries; i++) expected[i] = lower_bound_plain(arr, n, keys[i]);
+    memset(out, 0, queries * sizeof(size_t));  // Fault the pages in outside the timing
+
+    char bytes[32];
+    print_bytes(bytes, sizeof(bytes), n * sizeof(int));
+    printf("%10zu %10s", n, bytes);
+    int failures = 0;
+    double baseline = 0.0;
+    for (int m = 0; m < METHOD_COUNT; m++) {
+        int ok = 1;
+        for (int rep = 0; rep < reps; rep++) {
+            double start = now_seconds();
+            methods[m].run(&data, keys, queries, out);
+            times[rep] = now_seconds() - start;
+            for (size_t i = 0; ok && i < queries; i++) {
+                ok = found_value(&data, &methods[m], out[i]) == found_value(&data, &methods[0], expected[i]);
+            }
+        }
+        qsort(times, reps, sizeof(double), compare_doubles);
+        double ns = times[reps / 2] * 1e9 / queries;
+        if (m == 0) baseline = ns;
+        failures += !ok;
+        printf(" %*.1f%s", column_width(&methods[m]) - 1, ns, ok ? " " : "!");
+        if (csv) {
+            fprintf(csv, "%s,%zu,%zu,%zu,%.3f,%.3f,%d\n", methods[m].name, n, n * sizeof(int), queries,
+                    ns, baseline / ns, ok);
+        }
+    }
+    printf("\n");
+
+    eytzinger_destroy(eytzinger);
+    free(arr);
+    free(keys);
+    free(out);
+    free(expected);
+    free(times);
+    return failures;
+}
+
+// ---------------------------------------------------------------
+// Command line
+// ---------------------------------------------------------------
+
+static void print_usage(const char* program) {
+    printf("Usage: %s [--sizes N,...] [--queries N] [--reps N] [--seed N] [--csv out.csv]\n", program);
+    printf("Sizes are element counts with k, M or G suffixes (powers of two, default %s);\n",
+           DEFAULT_SIZES);
+    printf("each element is 4 bytes, so 256M is a 1 GB array\n");
+    printf("Prints the median ns per query of each method; ! marks a wrong answer\n");
+}
+
+int main(int argc, char* argv[]) {
+    char sizes_arg[1024] = DEFAULT_SIZES;
+    const char* csv_name = NULL;
+    size_t queries = DEFAULT_QUERIES;
+    int reps = DEFAULT_REPS;
+    uint64_t seed = 1;
+
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        const char* value = argv[i + 1];
+        int ok = 1;
+        if (strcmp(argv[i], "--sizes") == 0) snprintf(sizes_arg, sizeof(sizes_arg), "%s", value);
+        else if (strcmp(argv[i], "--queries") == 0) ok = parse_count(value, &queries);
+        else if (strcmp(argv[i], "--reps") == 0) ok = (reps = atoi(value)) >= 1;
+        else if (strcmp(argv[i], "--seed") == 0) seed = strtoull(value, NULL, 10);
+        else if (strcmp(argv[i], "--csv") == 0) csv_name = value;
+        else ok = 0;
+        if (!ok) {
+            printf("Error: Bad option %s %s\n", argv[i], value);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    size_t sizes[MAX_LIST];
+    int size_count = 0;
+    for (char* item = strtok(sizes_arg, ","); item && size_count < MAX_LIST; item = strtok(NULL, ",")) {
+        if (!parse_count(item, &sizes[size_count]) || sizes[size_count] > MAX_ELEMENTS) {
+            printf("Error: Bad size %s\n", item);
+            return 1;
+        }
+        size_count++;
+    }
+
+    FILE* csv = NULL;
+    if (csv_name) {
+        csv = fopen(csv_name, "w");
+        if (!csv) {
+            printf("Error: Can't open %s!\n", csv_name);
+            return 1;
+        }
+        fprintf(csv, "method,size,bytes,queries,ns_per_query,speedup,correct\n");
+    }
+
+    printf("%10s %10s", "elements", "bytes");
+    for (int m = 0; m < METHOD_COUNT; m++) {
+        printf(" %*s", column_width(&methods[m]), methods[m].name);
+    }
+    printf("\n");
+    int failures = 0;
+    for (int s = 0; s < size_count; s++) {
+        failures += benchmark_size(sizes[s], queries, reps, seed, csv);
+    }
+    printf("(ns per query; %zu queries, median of %d)\n", queries, reps);
+
+    if (csv) {
+        fclose(csv);
+    }
+    if (failures) {
+        printf("Error: %d wrong results!\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,267 @@
+#ifndef SORT_AVX2_H
+#define SORT_AVX2_H
+
+// AVX2 sorting kernels for 32-bit ints. Up to 64 values are sorted in
+// 1, 2, 4 or 8 registers. Eight registers are sorted by a network across
+// the registers (one per column) and a transpose into sorted rows; fewer
+// are each sorted by a network inside the register. Bitonic merges then
+// combine the sorted registers. The same bitonic merge, eight values at
+// a time, merges long sorted runs. A compare-and-mask scan filters
+// values against a top-k threshold.
+// The functions are compiled for AVX2 whatever the -m flags say, so only
+// call them when avx2_available() says the CPU has it. SORT_AVX2 is
+// defined when the kernels exist at all (x86 with GCC or Clang).
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SORT_AVX2 1
+
+#include <immintrin.h>
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define NETWORK_MAX 64  // Most values sort_network_i32 sorts at once
+
+static int avx2_available(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+}
+
+// Compare-exchange of whole registers: a gets the lane-wise minimum
+#define CSWAP(a, b) do { \
+    __m256i lo_ = _mm256_min_epi32(a, b); \
+    b = _mm256_max_epi32(a, b); \
+    a = lo_; \
+} while (0)
+
+// One layer of a network inside a register: each lane meets the lane
+// named in perm, and the lanes set in mask keep the larger value
+#define LANE_LAYER(v, perm, mask) do { \
+    __m256i t_ = _mm256_permutevar8x32_epi32(v, perm); \
+    v = _mm256_blend_epi32(_mm256_min_epi32(v, t_), _mm256_max_epi32(v, t_), mask); \
+} while (0)
+
+// Sort one register with the 19-comparator, depth-6 network for 8 inputs
+static inline TARGET_AVX2 __m256i sort8_register(__m256i v) {
+    LANE_LAYER(v, _mm256_setr_epi32(2, 3, 0, 1, 6, 7, 4, 5), 0xCC);
+    LANE_LAYER(v, _mm256_setr_epi32(4, 5, 6, 7, 0, 1, 2, 3), 0xF0);
+    LANE_LAYER(v, _mm256_setr_epi32(1, 0, 3, 2, 5, 4, 7, 6), 0xAA);
+    LANE_LAYER(v, _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7), 0x30);
+    LANE_LAYER(v, _mm256_setr_epi32(0, 4, 2, 6, 1, 5, 3, 7), 0x50);
+    LANE_LAYER(v, _mm256_setr_epi32(0, 2, 1, 4, 3, 6, 5, 7), 0x54);
+    return v;
+}
+
+static inline TARGET_AVX2 __m256i reverse8(__m256i v) {
+    return _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+// Sort a bitonic register: compare lanes 4, 2 and 1 apart
+static inline TARGET_AVX2 __m256i bitonic_sort8(__m256i v) {
+    __m256i t = _mm256_permute2x128_si256(v, v, 1);
+    v = _mm256_blend_epi32(_mm256_min_epi32(v, t), _mm256_max_epi32(v, t), 0xF0);
+    t = _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+    v = _mm256_blend_epi32(_mm256_min_epi32(v, t), _mm256_max_epi32(v, t), 0xCC);
+    t = _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm256_blend_epi32(_mm256_min_epi32(v, t), _mm256_max_epi32(v, t), 0xAA);
+}
+
+// Merge two sorted registers: a gets the lowest eight, b the highest
+static inline TARGET_AVX2 void merge8(__m256i* a, __m256i* b) {
+    __m256i r = reverse8(*b);
+    __m256i lo = _mm256_min_epi32(*a, r);
+    __m256i hi = _mm256_max_epi32(*a, r);
+    *a = bitonic_sort8(lo);
+    *b = bitonic_sort8(hi);
+}
+
+// v[0, k) and v[k, 2k) are sorted runs of k registers; merge them into one.
+// Reversing the second run makes the whole thing bitonic, then half
+// cleaners at register distances k..1 and a sort inside each register.
+static inline TARGET_AVX2 void merge_registers(__m256i* v, int k) {
+    for (int i = 0; i < k / 2; i++) {
+        __m256i t = v[k + i];
+        v[k + i] = v[2 * k - 1 - i];
+        v[2 * k - 1 - i] = t;
+    }
+    for (int i = k; i < 2 * k; i++)
+        v[i] = reverse8(v[i]);
+    for (int d = k; d >= 1; d /= 2)
+        for (int s = 0; s < 2 * k; s += 2 * d)
+            for (int i = s; i < s + d; i++)
+                CSWAP(v[i], v[i + d]);
+    for (int i = 0; i < 2 * k; i++)
+        v[i] = bitonic_sort8(v[i]);
+}
+
+// Sort 64 values held as eight registers of eight
+static inline TARGET_AVX2 void sort64_registers(__m256i* r) {
+    // Batcher's 19-comparator network sorts each column
+    CSWAP(r[0], r[1]); CSWAP(r[2], r[3]); CSWAP(r[4], r[5]); CSWAP(r[6], r[7]);
+    CSWAP(r[0], r[2]); CSWAP(r[1], r[3]); CSWAP(r[4], r[6]); CSWAP(r[5], r[7]);
+    CSWAP(r[1], r[2]); CSWAP(r[5], r[6]);
+    CSWAP(r[0], r[4]); CSWAP(r[1], r[5]); CSWAP(r[2], r[6]); CSWAP(r[3], r[7]);
+    CSWAP(r[2], r[4]); CSWAP(r[3], r[5]);
+    CSWAP(r[1], r[2]); CSWAP(r[3], r[4]); CSWAP(r[5], r[6]);
+
+    // Transpose, so each register holds one sorted column
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]), t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]), t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]), t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]), t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7);
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+
+    // Rows of 8 -> 16 -> 32 -> 64
+    for (int k = 1; k < 8; k *= 2)
+        for (int s = 0; s < 8; s += 2 * k)
+            merge_registers(r + s, k);
+}
+
+// Sort n <= 64 ints in the fewest registers that hold them. The last
+// register is padded with INT_MAX, which sorts to the end and is never
+// stored back.
+static TARGET_AVX2 void sort_network_i32(int* p, size_t n) {
+    __m256i r[8];
+    const __m256i pad = _mm256_set1_epi32(INT_MAX);
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    int regs = n <= 8 ? 1 : n <= 16 ? 2 : n <= 32 ? 4 : 8;
+    for (int i = 0; i < regs; i++) {
+        size_t base = (size_t)i * 8;
+        if (base + 8 <= n) {
+            r[i] = _mm256_loadu_si256((const __m256i*)(p + base));
+        } else if (base < n) {
+            __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)(n - base)), lane);
+            r[i] = _mm256_blendv_epi8(pad, _mm256_maskload_epi32(p + base, mask), mask);
+        } else {
+            r[i] = pad;
+        }
+    }
+    if (regs == 8) {
+        sort64_registers(r);
+    } else {
+        for (int i = 0; i < regs; i++)
+            r[i] = sort8_register(r[i]);
+        for (int k = 1; k < regs; k *= 2)
+            for (int s = 0; s < regs; s += 2 * k)
+                merge_registers(r + s, k);
+    }
+    for (int i = 0; i < regs; i++) {
+        size_t base = (size_t)i * 8;
+        if (base + 8 <= n) {
+            _mm256_storeu_si256((__m256i*)(p + base), r[i]);
+        } else if (base < n) {
+            __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)(n - base)), lane);
+            _mm256_maskstore_epi32(p + base, mask, r[i]);
+        }
+    }
+}
+
+// Merge sorted a[0, na) and b[0, nb) into dst. One register holds the
+// eight largest values seen so far; each step merges it with the next
+// eight from whichever input has the smaller head, and the low half is
+// final. The last few values are merged one at a time.
+static TARGET_AVX2 void merge_avx2(const int* a, size_t na, const int* b, size_t nb, int* dst) {
+    size_t ia = 0, ib = 0;
+    int tail[8];
+    size_t it = 0, nt = 0;
+    if (na >= 8 && nb >= 8) {
+        __m256i lo = _mm256_loadu_si256((const __m256i*)a);
+        __m256i hi = _mm256_loadu_si256((const __m256i*)b);
+        ia = ib = 8;
+        merge8(&lo, &hi);
+        _mm256_storeu_si256((__m256i*)dst, lo);
+        dst += 8;
+        while (ia + 8 <= na && ib + 8 <= nb) {
+            if (a[ia] < b[ib]) {
+                lo = _mm256_loadu_si256((const __m256i*)(a + ia));
+                ia += 8;
+            } else {
+                lo = _mm256_loadu_si256((const __m256i*)(b + ib));
+                ib += 8;
+            }
+            merge8(&lo, &hi);
+            _mm256_storeu_si256((__m256i*)dst, lo);
+            dst += 8;
+        }
+        _mm256_storeu_si256((__m256i*)tail, hi);
+        nt = 8;
+    }
+    // Three-way merge of what's left: the carried register and both inputs
+    while (ia < na || ib < nb || it < nt) {
+        int best = 0;  // 0 = a, 1 = b, 2 = tail
+        int v = INT_MAX;
+        if (ia < na) v = a[ia];
+        if (ib < nb && (ia >= na || b[ib] < v)) { best = 1; v = b[ib]; }
+        if (it < nt && ((ia >= na && ib >= nb) || tail[it] < v)) { best = 2; v = tail[it]; }
+        *dst++ = v;
+        if (best == 0) ia++;
+        else if (best == 1) ib++;
+        else it++;
+    }
+}
+
+// Bottom-up merge sort with network-sorted runs of 64 and vector merges
+static TARGET_AVX2 void merge_sort_avx2(int arr[], int buf[], size_t n) {
+    for (size_t lo = 0; lo < n; lo += NETWORK_MAX)
+        sort_network_i32(arr + lo, n - lo < NETWORK_MAX ? n - lo : NETWORK_MAX);
+
+    int* src = arr;
+    int* dst = buf;
+    for (size_t width = NETWORK_MAX; width < n; width *= 2) {
+        int ordered = 1;
+        for (size_t mid = width; mid < n && ordered; mid += 2 * width)
+            ordered = !(src[mid] < src[mid - 1]);
+        if (ordered)
+            continue;
+
+        for (size_t lo = 0; lo < n; lo += 2 * width) {
+            size_t mid = lo + width < n ? lo + width : n;
+            size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+            if (mid == hi || !(src[mid] < src[mid - 1]))
+                memcpy(dst + lo, src + lo, (hi - lo) * sizeof(int));
+            else
+                merge_avx2(src + lo, mid - lo, src + mid, hi - mid, dst + lo);
+        }
+        int* t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != arr)
+        memcpy(arr, src, n * sizeof(int));
+}
+
+// Offset of the first of p[0..n) below threshold, or n if there is none.
+// Eight values per compare: the filter in front of a top-k heap, where
+// almost nothing gets past the threshold once the heap has filled.
+static TARGET_AVX2 size_t first_below_avx2(const int* p, size_t n, int threshold) {
+    __m256i t = _mm256_set1_epi32(threshold);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_cmpgt_epi32(t, _mm256_loadu_si256((const __m256i*)(p + i)));
+        __m256i b = _mm256_cmpgt_epi32(t, _mm256_loadu_si256((const __m256i*)(p + i + 8)));
+        unsigned mask = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(a)) |
+                        (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(b)) << 8;
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    for (; i < n && !(p[i] < threshold); i++) {}
+    return i;
+}
+
+#undef CSWAP
+#undef LANE_LAYER
+#endif // x86 GCC/Clang
+
+#endif // SORT_AVX2_H
@@ -0,0 +1,916 @@
+// Sorting routines written once and instantiated for each element type.
+// Define these before every #include of this file:
+//   SORT_T       element type (int, int64_t, double, ...)
+//   SORT_SUFFIX  appended to every function name (_i32, _i64, ...)
+//   SORT_KEY_T   unsigned integer type the radix sorts work on
+//   SORT_KEY(x)  maps an element to a SORT_KEY_T with the same ordering
+// so including it with SORT_T=int and SORT_SUFFIX=_i32 gives
+// bubble_sort_i32(int arr[], size_t n) and so on.
+
+#if !defined(SORT_T) || !defined(SORT_SUFFIX) || !defined(SORT_KEY_T) || !defined(SORT_KEY)
+#error "Define SORT_T, SORT_SUFFIX, SORT_KEY_T and SORT_KEY before including sort_template.h"
+#endif
+
+#ifndef SORT_TEMPLATE_NAMES
+#define SORT_TEMPLATE_NAMES
+#define SORT_CAT_(a, b) a##b
+#define SORT_CAT(a, b) SORT_CAT_(a, b)
+#define SORT_FN(name) SORT_CAT(name, SORT_SUFFIX)
+#define MERGE_RUN 32  // Bottom-up merge sort starts from insertion-sorted runs this long
+#define PAR_CUTOFF 65536    // Parallel sorts and merges hand smaller ranges to the sequential code
+#define SAMPLE_OVERSAMPLE 32  // Sample sort draws this many candidates per splitter
+#define SAMPLE_BUCKETS_PER_THREAD 8
+#define RADIX_BITS 11      // LSD digit: 2048 counters still fit in L1
+#define RADIX_MAX_PASSES 6  // Enough 11-bit digits for a 64-bit key
+#define FLAG_BITS 8         // MSD digit
+#define FLAG_SMALL 64       // MSD buckets this small are insertion sorted
+#define PDQ_INSERTION 24    // pdqsort: ranges shorter than this are insertion sorted
+#define PDQ_NINTHER 128     // Ranges longer than this take the ninther as pivot
+#define PDQ_PARTIAL_LIMIT 8 // Element moves allowed when betting a range is nearly sorted
+#define PDQ_BLOCK 64        // Elements classified per block in the branchless partition
+#include "thread_pool.h"
+#endif
+
+// Bubble Sort
+static void SORT_FN(bubble_sort)(SORT_T arr[], size_t n) {
+    for (size_t i = 0; i + 1 < n; i++)
+        for (size_t j = 0; j + 1 < n - i; j++)
+            if (arr[j] > arr[j+1]) {
+                SORT_T temp = arr[j];
+                arr[j] = arr[j+1];
+                arr[j+1] = temp;
+            }
+}
+
+// Selection Sort
+static void SORT_FN(selection_sort)(SORT_T arr[], size_t n) {
+    for (size_t i = 0; i + 1 < n; i++) {
+        size_t min = i;
+        for (size_t j = i+1; j < n; j++)
+            if (arr[j] < arr[min])
+                min = j;
+        SORT_T temp = arr[i];
+        arr[i] = arr[min];
+        arr[min] = temp;
+    }
+}
+
+// Merge Sort (top-down, both halves copied into stack arrays at every level)
+static void SORT_FN(merge)(SORT_T arr[], long l, long m, long r) {
+    long n1 = m - l + 1;
+    long n2 = r - m;
+    SORT_T L[n1], R[n2];
+
+    for (long i = 0; i < n1; i++) L[i] = arr[l + i];
+    for (long j = 0; j < n2; j++) R[j] = arr[m + 1 + j];
+
+    long i = 0, j = 0, k = l;
+    while (i < n1 && j < n2)
+        arr[k++] = (L[i] <= R[j]) ? L[i++] : R[j++];
+
+    while (i < n1) arr[k++] = L[i++];
+    while (j < n2) arr[k++] = R[j++];
+}
+
+static void SORT_FN(merge_sort)(SORT_T arr[], long l, long r) {
+    if (l < r) {
+        long m = l + (r - l) / 2;
+        SORT_FN(merge_sort)(arr, l, m);
+        SORT_FN(merge_sort)(arr, m + 1, r);
+        SORT_FN(merge)(arr, l, m, r);
+    }
+}
+
+// Insertion Sort (for short runs)
+static void SORT_FN(insertion_sort)(SORT_T arr[], size_t n) {
+    for (size_t i = 1; i < n; i++) {
+        SORT_T key = arr[i];
+        size_t j = i;
+        while (j > 0 && arr[j-1] > key) {
+            arr[j] = arr[j-1];
+            j--;
+        }
+        arr[j] = key;
+    }
+}
+
+// Merge src[lo, mid) and src[mid, hi) into dst[lo, hi)
+static void SORT_FN(merge_into)(const SORT_T src[], SORT_T dst[], size_t lo, size_t mid, size_t hi) {
+    size_t i = lo, j = mid, k = lo;
+    while (i < mid && j < hi)
+        dst[k++] = (src[j] < src[i]) ? src[j++] : src[i++];
+    while (i < mid) dst[k++] = src[i++];
+    while (j < hi) dst[k++] = src[j++];
+}
+
+// Merge Sort (bottom-up). Runs of MERGE_RUN are insertion sorted, then
+// each pass merges pairs of runs from one array into the other, using a
+// single scratch buffer of n elements and no recursion.
+static void SORT_FN(merge_sort_bottom_up)(SORT_T arr[], SORT_T buf[], size_t n) {
+    for (size_t lo = 0; lo < n; lo += MERGE_RUN)
+        SORT_FN(insertion_sort)(arr + lo, n - lo < MERGE_RUN ? n - lo : MERGE_RUN);
+
+    SORT_T* src = arr;
+    SORT_T* dst = buf;
+    for (size_t width = MERGE_RUN; width < n; width *= 2) {
+        // When every pair is already in order the pass is a no-op, so skip it without copying
+        int ordered = 1;
+        for (size_t mid = width; mid < n && ordered; mid += 2 * width)
+            ordered = !(src[mid] < src[mid-1]);
+        if (ordered)
+            continue;
+
+        for (size_t lo = 0; lo < n; lo += 2 * width) {
+            size_t mid = lo + width < n ? lo + width : n;
+            size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+            if (mid == hi || !(src[mid] < src[mid-1]))
+                memcpy(dst + lo, src + lo, (hi - lo) * sizeof(SORT_T));  // Halves already in order
+            else
+                SORT_FN(merge_into)(src, dst, lo, mid, hi);
+        }
+        SORT_T* t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != arr)
+        memcpy(arr, src, n * sizeof(SORT_T));
+}
+
+// ---------------------------------------------------------------
+// Parallel merge sort: the halves are sorted as separate pool tasks down
+// to PAR_CUTOFF, then merged in parallel by splitting both inputs at the
+// middle of the longer one (binary search finds the split in the other)
+// ---------------------------------------------------------------
+
+typedef struct {
+    ThreadPool* pool;
+    const SORT_T* a;
+    size_t na;
+    const SORT_T* b;
+    size_t nb;
+    SORT_T* dst;
+} SORT_FN(MergeJob);
+
+// First index in arr[0, n) whose element is not less than key (or greater, if after_equal)
+static size_t SORT_FN(search_split)(const SORT_T arr[], size_t n, SORT_T key, int after_equal) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (arr[mid] < key || (after_equal && !(key < arr[mid])))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void SORT_FN(par_merge)(void* arg) {
+    SORT_FN(MergeJob)* job = arg;
+    if (job->na + job->nb <= PAR_CUTOFF) {
+        size_t i = 0, j = 0, k = 0;
+        while (i < job->na && j < job->nb)
+            job->dst[k++] = (job->b[j] < job->a[i]) ? job->b[j++] : job->a[i++];
+        while (i < job->na) job->dst[k++] = job->a[i++];
+        while (j < job->nb) job->dst[k++] = job->b[j++];
+        return;
+    }
+    // Equal elements from a stay ahead of those from b, so the merge remains stable
+    size_t ma, mb;
+    if (job->na >= job->nb) {
+        ma = job->na / 2;
+        mb = SORT_FN(search_split)(job->b, job->nb, job->a[ma], 0);
+    } else {
+        mb = job->nb / 2;
+        ma = SORT_FN(search_split)(job->a, job->na, job->b[mb], 1);
+    }
+    SORT_FN(MergeJob) left = {job->pool, job->a, ma, job->b, mb, job->dst};
+    SORT_FN(MergeJob) right = {job->pool, job->a + ma, job->na - ma, job->b + mb, job->nb - mb,
+                               job->dst + ma + mb};
+    int pending = 0;
+    pool_submit(job->pool, &pending, SORT_FN(par_merge), &left);
+    SORT_FN(par_merge)(&right);
+    pool_wait(job->pool, &pending);
+}
+
+typedef struct {
+    ThreadPool* pool;
+    SORT_T* src;       // Holds the input
+    SORT_T* other;     // Scratch of the same length
+    size_t n;
+    int into_other;    // Leave the result in 'other' instead of 'src'
+} SORT_FN(SortJob);
+
+// Each level sorts its halves into the array it isn't merging into, so
+// the data moves once per level without copying back
+static void SORT_FN(par_sort)(void* arg) {
+    SORT_FN(SortJob)* job = arg;
+    if (job->n <= PAR_CUTOFF) {
+        SORT_FN(merge_sort_bottom_up)(job->src, job->other, job->n);
+        if (job->into_other)
+            memcpy(job->other, job->src, job->n * sizeof(SORT_T));
+        return;
+    }
+    size_t half = job->n / 2;
+    SORT_FN(SortJob) left = {job->pool, job->src, job->other, half, !job->into_other};
+    SORT_FN(SortJob) right = {job->pool, job->src + half, job->other + half, job->n - half,
+                              !job->into_other};
+    int pending = 0;
+    pool_submit(job->pool, &pending, SORT_FN(par_sort), &left);
+    SORT_FN(par_sort)(&right);
+    pool_wait(job->pool, &pending);
+
+    const SORT_T* from = job->into_other ? job->src : job->other;
+    SORT_T* to = job->into_other ? job->other : job->src;
+    SORT_FN(MergeJob) merge = {job->pool, from, half, from + half, job->n - half, to};
+    SORT_FN(par_merge)(&merge);
+}
+
+static void SORT_FN(parallel_merge_sort)(ThreadPool* pool, SORT_T arr[], SORT_T buf[], size_t n) {
+    SORT_FN(SortJob) job = {pool, arr, buf, n, 0};
+    SORT_FN(par_sort)(&job);
+}
+
+// ---------------------------------------------------------------
+// Parallel sample sort: splitters picked from a random sample divide the
+// values into buckets. Blocks of the input are classified and counted in
+// parallel, scattered into the buffer at their prefix-sum offsets, then
+// every bucket is sorted on its own.
+// ---------------------------------------------------------------
+
+typedef struct {
+    SORT_T* arr;
+    SORT_T* buf;
+    size_t n;
+    SORT_T* splitters;   // buckets - 1 of them, ascending
+    int buckets;
+    int blocks;
+    uint16_t* ids;       // Bucket of every element
+    size_t* counts;      // blocks x buckets: elements of each bucket in each block
+    size_t* bucket_start;  // buckets + 1 offsets into buf
+} SORT_FN(SampleSort);
+
+typedef struct {
+    SORT_FN(SampleSort)* s;
+    int index;  // Block or bucket
+    int phase;
+} SORT_FN(SampleJob);
+
+static void SORT_FN(sample_task)(void* arg) {
+    SORT_FN(SampleJob)* job = arg;
+    SORT_FN(SampleSort)* s = job->s;
+    if (job->phase == 2) {
+        // Sort one bucket, ending up back in arr
+        size_t lo = s->bucket_start[job->index], len = s->bucket_start[job->index + 1] - lo;
+        memcpy(s->arr + lo, s->buf + lo, len * sizeof(SORT_T));
+        SORT_FN(merge_sort_bottom_up)(s->arr + lo, s->buf + lo, len);
+        return;
+    }
+    size_t lo = s->n * job->index / s->blocks, hi = s->n * (job->index + 1) / s->blocks;
+    size_t* counts = s->counts + (size_t)job->index * s->buckets;
+    if (job->phase == 0) {
+        // Bucket = number of splitters <= value, found without branches on the data
+        for (size_t i = lo; i < hi; i++) {
+            SORT_T x = s->arr[i];
+            const SORT_T* base = s->splitters;
+            size_t len = s->buckets - 1;
+            while (len > 1) {
+                size_t half = len / 2;
+                base = !(x < base[half]) ? base + half : base;
+                len -= half;
+            }
+            int id = (int)(base - s->splitters) + !(x < base[0]);
+            s->ids[i] = (uint16_t)id;
+            counts[id]++;
+        }
+    } else {
+        // counts now holds this block's write offset for each bucket
+        for (size_t i = lo; i < hi; i++)
+            s->buf[counts[s->ids[i]]++] = s->arr[i];
+    }
+}
+
+// Run one phase as 'tasks' pool tasks and wait for all of them
+static void SORT_FN(sample_phase)(ThreadPool* pool, SORT_FN(SampleSort)* s, SORT_FN(SampleJob) jobs[],
+                                  int tasks, int phase) {
+    int pending = 0;
+    for (int i = 0; i < tasks; i++) {
+        jobs[i].s = s;
+        jobs[i].index = i;
+        jobs[i].phase = phase;
+        pool_submit(pool, &pending, SORT_FN(sample_task), &jobs[i]);
+    }
+    pool_wait(pool, &pending);
+}
+
+static int SORT_FN(parallel_sample_sort)(ThreadPool* pool, SORT_T arr[], SORT_T buf[], size_t n) {
+    int threads = pool ? pool->threads : 1;
+    int buckets = threads * SAMPLE_BUCKETS_PER_THREAD;
+    if (buckets > UINT16_MAX) buckets = UINT16_MAX;
+    size_t samples = (size_t)buckets * SAMPLE_OVERSAMPLE;
+    if (n < samples || n <= PAR_CUTOFF) {
+        SORT_FN(merge_sort_bottom_up)(arr, buf, n);
+        return 1;
+    }
+
+    SORT_FN(SampleSort) s = {arr, buf, n, NULL, buckets, buckets, NULL, NULL, NULL};
+    SORT_T* sample = malloc(samples * 2 * sizeof(SORT_T));
+    s.splitters = malloc((buckets - 1) * sizeof(SORT_T));
+    s.ids = malloc(n * sizeof(uint16_t));
+    s.counts = calloc((size_t)s.blocks * buckets, sizeof(size_t));
+    s.bucket_start = malloc((buckets + 1) * sizeof(size_t));
+    SORT_FN(SampleJob)* jobs = malloc(buckets * sizeof(SORT_FN(SampleJob)));
+    int ok = sample && s.splitters && s.ids && s.counts && s.bucket_start && jobs;
+    if (ok) {
+        // Fixed seed, so every run of the same input splits the same way
+        uint64_t state = 0x9E3779B97F4A7C15ULL;
+        for (size_t i = 0; i < samples; i++) {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            sample[i] = arr[(state * 0x2545F4914F6CDD1DULL >> 11) % n];
+        }
+        SORT_FN(merge_sort_bottom_up)(sample, sample + samples, samples);
+        for (int i = 1; i < buckets; i++)
+            s.splitters[i - 1] = sample[(size_t)i * SAMPLE_OVERSAMPLE];
+
+        SORT_FN(sample_phase)(pool, &s, jobs, s.blocks, 0);
+        // Bucket-major prefix sums: bucket b of block k lands after bucket b of blocks < k
+        size_t offset = 0;
+        for (int b = 0; b < buckets; b++) {
+            s.bucket_start[b] = offset;
+            for (int k = 0; k < s.blocks; k++) {
+                size_t count = s.counts[(size_t)k * buckets + b];
+                s.counts[(size_t)k * buckets + b] = offset;
+                offset += count;
+            }
+        }
+        s.bucket_start[buckets] = offset;
+        SORT_FN(sample_phase)(pool, &s, jobs, s.blocks, 1);
+        SORT_FN(sample_phase)(pool, &s, jobs, buckets, 2);
+    }
+    free(sample);
+    free(s.splitters);
+    free(s.ids);
+    free(s.counts);
+    free(s.bucket_start);
+    free(jobs);
+    return ok;
+}
+
+// ---------------------------------------------------------------
+// Radix sorts on SORT_KEY(x)
+// ---------------------------------------------------------------
+
+// LSD radix sort: one read of the input counts every digit at once, then
+// each pass scatters stably between arr and buf. A digit whose values are
+// all equal (the high bits of small numbers, say) needs no pass at all.
+static void SORT_FN(radix_sort_lsd)(SORT_T arr[], SORT_T buf[], size_t n) {
+    enum { BUCKETS = 1 << RADIX_BITS };
+    const int passes = (int)((sizeof(SORT_KEY_T) * 8 + RADIX_BITS - 1) / RADIX_BITS);
+    size_t counts[RADIX_MAX_PASSES][BUCKETS] = {{0}};
+    for (size_t i = 0; i < n; i++) {
+        SORT_KEY_T key = SORT_KEY(arr[i]);
+        for (int p = 0; p < passes; p++)
+            counts[p][(key >> (p * RADIX_BITS)) & (BUCKETS - 1)]++;
+    }
+
+    SORT_T* src = arr;
+    SORT_T* dst = buf;
+    for (int p = 0; p < passes; p++) {
+        size_t* count = counts[p];
+        int shift = p * RADIX_BITS;
+        if (n == 0 || count[(SORT_KEY(src[0]) >> shift) & (BUCKETS - 1)] == n)
+            continue;
+        size_t offset = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            size_t c = count[b];
+            count[b] = offset;
+            offset += c;
+        }
+        for (size_t i = 0; i < n; i++)
+            dst[count[(SORT_KEY(src[i]) >> shift) & (BUCKETS - 1)]++] = src[i];
+        SORT_T* t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != arr)
+        memcpy(arr, src, n * sizeof(SORT_T));
+}
+
+// MSD radix sort in place (American flag sort): count the current digit,
+// then move every element straight into its bucket by following swap
+// cycles, and recurse into each bucket on the next digit
+static void SORT_FN(flag_sort)(SORT_T arr[], size_t n, int shift) {
+    enum { BUCKETS = 1 << FLAG_BITS };
+    while (n > FLAG_SMALL) {
+        size_t count[BUCKETS] = {0};
+        for (size_t i = 0; i < n; i++)
+            count[(SORT_KEY(arr[i]) >> shift) & (BUCKETS - 1)]++;
+
+        // Everything in one bucket: go on to the next digit without moving anything
+        if (count[(SORT_KEY(arr[0]) >> shift) & (BUCKETS - 1)] == n) {
+            if (shift == 0)
+                return;
+            shift -= FLAG_BITS;
+            continue;
+        }
+
+        size_t head[BUCKETS], tail[BUCKETS], offset = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            head[b] = offset;
+            offset += count[b];
+            tail[b] = offset;
+        }
+        for (int b = 0; b < BUCKETS; b++) {
+            while (head[b] < tail[b]) {
+                SORT_T v = arr[head[b]];
+                int d = (int)((SORT_KEY(v) >> shift) & (BUCKETS - 1));
+                while (d != b) {
+                    SORT_T t = arr[head[d]];
+                    arr[head[d]++] = v;
+                    v = t;
+                    d = (int)((SORT_KEY(v) >> shift) & (BUCKETS - 1));
+                }
+                arr[head[b]++] = v;
+            }
+        }
+        if (shift == 0)
+            return;
+        for (int b = 0; b < BUCKETS; b++)
+            SORT_FN(flag_sort)(arr + tail[b] - count[b], count[b], shift - FLAG_BITS);
+        return;
+    }
+    SORT_FN(insertion_sort)(arr, n);
+}
+
+static void SORT_FN(radix_sort_msd)(SORT_T arr[], size_t n) {
+    SORT_FN(flag_sort)(arr, n, (int)(sizeof(SORT_KEY_T) * 8) - FLAG_BITS);
+}
+
+// ---------------------------------------------------------------
+// Pattern-defeating quicksort (after Orson Peters' pdqsort): in place,
+// median-of-3 or ninther pivots, a branchless block partition, a bet
+// on nearly sorted ranges, equal-key ranges skipped in one pass, and
+// heapsort once too many partitions come out badly unbalanced
+// ---------------------------------------------------------------
+
+static inline void SORT_FN(swap)(SORT_T* a, SORT_T* b) {
+    SORT_T t = *a;
+    *a = *b;
+    *b = t;
+}
+
+static inline void SORT_FN(sort2)(SORT_T* a, SORT_T* b) {
+    if (*b < *a)
+        SORT_FN(swap)(a, b);
+}
+
+static inline void SORT_FN(sort3)(SORT_T* a, SORT_T* b, SORT_T* c) {
+    SORT_FN(sort2)(a, b);
+    SORT_FN(sort2)(b, c);
+    SORT_FN(sort2)(a, b);
+}
+
+// Heapsort: the O(n log n) fallback
+static void SORT_FN(sift_down)(SORT_T arr[], size_t root, size_t n) {
+    SORT_T v = arr[root];
+    size_t child;
+    while ((child = 2 * root + 1) < n) {
+        if (child + 1 < n && arr[child] < arr[child + 1])
+            child++;
+        if (!(v < arr[child]))
+            break;
+        arr[root] = arr[child];
+        root = child;
+    }
+    arr[root] = v;
+}
+
+static void SORT_FN(heap_sort)(SORT_T arr[], size_t n) {
+    for (size_t i = n / 2; i-- > 0;)
+        SORT_FN(sift_down)(arr, i, n);
+    for (size_t end = n; end-- > 1;) {
+        SORT_FN(swap)(&arr[0], &arr[end]);
+        SORT_FN(sift_down)(arr, 0, end);
+    }
+}
+
+// Insertion sort for a range with an element no bigger than any of it
+// just before 'begin', so the inner loop needs no bounds check
+static void SORT_FN(unguarded_insertion_sort)(SORT_T* begin, SORT_T* end) {
+    for (SORT_T* cur = begin + 1; cur < end; cur++) {
+        if (*cur < cur[-1]) {
+            SORT_T v = *cur;
+            SORT_T* sift = cur;
+            do {
+                *sift = sift[-1];
+                sift--;
+            } while (v < sift[-1]);
+            *sift = v;
+        }
+    }
+}
+
+// Insertion sort that gives up (returning 0) after PDQ_PARTIAL_LIMIT moves
+static int SORT_FN(partial_insertion_sort)(SORT_T* begin, SORT_T* end) {
+    size_t moves = 0;
+    for (SORT_T* cur = begin + 1; cur < end; cur++) {
+        if (moves > PDQ_PARTIAL_LIMIT)
+            return 0;
+        if (*cur < cur[-1]) {
+            SORT_T v = *cur;
+            SORT_T* sift = cur;
+            do {
+                *sift = sift[-1];
+                sift--;
+            } while (sift != begin && v < sift[-1]);
+            *sift = v;
+            moves += cur - sift;
+        }
+    }
+    return 1;
+}
+
+// Swap num misplaced pairs found by the block partition. When the counts
+// differ the elements are rotated through one temporary instead.
+static void SORT_FN(swap_offsets)(SORT_T* first, SORT_T* last, const unsigned char* offsets_l,
+                                  const unsigned char* offsets_r, size_t num, int use_swaps) {
+    if (use_swaps) {
+        for (size_t i = 0; i < num; i++)
+            SORT_FN(swap)(first + offsets_l[i], last - offsets_r[i]);
+    } else if (num > 0) {
+        SORT_T* l = first + offsets_l[0];
+        SORT_T* r = last - offsets_r[0];
+        SORT_T t = *l;
+        *l = *r;
+        for (size_t i = 1; i < num; i++) {
+            l = first + offsets_l[i];
+            *r = *l;
+            r = last - offsets_r[i];
+            *l = *r;
+        }
+        *r = t;
+    }
+}
+
+// Partition [begin, end) around the pivot at *begin: smaller elements to
+// the left, the rest to the right. Blocks of PDQ_BLOCK elements from each
+// end record the offsets of misplaced elements without branching on the
+// comparison, then the misplaced ones are swapped in bulk. Sets
+// *already_partitioned when no element had to move.
+static SORT_T* SORT_FN(partition_right)(SORT_T* begin, SORT_T* end, int* already_partitioned) {
+    SORT_T pivot = *begin;
+    SORT_T* first = begin;
+    SORT_T* last = end;
+
+    // The median-of-3 guarantees an element >= pivot, so the first scan stops
+    while (*++first < pivot) {}
+    if (first - 1 == begin)
+        while (first < last && !(*--last < pivot)) {}
+    else
+        while (!(*--last < pivot)) {}
+
+    *already_partitioned = first >= last;
+    if (!*already_partitioned) {
+        SORT_FN(swap)(first, last);
+        first++;
+
+        unsigned char offsets_l[PDQ_BLOCK], offsets_r[PDQ_BLOCK];
+        SORT_T* base_l = first;
+        SORT_T* base_r = last;
+        size_t num_l = 0, num_r = 0, start_l = 0, start_r = 0;
+        while (first < last) {
+            // Refill whichever side ran out, splitting what's left when both did
+            size_t unknown = last - first;
+            size_t left_split = num_l == 0 ? (num_r == 0 ? unknown / 2 : unknown) : 0;
+            size_t right_split = num_r == 0 ? unknown - left_split : 0;
+            if (left_split > PDQ_BLOCK) left_split = PDQ_BLOCK;
+            if (right_split > PDQ_BLOCK) right_split = PDQ_BLOCK;
+
+            for (size_t i = 0; i < left_split; i++) {
+                offsets_l[num_l] = (unsigned char)i;
+                num_l += !(*first < pivot);
+                first++;
+            }
+            for (size_t i = 0; i < right_split; i++) {
+                offsets_r[num_r] = (unsigned char)(i + 1);
+                num_r += *--last < pivot;
+            }
+
+            size_t num = num_l < num_r ? num_l : num_r;
+            SORT_FN(swap_offsets)(base_l, base_r, offsets_l + start_l, offsets_r + start_r, num,
+                                  num_l == num_r);
+            num_l -= num;
+            num_r -= num;
+            start_l += num;
+            start_r += num;
+            if (num_l == 0) {
+                start_l = 0;
+                base_l = first;
+            }
+            if (num_r == 0) {
+                start_r = 0;
+                base_r = last;
+            }
+        }
+
+        // One side may still hold misplaced elements: move them to the boundary
+        if (num_l) {
+            while (num_l--)
+                SORT_FN(swap)(base_l + offsets_l[start_l + num_l], --last);
+            first = last;
+        }
+        if (num_r) {
+            while (num_r--)
+                SORT_FN(swap)(base_r - offsets_r[start_r + num_r], first++);
+            last = first;
+        }
+    }
+
+    SORT_T* pivot_pos = first - 1;
+    *begin = *pivot_pos;
+    *pivot_pos = pivot;
+    return pivot_pos;
+}
+
+// Partition with elements equal to the pivot going left. Used when the
+// pivot equals the element before the range: everything equal to it is
+// then already in its final place and the left side needs no sorting.
+static SORT_T* SORT_FN(partition_left)(SORT_T* begin, SORT_T* end) {
+    SORT_T pivot = *begin;
+    SORT_T* first = begin;
+    SORT_T* last = end;
+
+    while (pivot < *--last) {}
+    if (last + 1 == end)
+        while (first < last && !(pivot < *++first)) {}
+    else
+        while (!(pivot < *++first)) {}
+
+    while (first < last) {
+        SORT_FN(swap)(first, last);
+        while (pivot < *--last) {}
+        while (!(pivot < *++first)) {}
+    }
+
+    *begin = *last;
+    *last = pivot;
+    return last;
+}
+
+// Pivot to *begin: ninther for big ranges, median of 3 otherwise. Either
+// way the last element ends up >= the pivot, which partition_right needs.
+static inline void SORT_FN(choose_pivot)(SORT_T* begin, SORT_T* end) {
+    size_t size = end - begin, half = size / 2;
+    if (size > PDQ_NINTHER) {
+        SORT_FN(sort3)(begin, begin + half, end - 1);
+        SORT_FN(sort3)(begin + 1, begin + half - 1, end - 2);
+        SORT_FN(sort3)(begin + 2, begin + half + 1, end - 3);
+        SORT_FN(sort3)(begin + half - 1, begin + half, begin + half + 1);
+        SORT_FN(swap)(begin, begin + half);
+    } else {
+        SORT_FN(sort3)(begin + half, begin, end - 1);
+    }
+}
+
+static void SORT_FN(pdq_loop)(SORT_T* begin, SORT_T* end, int bad_allowed, int leftmost) {
+    while (1) {
+        size_t size = end - begin;
+        if (size < PDQ_INSERTION) {
+            if (leftmost)
+                SORT_FN(insertion_sort)(begin, size);
+            else
+                SORT_FN(unguarded_insertion_sort)(begin, end);
+            return;
+        }
+
+        SORT_FN(choose_pivot)(begin, end);
+
+        // A pivot equal to the element before the range means many equal keys
+        if (!leftmost && !(begin[-1] < *begin)) {
+            begin = SORT_FN(partition_left)(begin, end) + 1;
+            continue;
+        }
+
+        int already_partitioned;
+        SORT_T* pivot_pos = SORT_FN(partition_right)(begin, end, &already_partitioned);
+        size_t l_size = pivot_pos - begin;
+        size_t r_size = end - (pivot_pos + 1);
+
+        if (l_size < size / 8 || r_size < size / 8) {
+            // Badly unbalanced: give up on quicksort after too many, else
+            // shuffle a few elements to break the pattern that caused it
+            if (--bad_allowed == 0) {
+                SORT_FN(heap_sort)(begin, size);
+                return;
+            }
+            if (l_size >= PDQ_INSERTION) {
+                SORT_FN(swap)(begin, begin + l_size / 4);
+                SORT_FN(swap)(pivot_pos - 1, pivot_pos - l_size / 4);
+                if (l_size > PDQ_NINTHER) {
+                    SORT_FN(swap)(begin + 1, begin + (l_size / 4 + 1));
+                    SORT_FN(swap)(begin + 2, begin + (l_size / 4 + 2));
+                    SORT_FN(swap)(pivot_pos - 2, pivot_pos - (l_size / 4 + 1));
+                    SORT_FN(swap)(pivot_pos - 3, pivot_pos - (l_size / 4 + 2));
+                }
+            }
+            if (r_size >= PDQ_INSERTION) {
+                SORT_FN(swap)(pivot_pos + 1, pivot_pos + (1 + r_size / 4));
+                SORT_FN(swap)(end - 1, end - r_size / 4);
+                if (r_size > PDQ_NINTHER) {
+                    SORT_FN(swap)(pivot_pos + 2, pivot_pos + (2 + r_size / 4));
+                    SORT_FN(swap)(pivot_pos + 3, pivot_pos + (3 + r_size / 4));
+                    SORT_FN(swap)(end - 2, end - (1 + r_size / 4));
+                    SORT_FN(swap)(end - 3, end - (2 + r_size / 4));
+                }
+            }
+        } else if (already_partitioned && SORT_FN(partial_insertion_sort)(begin, pivot_pos) &&
+                   SORT_FN(partial_insertion_sort)(pivot_pos + 1, end)) {
+            // Nothing moved and both sides were nearly sorted: done
+            return;
+        }
+
+        SORT_FN(pdq_loop)(begin, pivot_pos, bad_allowed, leftmost);
+        begin = pivot_pos + 1;
+        leftmost = 0;
+    }
+}
+
+static void SORT_FN(pdq_sort)(SORT_T arr[], size_t n) {
+    int bad_allowed = 1;
+    while (n >> bad_allowed) bad_allowed++;  // log2(n) unbalanced partitions before heapsort
+    SORT_FN(pdq_loop)(arr, arr + n, bad_allowed, 1);
+}
+
+// Comparison function for the C library's qsort, as the baseline
+static int SORT_FN(compare)(const void* a, const void* b) {
+    SORT_T x = *(const SORT_T*)a, y = *(const SORT_T*)b;
+    return (x > y) - (x < y);
+}
+
+// ---------------------------------------------------------------
+// Selection: the k smallest elements without a full sort
+// ---------------------------------------------------------------
+
+// Introselect: pdqsort's pivots and partitions, but only the side holding
+// kth is followed. Heapsort finishes the range once too many partitions
+// come out badly unbalanced, so the worst case stays O(n log n).
+static void SORT_FN(select_loop)(SORT_T* begin, SORT_T* end, SORT_T* kth, int bad_allowed, int leftmost) {
+    while (end - begin >= PDQ_INSERTION) {
+        size_t size = end - begin;
+        SORT_FN(choose_pivot)(begin, end);
+
+        // Pivot equal to the element before the range: the left side is all
+        // copies of it, so kth is either among them or to their right
+        if (!leftmost && !(begin[-1] < *begin)) {
+            SORT_T* last_equal = SORT_FN(partition_left)(begin, end);
+            if (kth <= last_equal)
+                return;
+            begin = last_equal + 1;
+            continue;
+        }
+
+        int already_partitioned;
+        SORT_T* pivot_pos = SORT_FN(partition_right)(begin, end, &already_partitioned);
+        if (pivot_pos == kth)
+            return;
+        size_t l_size = pivot_pos - begin;
+        size_t r_size = end - (pivot_pos + 1);
+        if ((l_size < size / 8 || r_size < size / 8) && --bad_allowed == 0) {
+            SORT_FN(heap_sort)(begin, size);
+            return;
+        }
+        if (kth < pivot_pos) {
+            end = pivot_pos;
+        } else {
+            begin = pivot_pos + 1;
+            leftmost = 0;
+        }
+    }
+    if (leftmost)
+        SORT_FN(insertion_sort)(begin, end - begin);
+    else
+        SORT_FN(unguarded_insertion_sort)(begin, end);
+}
+
+// Rearrange arr so its first k elements are the k smallest, in no
+// particular order, with the k-th smallest at arr[k - 1]
+static void SORT_FN(select_k)(SORT_T arr[], size_t n, size_t k) {
+    if (k == 0 || k >= n)
+        return;
+    int bad_allowed = 1;
+    while (n >> bad_allowed) bad_allowed++;
+    SORT_FN(select_loop)(arr, arr + n, arr + k - 1, bad_allowed, 1);
+}
+
+// Streaming top-k: heap[] keeps the k smallest values fed so far as a
+// max-heap, so its root is the threshold a new value has to beat and
+// most values of a long stream cost one comparison. *filled counts the
+// values held, starting at 0; call again for each new chunk.
+static void SORT_FN(top_k_feed)(SORT_T heap[], size_t k, size_t* filled, const SORT_T arr[], size_t n) {
+    size_t i = 0;
+    for (; i < n && *filled < k; i++) {
+        heap[(*filled)++] = arr[i];
+        if (*filled == k)
+            for (size_t j = k / 2; j-- > 0;)
+                SORT_FN(sift_down)(heap, j, k);
+    }
+    for (; i < n; i++) {
+        if (arr[i] < heap[0]) {
+            heap[0] = arr[i];
+            SORT_FN(sift_down)(heap, 0, k);
+        }
+    }
+}
+
+// The min(k, n) smallest values of arr into out, ascending; returns how many
+static size_t SORT_FN(top_k)(const SORT_T arr[], size_t n, size_t k, SORT_T out[]) {
+    size_t filled = 0;
+    if (k > 0)
+        SORT_FN(top_k_feed)(out, k, &filled, arr, n);
+    SORT_FN(heap_sort)(out, filled);
+    return filled;
+}
+
+// Utility
+static int SORT_FN(is_sorted)(const SORT_T arr[], size_t n) {
+    for (size_t i = 1; i < n; i++)
+        if (arr[i] < arr[i-1])
+            return 0;
+    return 1;
+}
+
+// Order-independent hash of the contents: equal before and after a
+// correct sort, so dropped or duplicated elements are caught
+static uint64_t SORT_FN(fingerprint)(const SORT_T arr[], size_t n) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t x = 0;
+        memcpy(&x, &arr[i], sizeof(SORT_T));
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;  // splitmix64 finaliser
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        sum += x ^ (x >> 31);
+    }
+    return sum;
+}
+
+// Entry points with one signature, for the benchmark's algorithm table.
+// Only the parallel sorts use the pool.
+static void SORT_FN(run_bubble)(void* arr, size_t n, ThreadPool* pool) { (void)pool; SORT_FN(bubble_sort)(arr, n); }
+static void SORT_FN(run_selection)(void* arr, size_t n, ThreadPool* pool) { (void)pool; SORT_FN(selection_sort)(arr, n); }
+static void SORT_FN(run_merge)(void* arr, size_t n, ThreadPool* pool) { (void)pool; SORT_FN(merge_sort)(arr, 0, (long)n - 1); }
+static void SORT_FN(run_merge_bottom_up)(void* arr, size_t n, ThreadPool* pool) {
+    (void)pool;
+    SORT_T* buf = malloc(n * sizeof(SORT_T));
+    if (!buf) {
+        printf("Error: Can't allocate merge buffer!\n");
+        return;
+    }
+    SORT_FN(merge_sort_bottom_up)(arr, buf, n);
+    free(buf);
+}
+static void SORT_FN(run_merge_parallel)(void* arr, size_t n, ThreadPool* pool) {
+    SORT_T* buf = malloc(n * sizeof(SORT_T));
+    if (!buf) {
+        printf("Error: Can't allocate merge buffer!\n");
+        return;
+    }
+    SORT_FN(parallel_merge_sort)(pool, arr, buf, n);
+    free(buf);
+}
+static void SORT_FN(run_sample_parallel)(void* arr, size_t n, ThreadPool* pool) {
+    SORT_T* buf = malloc(n * sizeof(SORT_T));
+    if (!buf || !SORT_FN(parallel_sample_sort)(pool, arr, buf, n))
+        printf("Error: Can't allocate sample sort buffers!\n");
+    free(buf);
+}
+static void SORT_FN(run_radix_lsd)(void* arr, size_t n, ThreadPool* pool) {
+    (void)pool;
+    SORT_T* buf = malloc(n * sizeof(SORT_T));
+    if (!buf) {
+        printf("Error: Can't allocate radix buffer!\n");
+        return;
+    }
+    SORT_FN(radix_sort_lsd)(arr, buf, n);
+    free(buf);
+}
+static void SORT_FN(run_radix_msd)(void* arr, size_t n, ThreadPool* pool) { (void)pool; SORT_FN(radix_sort_msd)(arr, n); }
+static void SORT_FN(run_pdq)(void* arr, size_t n, ThreadPool* pool) { (void)pool; SORT_FN(pdq_sort)(arr, n); }
+static void SORT_FN(run_qsort)(void* arr, size_t n, ThreadPool* pool) { (void)pool; qsort(arr, n, sizeof(SORT_T), SORT_FN(compare)); }
+// Selections for the benchmark's --k mode: out gets the k smallest
+static void SORT_FN(run_select_sort)(void* arr, size_t n, size_t k, void* out) {
+    SORT_FN(pdq_sort)(arr, n);
+    memcpy(out, arr, k * sizeof(SORT_T));
+}
+static void SORT_FN(run_introselect)(void* arr, size_t n, size_t k, void* out) {
+    SORT_FN(select_k)(arr, n, k);
+    memcpy(out, arr, k * sizeof(SORT_T));
+}
+static void SORT_FN(run_top_k)(void* arr, size_t n, size_t k, void* out) { SORT_FN(top_k)(arr, n, k, out); }
+static int SORT_FN(check_sorted)(const void* arr, size_t n) { return SORT_FN(is_sorted)(arr, n); }
+static uint64_t SORT_FN(check_fingerprint)(const void* arr, size_t n) { return SORT_FN(fingerprint)(arr, n); }
+
+#undef SORT_T
+#undef SORT_SUFFIX
+#undef SORT_KEY_T
+#undef SORT_KEY
@@ -0,0 +1,132 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// A small shared pool of worker threads for fork/join style tasks.
+// Tasks are grouped by a counter the caller owns: pool_submit() adds a
+// task to the group, pool_wait() returns once all of them have finished.
+// A thread waiting in pool_wait() runs queued tasks itself instead of
+// sleeping, so tasks may submit and wait for their own subtasks.
+
+#include <pthread.h>
+#include <stdlib.h>
+
+typedef struct PoolTask {
+    void (*fn)(void* arg);
+    void* arg;
+    int* pending;           // Group counter, decremented when fn returns
+    struct PoolTask* next;
+} PoolTask;
+
+typedef struct {
+    pthread_t* workers;
+    int threads;            // Workers plus the thread that waits
+    PoolTask* stack;        // LIFO, so recursive work goes depth-first
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // A task was queued, or the pool is stopping
+    pthread_cond_t done;    // A task finished
+} ThreadPool;
+
+// Pop a task and run it with the lock released. Called with the lock held.
+static void pool_run_one(ThreadPool* pool) {
+    PoolTask* task = pool->stack;
+    pool->stack = task->next;
+    pthread_mutex_unlock(&pool->lock);
+    task->fn(task->arg);
+    pthread_mutex_lock(&pool->lock);
+    (*task->pending)--;
+    pthread_cond_broadcast(&pool->done);
+    free(task);
+}
+
+static void* pool_worker(void* arg) {
+    ThreadPool* pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->stack && !pool->stop) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (!pool->stack) {
+            break;
+        }
+        pool_run_one(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Pool with 'threads' threads in total: the caller counts as one of them
+static ThreadPool* pool_create(int threads) {
+    ThreadPool* pool = calloc(1, sizeof(ThreadPool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->threads = threads < 1 ? 1 : threads;
+    pool->workers = malloc(pool->threads * sizeof(pthread_t));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int i = 1; i < pool->threads; i++) {
+        pthread_create(&pool->workers[i], NULL, pool_worker, pool);
+    }
+    return pool;
+}
+
+static void pool_destroy(ThreadPool* pool) {
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->threads; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->workers);
+    free(pool);
+}
+
+// Queue fn(arg) as part of the group counted by *pending. Without a pool,
+// with a single thread, or if the task can't be allocated, it runs right away.
+static void pool_submit(ThreadPool* pool, int* pending, void (*fn)(void*), void* arg) {
+    PoolTask* task = pool && pool->threads > 1 ? malloc(sizeof(PoolTask)) : NULL;
+    if (!task) {
+        fn(arg);
+        return;
+    }
+    task->fn = fn;
+    task->arg = arg;
+    task->pending = pending;
+    pthread_mutex_lock(&pool->lock);
+    (*pending)++;
+    task->next = pool->stack;
+    pool->stack = task;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Wait for every task in the group, running queued tasks meanwhile
+static void pool_wait(ThreadPool* pool, int* pending) {
+    if (!pool || pool->threads == 1) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (*pending > 0) {
+        if (pool->stack) {
+            pool_run_one(pool);
+        } else {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+#endif // THREAD_POOL_H
@@ -1,101 +1,749 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
 #include <time.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
-#define SIZE 100000  // Try 1 million later!
+// Radix keys: flipping the sign bit orders two's complement integers as
+// unsigned; doubles also need the other bits inverted when negative
+static inline uint64_t double_key(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits & 0x8000000000000000ULL ? ~bits : bits | 0x8000000000000000ULL;
+}
+
+// Every sort exists once per element type (see sort_template.h)
+#define SORT_T int
+#define SORT_SUFFIX _i32
+#define SORT_KEY_T uint32_t
+#define SORT_KEY(x) ((uint32_t)(x) ^ 0x80000000u)
+#include "sort_template.h"
+#define SORT_T int64_t
+#define SORT_SUFFIX _i64
+#define SORT_KEY_T uint64_t
+#define SORT_KEY(x) ((uint64_t)(x) ^ 0x8000000000000000ULL)
+#include "sort_template.h"
+#define SORT_T double
+#define SORT_SUFFIX _f64
+#define SORT_KEY_T uint64_t
+#define SORT_KEY(x) double_key(x)
+#include "sort_template.h"
+#include "sort_avx2.h"
+
+#define DEFAULT_SIZES "1000,10000,100000"
+#define DEFAULT_REPS 5
+#define DEFAULT_RANGE 100000           // Random values are in [0, range), like rand() % 100000
+#define DEFAULT_QUADRATIC_LIMIT 20000  // Bubble and selection sort skip anything bigger
+#define MAX_LIST 32
+#define MAX_THREADS 1024
+#define FILL_CHUNK 65536
+
+// ---------------------------------------------------------------
+// Element types, input distributions and algorithms
+// ---------------------------------------------------------------
+
+typedef enum { TYPE_I32, TYPE_I64, TYPE_F64, TYPE_COUNT } ElemType;
+static const char* type_names[TYPE_COUNT] = {"i32", "i64", "f64"};
+static const size_t type_sizes[TYPE_COUNT] = {sizeof(int), sizeof(int64_t), sizeof(double)};
+
+typedef enum {
+    DIST_RANDOM,      // Uniform in [0, range)
+    DIST_SORTED,      // Already ascending
+    DIST_REVERSED,    // Descending
+    DIST_FEW_UNIQUE,  // Eight distinct values
+    DIST_ORGAN_PIPE,  // Ascending to the middle, then descending
+    DIST_COUNT
+} Distribution;
+static const char* dist_names[DIST_COUNT] = {"random", "sorted", "reversed", "few-unique", "organ-pipe"};
+
+typedef void (*SortFn)(void* arr, size_t n, ThreadPool* pool);
+
+typedef struct {
+    const char* name;
+    SortFn run[TYPE_COUNT];
+    int quadratic;    // O(n^2): skipped above --quadratic-limit
+    int stack_bound;  // Copies n elements onto the stack: skipped if that won't fit
+    int parallel;     // Runs once per --threads entry
+} Algorithm;
+
+#define FOR_ALL_TYPES(fn) {fn##_i32, fn##_i64, fn##_f64}
+
+// Merge sort on AVX2 kernels, for int only. Without AVX2 it falls back
+// to the scalar bottom-up merge sort.
+static void run_merge_simd_i32(void* arr, size_t n, ThreadPool* pool) {
+#ifdef SORT_AVX2
+    if (avx2_available()) {
+        int* buf = malloc(n * sizeof(int));
+        if (!buf) {
+            printf("Error: Can't allocate merge buffer!\n");
+            return;
+        }
+        merge_sort_avx2(arr, buf, n);
+        free(buf);
+        return;
+    }
+#endif
+    run_merge_bottom_up_i32(arr, n, pool);
+}
+
+static const Algorithm algorithms[] = {
+    {"bubble", FOR_ALL_TYPES(run_bubble), 1, 0, 0},
+    {"selection", FOR_ALL_TYPES(run_selection), 1, 0, 0},
+    {"merge", FOR_ALL_TYPES(run_merge), 0, 1, 0},
+    {"merge-bu", FOR_ALL_TYPES(run_merge_bottom_up), 0, 0, 0},
+    {"merge-simd", {run_merge_simd_i32, NULL, NULL}, 0, 0, 0},
+    {"pdq", FOR_ALL_TYPES(run_pdq), 0, 0, 0},
+    {"qsort", FOR_ALL_TYPES(run_qsort), 0, 0, 0},
+    {"radix-lsd", FOR_ALL_TYPES(run_radix_lsd), 0, 0, 0},
+    {"radix-msd", FOR_ALL_TYPES(run_radix_msd), 0, 0, 0},
+    {"merge-par", FOR_ALL_TYPES(run_merge_parallel), 0, 0, 1},
+    {"sample-par", FOR_ALL_TYPES(run_sample_parallel), 0, 0, 1},
+};
+#define ALGORITHM_COUNT (int)(sizeof(algorithms) / sizeof(algorithms[0]))
+
+// Selections for --k: each puts the k smallest elements of arr in out,
+// and may reorder arr while doing it
+typedef void (*SelectFn)(void* arr, size_t n, size_t k, void* out);
+
+typedef struct {
+    const char* name;
+    SelectFn run[TYPE_COUNT];
+    int ordered;  // out comes back ascending
+} Selection;
+
+// Heap top-k with AVX2 skipping everything not below the current
+// threshold, eight values per compare. Falls back to the scalar heap.
+static void run_top_k_simd_i32(void* arr, size_t n, size_t k, void* out) {
+#ifdef SORT_AVX2
+    if (avx2_available() && k > 0 && k < n) {
+        const int* a = arr;
+        int* heap = out;
+        size_t filled = 0;
+        top_k_feed_i32(heap, k, &filled, a, k);
+        for (size_t i = k; i < n; i++) {
+            i += first_below_avx2(a + i, n - i, heap[0]);
+            if (i == n)
+                break;
+            heap[0] = a[i];
+            sift_down_i32(heap, 0, k);
+        }
+        heap_sort_i32(heap, k);
+        return;
+    }
+#endif
+    run_top_k_i32(arr, n, k, out);
+}
+
+static const Selection selections[] = {
+    {"full-sort", FOR_ALL_TYPES(run_select_sort), 1},
+    {"introselect", FOR_ALL_TYPES(run_introselect), 0},
+    {"heap-topk", FOR_ALL_TYPES(run_top_k), 1},
+    {"heap-topk-simd", {run_top_k_simd_i32, NULL, NULL}, 1},
+};
+#define SELECTION_COUNT (int)(sizeof(selections) / sizeof(selections[0]))
+
+static int (*const check_sorted[TYPE_COUNT])(const void*, size_t) = FOR_ALL_TYPES(check_sorted);
+static uint64_t (*const check_fingerprint[TYPE_COUNT])(const void*, size_t) = FOR_ALL_TYPES(check_fingerprint);
+static const SortFn reference_sort[TYPE_COUNT] = FOR_ALL_TYPES(run_pdq);  // For --k answers
 
-// Bubble Sort
-void bubble_sort(int arr[], int n) {
-    for (int i = 0; i < n-1; i++)
-        for (int j = 0; j < n-1-i; j++)
-            if (arr[j] > arr[j+1]) {
-                int temp = arr[j];
-                arr[j] = arr[j+1];
-                arr[j+1] = temp;
+// ---------------------------------------------------------------
+// Input generation
+// ---------------------------------------------------------------
+
+// xorshift64*: fast, seedable and far better than rand() for big arrays
+static inline uint64_t next_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static int64_t dist_value(Distribution dist, size_t i, size_t n, int64_t range, uint64_t* state) {
+    switch (dist) {
+    case DIST_RANDOM:
+        return (int64_t)(next_random(state) >> 33) % range;
+    case DIST_SORTED:
+        return (int64_t)i;
+    case DIST_REVERSED:
+        return (int64_t)(n - 1 - i);
+    case DIST_FEW_UNIQUE:
+        return (int64_t)(next_random(state) >> 61) * (range / 8);
+    default:
+        return (int64_t)(i < n - i ? i : n - 1 - i);
+    }
+}
+
+// Fill arr with n values of the given distribution, converted to the element type.
+// 64-bit values are spread over the high bits so they really need 64 bits.
+static void fill_array(void* arr, ElemType type, size_t n, Distribution dist, int64_t range,
+                       uint64_t seed) {
+    uint64_t state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    int64_t chunk[FILL_CHUNK];
+    for (size_t base = 0; base < n; base += FILL_CHUNK) {
+        size_t count = n - base < FILL_CHUNK ? n - base : FILL_CHUNK;
+        for (size_t i = 0; i < count; i++) {
+            chunk[i] = dist_value(dist, base + i, n, range, &state);
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (type == TYPE_I32) ((int*)arr)[base + i] = (int)chunk[i];
+            else if (type == TYPE_I64) ((int64_t*)arr)[base + i] = chunk[i] * 2654435761LL;
+            else ((double*)arr)[base + i] = chunk[i] * 0.25;
+        }
+    }
+}
+
+// ---------------------------------------------------------------
+// Timing and statistics
+// ---------------------------------------------------------------
+
+// Wall time from a monotonic clock (clock() would measure CPU time)
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+typedef struct {
+    const char* algo;
+    const char* type;
+    const char* dist;
+    size_t size;
+    size_t k;        // Elements selected in --k mode; 0 for sorts
+    int threads;
+    int reps;
+    double median_ms, min_ms, mean_ms, stddev_ms;
+    double ns_per_elem;
+    double speedup;  // Against the first --threads entry; 0 for sequential sorts
+    int sorted;  // Every repetition came out sorted with the same contents
+                 // (in --k mode: with exactly the k smallest elements)
+} Result;
+
+static void summarize(double* times, int reps, Result* r) {
+    qsort(times, reps, sizeof(double), compare_doubles);
+    double sum = 0.0, sq = 0.0;
+    for (int i = 0; i < reps; i++) sum += times[i];
+    double mean = sum / reps;
+    for (int i = 0; i < reps; i++) sq += (times[i] - mean) * (times[i] - mean);
+    r->median_ms = (reps % 2 ? times[reps / 2] : (times[reps / 2 - 1] + times[reps / 2]) / 2) * 1e3;
+    r->min_ms = times[0] * 1e3;
+    r->mean_ms = mean * 1e3;
+    r->stddev_ms = (reps > 1 ? sqrt(sq / (reps - 1)) : 0.0) * 1e3;
+    r->ns_per_elem = r->size ? r->median_ms * 1e6 / r->size : 0.0;
+}
+
+// ---------------------------------------------------------------
+// Leaf sorts
+// ---------------------------------------------------------------
+
+// Time the base case of the merge sorts on its own: 'total' random ints
+// sorted in independent blocks, by insertion sort and by the AVX2 network.
+// Returns the number of failed checks.
+static int benchmark_leaves(size_t total, int reps, uint64_t seed) {
+    static const size_t blocks[] = {8, 16, 32, 64};
+#ifdef SORT_AVX2
+    int simd = avx2_available();
+#else
+    int simd = 0;
+#endif
+    if (!simd) {
+        printf("AVX2 not available: timing insertion sort only\n");
+    }
+    int* original = malloc(total * sizeof(int));
+    int* work = malloc(total * sizeof(int));
+    double* times = malloc(reps * sizeof(double));
+    if (!original || !work || !times) {
+        printf("Error: Can't allocate memory!\n");
+        free(original);
+        free(work);
+        free(times);
+        return 1;
+    }
+    fill_array(original, TYPE_I32, total, DIST_RANDOM, INT32_MAX, seed);
+
+    int failures = 0;
+    printf("%6s %14s %14s %8s  %s\n", "block", "insertion ns", "network ns", "speedup", "check");
+    for (int b = 0; b < (int)(sizeof(blocks) / sizeof(blocks[0])); b++) {
+        size_t block = blocks[b], count = total / block;
+        double ns[2] = {0.0, 0.0};
+        int ok = 1;
+        for (int method = 0; method < 1 + simd; method++) {
+            for (int rep = 0; rep < reps; rep++) {
+                memcpy(work, original, count * block * sizeof(int));
+                double start = now_seconds();
+                for (size_t i = 0; i < count; i++) {
+#ifdef SORT_AVX2
+                    if (method) {
+                        sort_network_i32(work + i * block, block);
+                        continue;
+                    }
+#endif
+                    insertion_sort_i32(work + i * block, block);
+                }
+                times[rep] = now_seconds() - start;
+                for (size_t i = 0; i < count; i++) {
+                    ok = ok && is_sorted_i32(work + i * block, block) &&
+                         fingerprint_i32(work + i * block, block) == fingerprint_i32(original + i * block, block);
+                }
             }
+            qsort(times, reps, sizeof(double), compare_doubles);
+            ns[method] = times[reps / 2] * 1e9 / count;
+        }
+        failures += !ok;
+        if (simd) {
+            printf("%6zu %14.1f %14.1f %7.2fx  %s\n", block, ns[0], ns[1], ns[0] / ns[1], ok ? "ok" : "NOT SORTED");
+        } else {
+            printf("%6zu %14.1f %14s %8s  %s\n", block, ns[0], "-", "-", ok ? "ok" : "NOT SORTED");
+        }
+    }
+    free(original);
+    free(work);
+    free(times);
+    return failures;
+}
+
+// ---------------------------------------------------------------
+// Selection
+// ---------------------------------------------------------------
+
+// The k actually used for an array of n: at most n, with 0 meaning the median
+static size_t effective_k(size_t k, size_t n) {
+    return k ? (k < n ? k : n) : (n + 1) / 2;
 }
 
-// Selection Sort
-void selection_sort(int arr[], int n) {
-    for (int i = 0; i < n-1; i++) {
-        int min = i;
-        for (int j = i+1; j < n; j++)
-            if (arr[j] < arr[min])
-                min = j;
-        int temp = arr[i];
-        arr[i] = arr[min];
-        arr[min] = temp;
+// Run the chosen selections for every k, size, distribution and type,
+// appending to results. A k of 0 stands for the median. Ks that come
+// out the same for a size (after clamping to n) are run once. Returns
+// the number of failures.
+static int benchmark_selection(const size_t sizes[], int size_count, const int dists[], int dist_count,
+                               const int types[], int type_count, const int ops[], int op_count,
+                               const size_t ks[], int k_count, int reps, uint64_t seed, int64_t range,
+                               Result* results, int* count) {
+    double* times = malloc(reps * sizeof(double));
+    if (!times) {
+        printf("Error: Can't allocate memory!\n");
+        return 1;
     }
+    int failures = 0;
+    printf("%-14s %-4s %-11s %11s %11s %11s %11s %11s %9s  %s\n", "algo", "type", "dist", "size", "k",
+           "median ms", "min ms", "stddev ms", "ns/elem", "check");
+    for (int t = 0; t < type_count; t++) {
+        ElemType type = types[t];
+        size_t elem = type_sizes[type];
+        for (int s = 0; s < size_count; s++) {
+            size_t n = sizes[s];
+            void* original = malloc(n * elem);
+            void* work = malloc(n * elem);
+            void* sorted = malloc(n * elem);
+            void* out = malloc(n * elem);
+            if (!original || !work || !sorted || !out) {
+                printf("Error: Can't allocate %zu %s elements!\n", n, type_names[type]);
+                free(original);
+                free(work);
+                free(sorted);
+                free(out);
+                failures++;
+                continue;
+            }
+            for (int d = 0; d < dist_count; d++) {
+                // The k smallest, to check against, come from a full sort
+                fill_array(original, type, n, dists[d], range, seed);
+                memcpy(sorted, original, n * elem);
+                reference_sort[type](sorted, n, NULL);
+                for (int ki = 0; ki < k_count; ki++) {
+                    size_t k = effective_k(ks[ki], n);
+                    int repeat = 0;
+                    for (int kj = 0; kj < ki && !repeat; kj++) {
+                        repeat = effective_k(ks[kj], n) == k;
+                    }
+                    if (repeat) {
+                        continue;
+                    }
+                    uint64_t expected = check_fingerprint[type](sorted, k);
+                    for (int o = 0; o < op_count; o++) {
+                        const Selection* op = &selections[ops[o]];
+                        if (!op->run[type]) {
+                            printf("%-14s %-4s %-11s %11zu %11zu  skipped (no version for this type)\n",
+                                   op->name, type_names[type], dist_names[dists[d]], n, k);
+                            continue;
+                        }
+                        Result* r = &results[(*count)++];
+                        r->algo = op->name;
+                        r->type = type_names[type];
+                        r->dist = dist_names[dists[d]];
+                        r->size = n;
+                        r->k = k;
+                        r->threads = 1;
+                        r->reps = reps;
+                        r->speedup = 0.0;
+                        r->sorted = 1;
+                        for (int rep = 0; rep < reps; rep++) {
+                            memcpy(work, original, n * elem);
+                            double start = now_seconds();
+                            op->run[type](work, n, k, out);
+                            times[rep] = now_seconds() - start;
+                            r->sorted = r->sorted && check_fingerprint[type](out, k) == expected &&
+                                        (!op->ordered || check_sorted[type](out, k));
+                        }
+                        summarize(times, reps, r);
+                        failures += !r->sorted;
+                        printf("%-14s %-4s %-11s %11zu %11zu %11.3f %11.3f %11.3f %9.2f  %s\n", r->algo,
+                               r->type, r->dist, n, k, r->median_ms, r->min_ms, r->stddev_ms,
+                               r->ns_per_elem, r->sorted ? "ok" : "WRONG");
+                        fflush(stdout);
+                    }
+                }
+            }
+            free(original);
+            free(work);
+            free(sorted);
+            free(out);
+        }
+    }
+    free(times);
+    return failures;
 }
 
-// Merge Sort
-void merge(int arr[], int l, int m, int r) {
-    int n1 = m - l + 1;
-    int n2 = r - m;
-    int L[n1], R[n2];
+// ---------------------------------------------------------------
+// Output
+// ---------------------------------------------------------------
+
+static int write_csv(const char* filename, const Result* results, int count) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        printf("Error: Can't create %s!\n", filename);
+        return 0;
+    }
+    fprintf(file, "algo,type,dist,size,k,threads,reps,median_ms,min_ms,mean_ms,stddev_ms,ns_per_elem,"
+                  "speedup,sorted\n");
+    for (int i = 0; i < count; i++) {
+        const Result* r = &results[i];
+        fprintf(file, "%s,%s,%s,%zu,%zu,%d,%d,%.6f,%.6f,%.6f,%.6f,%.4f,%.4f,%d\n", r->algo, r->type,
+                r->dist, r->size, r->k, r->threads, r->reps, r->median_ms, r->min_ms, r->mean_ms,
+                r->stddev_ms, r->ns_per_elem, r->speedup, r->sorted);
+    }
+    fclose(file);
+    printf("Results written to %s\n", filename);
+    return 1;
+}
 
-    for (int i = 0; i < n1; i++) L[i] = arr[l + i];
-    for (int j = 0; j < n2; j++) R[j] = arr[m + 1 + j];
+static int write_json(const char* filename, const Result* results, int count) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        printf("Error: Can't create %s!\n", filename);
+        return 0;
+    }
+    // One result per line, easy to grep and to load for plotting
+    fprintf(file, "{\n  \"results\": [\n");
+    for (int i = 0; i < count; i++) {
+        const Result* r = &results[i];
+        fprintf(file, "    {\"algo\": \"%s\", \"type\": \"%s\", \"dist\": \"%s\", \"size\": %zu, "
+                      "\"k\": %zu, \"threads\": %d, \"reps\": %d, \"median_ms\": %.6f, \"min_ms\": %.6f, "
+                      "\"mean_ms\": %.6f, \"stddev_ms\": %.6f, \"ns_per_elem\": %.4f, "
+                      "\"speedup\": %.4f, \"sorted\": %s}%s\n",
+                r->algo, r->type, r->dist, r->size, r->k, r->threads, r->reps, r->median_ms, r->min_ms,
+                r->mean_ms, r->stddev_ms, r->ns_per_elem, r->speedup, r->sorted ? "true" : "false",
+                i + 1 < count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    printf("Results written to %s\n", filename);
+    return 1;
+}
 
-    int i = 0, j = 0, k = l;
-    while (i < n1 && j < n2)
-        arr[k++] = (L[i] <= R[j]) ? L[i++] : R[j++];
+// ---------------------------------------------------------------
+// Command line
+// ---------------------------------------------------------------
 
-    while (i < n1) arr[k++] = L[i++];
-    while (j < n2) arr[k++] = R[j++];
+// Parse a count with an optional k, M or G suffix (powers of ten)
+static int parse_count(const char* text, size_t* value) {
+    char* end;
+    double v = strtod(text, &end);
+    if (*end == 'k' || *end == 'K') { v *= 1e3; end++; }
+    else if (*end == 'm' || *end == 'M') { v *= 1e6; end++; }
+    else if (*end == 'g' || *end == 'G') { v *= 1e9; end++; }
+    if (end == text || *end != '\0' || v < 1) {
+        return 0;
+    }
+    *value = (size_t)v;
+    return 1;
 }
 
-void merge_sort(int arr[], int l, int r) {
-    if (l < r) {
-        int m = l + (r - l) / 2;
-        merge_sort(arr, l, m);
-        merge_sort(arr, m + 1, r);
-        merge(arr, l, m, r);
+// Split a comma-separated list in place
+static int split_list(char* text, char* items[], int max) {
+    int count = 0;
+    for (char* item = strtok(text, ","); item && count < max; item = strtok(NULL, ",")) {
+        items[count++] = item;
     }
+    return count;
 }
 
-// Utility
-void fill_array(int arr[], int size) {
-    for (int i = 0; i < size; i++)
-        arr[i] = rand() % 100000;
+static int find_name(const char* name, const char* const names[], int count) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(name, names[i]) == 0) return i;
+    }
+    return -1;
 }
 
-void copy_array(int src[], int dest[], int size) {
-    for (int i = 0; i < size; i++)
-        dest[i] = src[i];
+static void print_usage(const char* program) {
+    printf("Usage: %s [--sizes N,...] [--dists D,...] [--types T,...] [--algos A,...]\n", program);
+    printf("          [--threads N,...] [--reps N] [--seed N] [--range N] [--quadratic-limit N]\n");
+    printf("          [--csv out.csv] [--json out.json]\n");
+    printf("       %s --k K,... [--sizes N,...] [--dists D,...] [--types T,...] [--algos A,...]\n", program);
+    printf("          [--reps N] [--seed N] [--range N] [--csv out.csv] [--json out.json]\n");
+    printf("       %s --leaves N [--reps N] [--seed N]\n", program);
+    printf("Sizes take k, M or G suffixes (default %s)\n", DEFAULT_SIZES);
+    printf("Distributions: random, sorted, reversed, few-unique, organ-pipe (default random)\n");
+    printf("Types: i32, i64, f64 (default i32)\n");
+    printf("Algorithms:");
+    for (int a = 0; a < ALGORITHM_COUNT; a++) {
+        printf(" %s", algorithms[a].name);
+    }
+    printf(" (default all)\n");
+    printf("--range 0 draws random values from the full 31-bit range\n");
+    printf("--threads lists the pool sizes for the -par sorts (default 1, 2, 4, ... up to all\n");
+    printf("cores); speedup is against the first entry\n");
+    printf("--k times finding the k smallest elements instead of sorting, for each k\n");
+    printf("(k or M suffixes, or median); --algos then picks from:");
+    for (int o = 0; o < SELECTION_COUNT; o++) {
+        printf(" %s", selections[o].name);
+    }
+    printf("\n");
+    printf("--leaves times insertion sort against the AVX2 network on N ints in\n");
+    printf("blocks of 8, 16, 32 and 64, then exits\n");
 }
 
-int main() {
-    int original[SIZE], arr1[SIZE], arr2[SIZE], arr3[SIZE];
-    fill_array(original, SIZE);
+int main(int argc, char* argv[]) {
+    char sizes_arg[1024] = DEFAULT_SIZES, dists_arg[256] = "random", types_arg[64] = "i32";
+    char algos_arg[1024] = "", threads_arg[256] = "", k_arg[256] = "";
+    const char* csv = NULL;
+    const char* json = NULL;
+    int reps = DEFAULT_REPS;
+    uint64_t seed = 1;
+    int64_t range = DEFAULT_RANGE;
+    size_t quadratic_limit = DEFAULT_QUADRATIC_LIMIT;
+    size_t leaves = 0;
 
-    copy_array(original, arr1, SIZE);
-    copy_array(original, arr2, SIZE);
-    copy_array(original, arr3, SIZE);
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        const char* value = argv[i + 1];
+        int ok = 1;
+        if (strcmp(argv[i], "--sizes") == 0) snprintf(sizes_arg, sizeof(sizes_arg), "%s", value);
+        else if (strcmp(argv[i], "--dists") == 0) snprintf(dists_arg, sizeof(dists_arg), "%s", value);
+        else if (strcmp(argv[i], "--types") == 0) snprintf(types_arg, sizeof(types_arg), "%s", value);
+        else if (strcmp(argv[i], "--algos") == 0) snprintf(algos_arg, sizeof(algos_arg), "%s", value);
+        else if (strcmp(argv[i], "--threads") == 0) snprintf(threads_arg, sizeof(threads_arg), "%s", value);
+        else if (strcmp(argv[i], "--k") == 0) snprintf(k_arg, sizeof(k_arg), "%s", value);
+        else if (strcmp(argv[i], "--reps") == 0) ok = (reps = atoi(value)) >= 1;
+        else if (strcmp(argv[i], "--seed") == 0) seed = strtoull(value, NULL, 10);
+        else if (strcmp(argv[i], "--range") == 0) ok = (range = atoll(value)) >= 0;
+        else if (strcmp(argv[i], "--quadratic-limit") == 0) ok = parse_count(value, &quadratic_limit);
+        else if (strcmp(argv[i], "--leaves") == 0) ok = parse_count(value, &leaves);
+        else if (strcmp(argv[i], "--csv") == 0) csv = value;
+        else if (strcmp(argv[i], "--json") == 0) json = value;
+        else ok = 0;
+        if (!ok) {
+            printf("Error: Bad option %s %s\n", argv[i], value);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (range == 0) {
+        range = INT32_MAX;
+    }
+    if (leaves) {
+        return benchmark_leaves(leaves, reps, seed) ? 1 : 0;
+    }
 
-    clock_t start, end;
-    double time_taken;
+    // Resolve the lists
+    char* items[MAX_LIST];
+    size_t sizes[MAX_LIST];
+    int size_count = split_list(sizes_arg, items, MAX_LIST);
+    for (int i = 0; i < size_count; i++) {
+        if (!parse_count(items[i], &sizes[i])) {
+            printf("Error: Bad size %s\n", items[i]);
+            return 1;
+        }
+    }
+    int dists[DIST_COUNT], dist_count = split_list(dists_arg, items, DIST_COUNT);
+    for (int i = 0; i < dist_count; i++) {
+        if ((dists[i] = find_name(items[i], dist_names, DIST_COUNT)) < 0) {
+            printf("Error: Unknown distribution %s\n", items[i]);
+            return 1;
+        }
+    }
+    int types[TYPE_COUNT], type_count = split_list(types_arg, items, TYPE_COUNT);
+    for (int i = 0; i < type_count; i++) {
+        if ((types[i] = find_name(items[i], type_names, TYPE_COUNT)) < 0) {
+            printf("Error: Unknown type %s\n", items[i]);
+            return 1;
+        }
+    }
+    // --algos names sorts, or selections in --k mode
+    int k_mode = k_arg[0] != '\0';
+    int algo_total = k_mode ? SELECTION_COUNT : ALGORITHM_COUNT;
+    const char* algo_names[MAX_LIST];
+    for (int a = 0; a < algo_total; a++) algo_names[a] = k_mode ? selections[a].name : algorithms[a].name;
+    int algos[MAX_LIST], algo_count = algo_total;
+    if (algos_arg[0]) {
+        algo_count = split_list(algos_arg, items, algo_total);
+        for (int i = 0; i < algo_count; i++) {
+            if ((algos[i] = find_name(items[i], algo_names, algo_total)) < 0) {
+                printf("Error: Unknown algorithm %s\n", items[i]);
+                return 1;
+            }
+        }
+    } else {
+        for (int a = 0; a < algo_total; a++) algos[a] = a;
+    }
 
-    // Bubble Sort
-    start = clock();
-    bubble_sort(arr1, SIZE);
-    end = clock();
-    time_taken = ((double)(end - start)) / CLOCKS_PER_SEC;
-    printf("Bubble Sort Time: %.4f seconds\n", time_taken);
+    if (k_mode) {
+        size_t ks[MAX_LIST];
+        int k_count = split_list(k_arg, items, MAX_LIST);
+        for (int i = 0; i < k_count; i++) {
+            if (strcmp(items[i], "median") == 0) {
+                ks[i] = 0;
+            } else if (!parse_count(items[i], &ks[i])) {
+                printf("Error: Bad k %s\n", items[i]);
+                return 1;
+            }
+        }
+        int capacity = size_count * dist_count * type_count * algo_count * k_count;
+        Result* results = malloc((capacity ? capacity : 1) * sizeof(Result));
+        if (!results) {
+            printf("Error: Can't allocate memory!\n");
+            return 1;
+        }
+        int count = 0;
+        int failures = benchmark_selection(sizes, size_count, dists, dist_count, types, type_count, algos,
+                                           algo_count, ks, k_count, reps, seed, range, results, &count);
+        if (csv) write_csv(csv, results, count);
+        if (json) write_json(json, results, count);
+        free(results);
+        return failures ? 1 : 0;
+    }
 
-    // Selection Sort
-    start = clock();
-    selection_sort(arr2, SIZE);
-    end = clock();
-    time_taken = ((double)(end - start)) / CLOCKS_PER_SEC;
-    printf("Selection Sort Time: %.4f seconds\n", time_taken);
+    // Pool sizes: doubling up to every online core unless listed
+    int threads[MAX_LIST], thread_count = 0;
+    if (threads_arg[0]) {
+        thread_count = split_list(threads_arg, items, MAX_LIST);
+        for (int i = 0; i < thread_count; i++) {
+            threads[i] = atoi(items[i]);
+            if (threads[i] < 1 || threads[i] > MAX_THREADS) {
+                printf("Error: Bad thread count %s\n", items[i]);
+                return 1;
+            }
+        }
+    } else {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cores < 1) cores = 1;
+        if (cores > MAX_THREADS) cores = MAX_THREADS;
+        for (int t = 1; t < cores && thread_count < MAX_LIST - 1; t *= 2) threads[thread_count++] = t;
+        threads[thread_count++] = (int)cores;
+    }
+
+    // The stack-copying merge sort needs about one array's worth of stack
+    struct rlimit stack;
+    size_t stack_bytes = getrlimit(RLIMIT_STACK, &stack) == 0 && stack.rlim_cur != RLIM_INFINITY
+                         ? (size_t)stack.rlim_cur : SIZE_MAX;
 
-    // Merge Sort
-    start = clock();
-    merge_sort(arr3, 0, SIZE - 1);
-    end = clock();
-    time_taken = ((double)(end - start)) / CLOCKS_PER_SEC;
-    printf("Merge Sort Time: %.4f seconds\n", time_taken);
+    int capacity = size_count * dist_count * type_count * algo_count * thread_count;
+    Result* results = malloc((capacity ? capacity : 1) * sizeof(Result));
+    double* times = malloc(reps * sizeof(double));
+    if (!results || !times) {
+        printf("Error: Can't allocate memory!\n");
+        return 1;
+    }
+    int count = 0, failures = 0;
+
+    printf("%-12s %-4s %-11s %11s %4s %11s %11s %11s %9s %8s  %s\n", "algo", "type", "dist", "size",
+           "thr", "median ms", "min ms", "stddev ms", "ns/elem", "speedup", "check");
+    for (int t = 0; t < type_count; t++) {
+        ElemType type = types[t];
+        for (int s = 0; s < size_count; s++) {
+            size_t n = sizes[s];
+            void* original = malloc(n * type_sizes[type]);
+            void* work = malloc(n * type_sizes[type]);
+            if (!original || !work) {
+                printf("Error: Can't allocate %zu %s elements!\n", n, type_names[type]);
+                free(original);
+                free(work);
+                failures++;
+                continue;
+            }
+            for (int d = 0; d < dist_count; d++) {
+                fill_array(original, type, n, dists[d], range, seed);
+                uint64_t expected = check_fingerprint[type](original, n);
+                for (int a = 0; a < algo_count; a++) {
+                    const Algorithm* algo = &algorithms[algos[a]];
+                    const char* skip = NULL;
+                    if (!algo->run[type]) skip = "skipped (no version for this type)";
+                    if (algo->quadratic && n > quadratic_limit) skip = "skipped (O(n^2), see --quadratic-limit)";
+                    if (algo->stack_bound && n * type_sizes[type] > stack_bytes / 2) skip = "skipped (stack too small)";
+                    if (skip) {
+                        printf("%-12s %-4s %-11s %11zu  %s\n", algo->name, type_names[type],
+                               dist_names[dists[d]], n, skip);
+                        continue;
+                    }
 
-    return 0;
-}
\ No newline at end of file
+                    double base_ms = 0.0;
+                    for (int th = 0; th < (algo->parallel ? thread_count : 1); th++) {
+                        ThreadPool* pool = NULL;
+                        if (algo->parallel && !(pool = pool_create(threads[th]))) {
+                            printf("Error: Can't start %d threads!\n", threads[th]);
+                            failures++;
+                            continue;
+                        }
+                        Result* r = &results[count++];
+                        r->algo = algo->name;
+                        r->type = type_names[type];
+                        r->dist = dist_names[dists[d]];
+                        r->size = n;
+                        r->k = 0;
+                        r->threads = pool ? pool->threads : 1;
+                        r->reps = reps;
+                        r->sorted = 1;
+                        for (int rep = 0; rep < reps; rep++) {
+                            memcpy(work, original, n * type_sizes[type]);
+                            double start = now_seconds();
+                            algo->run[type](work, n, pool);
+                            times[rep] = now_seconds() - start;
+                            r->sorted = r->sorted && check_sorted[type](work, n) &&
+                                        check_fingerprint[type](work, n) == expected;
+                        }
+                        pool_destroy(pool);
+                        summarize(times, reps, r);
+                        if (th == 0) base_ms = r->median_ms;
+                        r->speedup = algo->parallel && r->median_ms > 0 ? base_ms / r->median_ms : 0.0;
+                        failures += !r->sorted;
+                        char speedup[16] = "-";
+                        if (algo->parallel) snprintf(speedup, sizeof(speedup), "%.2fx", r->speedup);
+                        printf("%-12s %-4s %-11s %11zu %4d %11.3f %11.3f %11.3f %9.2f %8s  %s\n",
+                               r->algo, r->type, r->dist, n, r->threads, r->median_ms, r->min_ms,
+                               r->stddev_ms, r->ns_per_elem, speedup, r->sorted ? "ok" : "NOT SORTED");
+                        fflush(stdout);
+                    }
+                }
+            }
+            free(original);
+            free(work);
+        }
+    }
+
+    if (csv) write_csv(csv, results, count);
+    if (json) write_json(json, results, count);
+    free(results);
+    free(times);
+    return failures ? 1 : 0;
+}
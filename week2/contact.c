@@ -236,6 +236,24 @@ void search_contacts(ContactManager *manager, const char *query) {
     }
 }
 
+// sort_by_name(contacts, count): case-insensitive by name, see include/key_sort.h
+#define KEY_SORT_NAME sort_by_name
+#define KEY_SORT_T Contact
+#define KEY_SORT_PREFIX(c) key_prefix_casefold((c)->name)
+#define KEY_SORT_LESS(a, b) (key_casecmp((a)->name, (b)->name) < 0)
+#include "include/key_sort.h"
+
+int sort_contacts(ContactManager *manager) {
+    if (!manager) return 0;
+    
+    if (!sort_by_name(manager->contacts, manager->count)) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 0;
+    }
+    printf("Sorted %d contacts by name\n", manager->count);
+    return 1;
+}
+
 void list_all_contacts(ContactManager *manager) {
     if (!manager) return;
     
@@ -270,6 +288,7 @@ void print_usage(const char *program_name) {
     printf("  -a <name> <phone> <email>  Add a new contact\n");
     printf("  -r <name>              Remove contact by name\n");
     printf("  -s <query>             Search contacts\n");
+    printf("  -o                     Sort contacts by name (ignoring case)\n");
     printf("  -h                     Show this help message\n\n");
     printf("  -i                     Enter contacts interactively via stdin\n");
 
@@ -31,6 +31,7 @@ int save_contacts_to_csv(ContactManager *manager, const char *filename);
 int add_contact(ContactManager *manager, const char *name, const char *phone, const char *email);
 int remove_contact(ContactManager *manager, const char *name);
 void search_contacts(ContactManager *manager, const char *query);
+int sort_contacts(ContactManager *manager);
 void list_all_contacts(ContactManager *manager);
 void print_usage(const char *program_name);
 int resize_contact_array(ContactManager *manager);
@@ -53,6 +53,14 @@ int main(int argc, char *argv[]) {
             search_contacts(manager, argv[i + 1]);
             i += 2;
         }
+        else if (strcmp(argv[i], "-o") == 0) {
+            // Sort contacts by name
+            if (!sort_contacts(manager)) {
+                destroy_contact_manager(manager);
+                return 1;
+            }
+            i++;
+        }
         else if (strcmp(argv[i], "-i") == 0) {
             // Interactive mode: read contacts from user input
             interactive_add_contacts(manager);
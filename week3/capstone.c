@@ -19,7 +19,7 @@ int binarySearch(int arr[], int n, int target) {
     int left = 0, right = n - 1;
     
     while (left <= right) {
-        int mid = (left + right) / 2;
+        int mid = left + (right - left) / 2;  // (left + right) / 2 can overflow
 
         if (arr[mid] == target)
             return mid; // Found at index mid
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  // strcasestr
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -162,12 +163,12 @@ void delete_contact(Contact **contacts, int *count) {
     printf("[INFO] Contact deleted.\n");
 }
 
-// Compare function for qsort
-int compare_contacts(const void *a, const void *b) {
-    const Contact *c1 = (const Contact *)a;
-    const Contact *c2 = (const Contact *)b;
-    return strcasecmp(c1->name, c2->name);
-}
+// Sort by name, ignoring case: sort_by_name(contacts, count) from include/key_sort.h
+#define KEY_SORT_NAME sort_by_name
+#define KEY_SORT_T Contact
+#define KEY_SORT_PREFIX(c) key_prefix_casefold((c)->name)
+#define KEY_SORT_LESS(a, b) (key_casecmp((a)->name, (b)->name) < 0)
+#include "include/key_sort.h"
 
 // Sort contacts alphabetically
 void sort_contacts(Contact *contacts, int count) {
@@ -176,7 +177,10 @@ void sort_contacts(Contact *contacts, int count) {
         return;
     }
 
-    qsort(contacts, count, sizeof(Contact), compare_contacts);
+    if (!sort_by_name(contacts, count)) {
+        perror("Memory allocation failed");
+        return;
+    }
     printf("[INFO] Contacts sorted alphabetically by name.\n");
 }
 
@@ -2,6 +2,18 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <strings.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 // BMP file headers (simplified)
 typedef struct {
@@ -32,19 +44,673 @@ typedef struct {
     uint8_t red;
 } Pixel;
 
+// How pixels are kept in memory (see convert_layout)
+typedef enum { LAYOUT_PACKED, LAYOUT_PLANAR, LAYOUT_BGRX } PixelLayout;
+
 // Our image structure
 typedef struct {
     BMPHeader header;
     BMPInfoHeader info;
     int width;
     int height;
-    Pixel* pixels;      // Pointer to pixel array
+    Pixel* pixels;      // Pointer to pixel array (LAYOUT_PACKED)
     int padding;        // Padding bytes per row
+    PixelLayout layout;
+    uint8_t* planar;    // LAYOUT_PLANAR: blue plane, then green, then red
+    uint32_t* bgrx;     // LAYOUT_BGRX: one 32-bit word per pixel
 } Image;
 
-// Function to read BMP file
-Image* load_bmp(char* filename) {
-    printf("Loading %s...\n", filename);
+// Progress messages can be switched off (batch mode runs many images at
+// once). Per thread, so code that silences itself for a moment doesn't
+// race with workers reading it; batch and index workers set their own.
+__thread int quiet = 0;
+#define progress(...) do { if (!quiet) printf(__VA_ARGS__); } while (0)
+
+// Seconds from a monotonic clock, for throughput reports
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ---------------------------------------------------------------
+// Instrumentation: build with -DIMAGE_TRACE (make TRACE=1) to record
+// a span for every load, operation, save and free, with the bytes it
+// touched and the peak memory so far. Without the flag the TRACE_*
+// macros expand to nothing.
+// ---------------------------------------------------------------
+
+#ifdef IMAGE_TRACE
+
+typedef struct {
+    char name[32];
+    double start;        // Seconds, monotonic clock
+    double end;
+    uint64_t bytes;      // Bytes of pixels processed
+    long peak_rss_kb;    // Peak resident memory when the span ended
+    int thread;
+} TraceSpan;
+
+static TraceSpan* trace_spans = NULL;
+static int trace_count = 0;
+static int trace_capacity = 0;
+static double trace_origin = 0.0;
+static int trace_threads = 0;
+static __thread int trace_thread_id = -1;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void trace_record_span(const char* name, double start, double end, uint64_t bytes) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    
+    pthread_mutex_lock(&trace_lock);
+    if (trace_thread_id < 0) {
+        trace_thread_id = trace_threads++;
+    }
+    if (trace_count == trace_capacity) {
+        int capacity = trace_capacity ? trace_capacity * 2 : 256;
+        TraceSpan* bigger = realloc(trace_spans, capacity * sizeof(TraceSpan));
+        if (!bigger) {
+            pthread_mutex_unlock(&trace_lock);
+            return;
+        }
+        trace_spans = bigger;
+        trace_capacity = capacity;
+    }
+    TraceSpan* span = &trace_spans[trace_count++];
+    snprintf(span->name, sizeof(span->name), "%s", name);
+    span->start = start;
+    span->end = end;
+    span->bytes = bytes;
+    span->peak_rss_kb = usage.ru_maxrss;
+    span->thread = trace_thread_id;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_record(const char* name, double start, uint64_t bytes) {
+    trace_record_span(name, start, now_seconds(), bytes);
+}
+
+#define TRACE_BEGIN(span) double span = now_seconds()
+#define TRACE_END(span, name, bytes) trace_record((name), span, (uint64_t)(bytes))
+#define TRACE_SPAN(name, start, end, bytes) trace_record_span((name), (start), (end), (uint64_t)(bytes))
+
+#else
+
+// sizeof keeps byte counts "used" without evaluating them
+#define TRACE_BEGIN(span) ((void)0)
+#define TRACE_END(span, name, bytes) ((void)sizeof(bytes))
+#define TRACE_SPAN(name, start, end, bytes) ((void)(name), (void)(start), (void)sizeof(bytes))
+
+#endif
+
+// Where to report spans: NULL (off), "table", or a .json file for chrome://tracing
+const char* trace_output = NULL;
+
+static void trace_start(void) {
+#ifdef IMAGE_TRACE
+    trace_origin = now_seconds();
+#endif
+}
+
+// Print or write everything recorded so far
+static void trace_report(void) {
+#ifdef IMAGE_TRACE
+    if (!trace_output) {
+        return;
+    }
+    
+    if (strcmp(trace_output, "table") != 0) {
+        FILE* file = fopen(trace_output, "w");
+        if (!file) {
+            printf("Error: Can't create %s!\n", trace_output);
+            return;
+        }
+        fprintf(file, "{\"traceEvents\": [\n");
+        for (int i = 0; i < trace_count; i++) {
+            TraceSpan* s = &trace_spans[i];
+            fprintf(file, "  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                          "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"bytes\": %llu, "
+                          "\"peak_rss_kb\": %ld}}%s\n",
+                    s->name, s->thread, (s->start - trace_origin) * 1e6, (s->end - s->start) * 1e6,
+                    (unsigned long long)s->bytes, s->peak_rss_kb, i + 1 < trace_count ? "," : "");
+        }
+        fprintf(file, "]}\n");
+        fclose(file);
+        printf("Trace with %d spans written to %s\n", trace_count, trace_output);
+    } else {
+        // One row per span name: calls, total and mean time, throughput
+        printf("\n%-16s %7s %12s %12s %12s %10s\n", "Stage", "Calls", "Total (ms)", "Mean (ms)",
+               "Bytes", "MB/s");
+        long peak = 0;
+        for (int i = 0; i < trace_count; i++) {
+            if (trace_spans[i].peak_rss_kb > peak) peak = trace_spans[i].peak_rss_kb;
+            
+            // Only the first span with each name prints the row
+            int seen = 0;
+            for (int j = 0; j < i && !seen; j++) {
+                seen = strcmp(trace_spans[j].name, trace_spans[i].name) == 0;
+            }
+            if (seen) continue;
+            
+            int calls = 0;
+            double total = 0.0;
+            uint64_t bytes = 0;
+            for (int j = i; j < trace_count; j++) {
+                if (strcmp(trace_spans[j].name, trace_spans[i].name) == 0) {
+                    calls++;
+                    total += trace_spans[j].end - trace_spans[j].start;
+                    bytes += trace_spans[j].bytes;
+                }
+            }
+            printf("%-16s %7d %12.3f %12.3f %12llu %10.1f\n", trace_spans[i].name, calls,
+                   total * 1e3, total * 1e3 / calls, (unsigned long long)bytes,
+                   total > 0 ? bytes / (1024.0 * 1024.0) / total : 0.0);
+        }
+        printf("Peak memory: %.1f MB\n", peak / 1024.0);
+    }
+    free(trace_spans);
+    trace_spans = NULL;
+    trace_count = trace_capacity = 0;
+#else
+    if (trace_output) {
+        printf("Tracing is not compiled in, rebuild with make TRACE=1\n");
+    }
+#endif
+}
+
+// Keep header fields in step with a new size (for save_bmp)
+void set_image_size(Image* img, int width, int height) {
+    img->width = width;
+    img->height = height;
+    img->padding = (4 - (width * 3) % 4) % 4;
+    img->header.offset = sizeof(BMPHeader) + sizeof(BMPInfoHeader);
+    img->info.size = sizeof(BMPInfoHeader);
+    img->info.width = width;
+    img->info.height = height;
+    img->info.imagesize = (uint32_t)(width * 3 + img->padding) * height;
+    img->header.size = img->header.offset + img->info.imagesize;
+}
+
+// Compression types we understand
+#define BI_RGB       0
+#define BI_RLE8      1
+#define BI_BITFIELDS 3
+
+// Bits per pixel save_bmp writes: 24 (packed) or 32 (BGRX, 4-byte aligned)
+int output_bits = 24;
+
+// Read and check the BMP headers at the start of a file
+int read_bmp_headers(FILE* file, BMPHeader* header, BMPInfoHeader* info) {
+    // Read BMP headers
+    if (fread(header, sizeof(BMPHeader), 1, file) != 1 ||
+        fread(info, sizeof(BMPInfoHeader), 1, file) != 1) {
+        printf("Error: File is too short to be a BMP!\n");
+        return 0;
+    }
+    
+    // Check if it's a valid BMP
+    if (header->type != 0x4D42) {  // "BM" in hex
+        printf("Error: Not a BMP file!\n");
+        return 0;
+    }
+    
+    // Supported: 8-bit paletted (plain or RLE8), 16/32-bit (plain or bitfields), 24-bit
+    int bits = info->bits;
+    int comp = info->compression;
+    int supported = (bits == 24 && comp == BI_RGB) ||
+                    (bits == 8 && (comp == BI_RGB || comp == BI_RLE8)) ||
+                    ((bits == 16 || bits == 32) && (comp == BI_RGB || comp == BI_BITFIELDS));
+    if (!supported) {
+        printf("Error: Unsupported BMP format (%d-bit, compression %d)!\n", bits, comp);
+        return 0;
+    }
+    if (info->width <= 0 || info->height == 0) {
+        printf("Error: Bad image size!\n");
+        return 0;
+    }
+    return 1;
+}
+
+// One bitfield mask turned into a shift and a scale to 8 bits
+typedef struct {
+    uint32_t mask;
+    int shift;
+    uint32_t max;
+} Channel;
+
+static Channel make_channel(uint32_t mask) {
+    Channel ch = {mask, 0, 0};
+    if (mask) {
+        while (!(mask & 1)) {
+            mask >>= 1;
+            ch.shift++;
+        }
+        ch.max = mask;
+    }
+    return ch;
+}
+
+static inline uint8_t channel_value(const Channel* ch, uint32_t px) {
+    if (!ch->max) return 0;
+    uint32_t v = (px & ch->mask) >> ch->shift;
+    return ch->max == 255 ? (uint8_t)v : (uint8_t)((v * 255 + ch->max / 2) / ch->max);
+}
+
+#ifdef __SSE2__
+// BGRA -> BGR, 4 pixels per shuffle when the CPU has SSSE3
+__attribute__((target("ssse3")))
+static void unpack_bgra_ssse3(const uint8_t* src, Pixel* dst, int width) {
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+                                          -1, -1, -1, -1);
+    uint8_t* d = (uint8_t*)dst;
+    int x = 0;
+    // Stores are 16 bytes wide but only 12 are kept, so stop one group early
+    for (; x + 6 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + x * 4));
+        _mm_storeu_si128((__m128i*)(d + x * 3), _mm_shuffle_epi8(v, shuffle));
+    }
+    for (; x < width; x++) {
+        d[x * 3] = src[x * 4];
+        d[x * 3 + 1] = src[x * 4 + 1];
+        d[x * 3 + 2] = src[x * 4 + 2];
+    }
+}
+
+#endif
+
+static void unpack_bgra(const uint8_t* src, Pixel* dst, int width) {
+#ifdef __SSE2__
+    if (__builtin_cpu_supports("ssse3")) {
+        unpack_bgra_ssse3(src, dst, width);
+        return;
+    }
+#endif
+    for (int x = 0; x < width; x++) {
+        dst[x].blue = src[x * 4];
+        dst[x].green = src[x * 4 + 1];
+        dst[x].red = src[x * 4 + 2];
+    }
+}
+
+#ifdef __SSE2__
+// BGR -> BGRX for 32-bit output
+__attribute__((target("ssse3")))
+static void pack_bgrx_ssse3(const Pixel* src, uint8_t* dst, int width) {
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1,
+                                          9, 10, 11, -1);
+    const uint8_t* s = (const uint8_t*)src;
+    int x = 0;
+    // Loads are 16 bytes wide but only 12 are used, so stop one group early
+    for (; x + 6 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + x * 3));
+        _mm_storeu_si128((__m128i*)(dst + x * 4), _mm_shuffle_epi8(v, shuffle));
+    }
+    for (; x < width; x++) {
+        dst[x * 4] = s[x * 3];
+        dst[x * 4 + 1] = s[x * 3 + 1];
+        dst[x * 4 + 2] = s[x * 3 + 2];
+        dst[x * 4 + 3] = 0;
+    }
+}
+
+#endif
+
+static void pack_bgrx(const Pixel* src, uint8_t* dst, int width) {
+#ifdef __SSE2__
+    if (__builtin_cpu_supports("ssse3")) {
+        pack_bgrx_ssse3(src, dst, width);
+        return;
+    }
+#endif
+    for (int x = 0; x < width; x++) {
+        dst[x * 4] = src[x].blue;
+        dst[x * 4 + 1] = src[x].green;
+        dst[x * 4 + 2] = src[x].red;
+        dst[x * 4 + 3] = 0;
+    }
+}
+
+#ifdef __SSE2__
+// 8-bit palette -> BGR, 8 pixels per gather when the CPU has AVX2. The
+// palette is held as BGRX words so one gather fetches 8 whole entries.
+__attribute__((target("avx2")))
+static void expand_palette_avx2(const uint32_t* palette, const uint8_t* src, Pixel* dst, int width) {
+    const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                             0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    uint8_t* d = (uint8_t*)dst;
+    int x = 0;
+    // Each half is stored 16 bytes wide but only 12 are kept, so stop one group early
+    for (; x + 10 <= width; x += 8) {
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + x)));
+        __m256i px = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int*)palette, idx, 4), shuffle);
+        _mm_storeu_si128((__m128i*)(d + x * 3), _mm256_castsi256_si128(px));
+        _mm_storeu_si128((__m128i*)(d + x * 3 + 12), _mm256_extracti128_si256(px, 1));
+    }
+    for (; x < width; x++) {
+        uint32_t entry = palette[src[x]];
+        d[x * 3] = (uint8_t)entry;
+        d[x * 3 + 1] = (uint8_t)(entry >> 8);
+        d[x * 3 + 2] = (uint8_t)(entry >> 16);
+    }
+}
+
+#endif
+
+// Decode BI_RLE8 data into one palette index per pixel (rows in file order)
+static int decode_rle8(const uint8_t* data, size_t size, uint8_t* indices, int width, int height) {
+    int x = 0, y = 0;
+    size_t i = 0;
+    
+    while (i + 1 < size && y < height) {
+        int count = data[i++];
+        int value = data[i++];
+        if (count > 0) {
+            // Encoded run: count copies of value
+            for (int k = 0; k < count && x < width; k++) {
+                indices[(size_t)y * width + x++] = (uint8_t)value;
+            }
+        } else if (value == 0) {
+            x = 0;      // End of line
+            y++;
+        } else if (value == 1) {
+            return 1;   // End of bitmap
+        } else if (value == 2) {
+            if (i + 1 >= size) break;
+            x += data[i++];  // Delta: skip right and down
+            y += data[i++];
+        } else {
+            // Absolute run of 'value' literal bytes, padded to a 16-bit boundary
+            if (i + value > size) break;
+            for (int k = 0; k < value; k++) {
+                if (x < width) {
+                    indices[(size_t)y * width + x++] = data[i + k];
+                }
+            }
+            i += value + (value & 1);
+        }
+    }
+    return y <= height;
+}
+
+// Everything needed to turn one stored row of an uncompressed BMP into pixels
+typedef struct {
+    int bits;
+    Pixel palette[256];
+    uint32_t palette_bgrx[256];  // Same entries as words, for the gather
+    Channel red, green, blue;
+    int standard_32;  // 32-bit with the usual BGRA masks, so unpack_bgra applies
+} RowFormat;
+
+// Read the palette or bitfield masks that sit between the headers and the pixel data
+static int read_row_format(FILE* file, const BMPInfoHeader* info, RowFormat* fmt) {
+    memset(fmt, 0, sizeof(*fmt));
+    fmt->bits = info->bits;
+    if (fmt->bits == 8) {
+        int colours = info->ncolours ? (int)info->ncolours : 256;
+        if (colours > 256) colours = 256;
+        uint8_t entries[256 * 4];
+        fseek(file, sizeof(BMPHeader) + info->size, SEEK_SET);
+        if (fread(entries, 4, colours, file) != (size_t)colours) {
+            printf("Error: Palette is truncated!\n");
+            return 0;
+        }
+        for (int i = 0; i < colours; i++) {
+            fmt->palette[i].blue = entries[i * 4];
+            fmt->palette[i].green = entries[i * 4 + 1];
+            fmt->palette[i].red = entries[i * 4 + 2];
+            fmt->palette_bgrx[i] = entries[i * 4] | entries[i * 4 + 1] << 8 |
+                                   (uint32_t)entries[i * 4 + 2] << 16;
+        }
+    } else if (info->compression == BI_BITFIELDS) {
+        uint32_t masks[3];
+        fseek(file, sizeof(BMPHeader) + sizeof(BMPInfoHeader), SEEK_SET);
+        if (fread(masks, sizeof(uint32_t), 3, file) != 3) {
+            printf("Error: Bitfield masks are truncated!\n");
+            return 0;
+        }
+        fmt->red = make_channel(masks[0]);
+        fmt->green = make_channel(masks[1]);
+        fmt->blue = make_channel(masks[2]);
+    } else if (fmt->bits == 16) {
+        fmt->red = make_channel(0x7C00);  // Plain 16-bit is 5-5-5
+        fmt->green = make_channel(0x03E0);
+        fmt->blue = make_channel(0x001F);
+    } else {
+        fmt->red = make_channel(0x00FF0000);
+        fmt->green = make_channel(0x0000FF00);
+        fmt->blue = make_channel(0x000000FF);
+    }
+    fmt->standard_32 = fmt->bits == 32 && fmt->red.mask == 0x00FF0000 &&
+                       fmt->green.mask == 0x0000FF00 && fmt->blue.mask == 0x000000FF;
+    return 1;
+}
+
+// Convert 'count' stored pixels starting at 'src' (any uncompressed format)
+static void decode_row(const RowFormat* fmt, const uint8_t* src, Pixel* dst, int count) {
+    if (fmt->bits == 24) {
+        memcpy(dst, src, (size_t)count * 3);
+    } else if (fmt->bits == 8) {
+#ifdef __SSE2__
+        if (__builtin_cpu_supports("avx2")) {
+            expand_palette_avx2(fmt->palette_bgrx, src, dst, count);
+            return;
+        }
+#endif
+        for (int x = 0; x < count; x++) {
+            dst[x] = fmt->palette[src[x]];
+        }
+    } else if (fmt->standard_32) {
+        unpack_bgra(src, dst, count);
+    } else {
+        for (int x = 0; x < count; x++) {
+            uint32_t px = fmt->bits == 16 ? (uint32_t)(src[x * 2] | src[x * 2 + 1] << 8)
+                                          : (uint32_t)src[x * 4] | (uint32_t)src[x * 4 + 1] << 8 |
+                                            (uint32_t)src[x * 4 + 2] << 16 | (uint32_t)src[x * 4 + 3] << 24;
+            dst[x].red = channel_value(&fmt->red, px);
+            dst[x].green = channel_value(&fmt->green, px);
+            dst[x].blue = channel_value(&fmt->blue, px);
+        }
+    }
+}
+
+// Decode the pixel data of any supported format into 24-bit pixels
+static int read_bmp_pixels(FILE* file, Image* img) {
+    int width = img->width;
+    int height = img->height;
+    int bits = img->info.bits;
+    int bottom_up = img->info.height > 0;
+    size_t stride = ((size_t)bits * width + 31) / 32 * 4;  // Rows are padded to 4 bytes
+    
+    RowFormat fmt;
+    if (!read_row_format(file, &img->info, &fmt)) {
+        return 0;
+    }
+    
+    fseek(file, img->header.offset, SEEK_SET);
+    
+    if (img->info.compression == BI_RLE8) {
+        // Decode the whole compressed stream, then expand through the palette
+        struct stat st;
+        fstat(fileno(file), &st);
+        size_t size = st.st_size > (off_t)img->header.offset ? st.st_size - img->header.offset : 0;
+        uint8_t* data = malloc(size ? size : 1);
+        uint8_t* indices = calloc((size_t)width * height, 1);
+        int ok = data && indices && fread(data, 1, size, file) == size &&
+                 decode_rle8(data, size, indices, width, height);
+        if (ok) {
+            for (int r = 0; r < height; r++) {
+                decode_row(&fmt, indices + (size_t)r * width,
+                           &img->pixels[(size_t)(bottom_up ? height - 1 - r : r) * width], width);
+            }
+        } else {
+            printf("Error: Bad RLE8 data!\n");
+        }
+        free(data);
+        free(indices);
+        return ok;
+    }
+    
+    uint8_t* row = malloc(stride);
+    if (!row) {
+        printf("Error: Can't allocate row buffer!\n");
+        return 0;
+    }
+    
+    int ok = 1;
+    for (int r = 0; r < height && ok; r++) {
+        Pixel* d = &img->pixels[(size_t)(bottom_up ? height - 1 - r : r) * width];
+        
+        // 24-bit rows go straight into the pixel array
+        uint8_t* s = bits == 24 ? (uint8_t*)d : row;
+        if (fread(s, 1, bits == 24 ? (size_t)width * 3 : stride, file)
+            != (bits == 24 ? (size_t)width * 3 : stride)) {
+            printf("Error: Pixel data is truncated!\n");
+            ok = 0;
+            break;
+        }
+        
+        if (bits == 24) {
+            fseek(file, stride - (size_t)width * 3, SEEK_CUR);
+        } else {
+            decode_row(&fmt, s, d, width);
+        }
+    }
+    free(row);
+    return ok;
+}
+
+// ---------------------------------------------------------------
+// Pixel layouts: packed 3-byte BGR (the file format), planar (one
+// byte array per channel) or BGRX (one aligned 32-bit word per pixel).
+// Images are converted once after loading and once before saving;
+// operations either have their own code for each layout or convert
+// back to packed first (see run_operation).
+// ---------------------------------------------------------------
+
+// Layout load_bmp converts to, set with --layout
+PixelLayout load_layout = LAYOUT_PACKED;
+
+const char* layout_name(PixelLayout layout) {
+    switch (layout) {
+        case LAYOUT_PLANAR: return "planar";
+        case LAYOUT_BGRX:   return "bgrx";
+        default:            return "packed";
+    }
+}
+
+int parse_layout(const char* name, PixelLayout* layout) {
+    if (strcmp(name, "packed") == 0) *layout = LAYOUT_PACKED;
+    else if (strcmp(name, "planar") == 0) *layout = LAYOUT_PLANAR;
+    else if (strcmp(name, "bgrx") == 0) *layout = LAYOUT_BGRX;
+    else return 0;
+    return 1;
+}
+
+// 64-byte aligned so vector loads never straddle a cache line at row 0
+static void* alloc_aligned(size_t bytes) {
+    void* p = NULL;
+    return posix_memalign(&p, 64, bytes ? bytes : 1) == 0 ? p : NULL;
+}
+
+// Start of channel c (0 = blue, 1 = green, 2 = red) in a planar image
+static inline uint8_t* image_plane(const Image* img, int c) {
+    return img->planar + (size_t)c * img->width * img->height;
+}
+
+// Copy row r of any layout into packed pixels
+static void layout_row_to_packed(const Image* img, int r, Pixel* out) {
+    size_t offset = (size_t)r * img->width;
+    if (img->layout == LAYOUT_PACKED) {
+        memcpy(out, &img->pixels[offset], (size_t)img->width * sizeof(Pixel));
+    } else if (img->layout == LAYOUT_BGRX) {
+        unpack_bgra((const uint8_t*)&img->bgrx[offset], out, img->width);
+    } else {
+        const uint8_t* b = image_plane(img, 0) + offset;
+        const uint8_t* g = image_plane(img, 1) + offset;
+        const uint8_t* rd = image_plane(img, 2) + offset;
+        for (int x = 0; x < img->width; x++) {
+            out[x].blue = b[x];
+            out[x].green = g[x];
+            out[x].red = rd[x];
+        }
+    }
+}
+
+// Build the planar or BGRX copy of a packed image and switch to it. The
+// packed array is left alone (img->pixels becomes NULL), so whoever owns
+// it decides whether to free or keep it. Returns 0 if out of memory.
+static int layout_from_packed(Image* img, PixelLayout layout) {
+    size_t total = (size_t)img->width * img->height;
+    if (layout == LAYOUT_BGRX) {
+        img->bgrx = alloc_aligned(total * sizeof(uint32_t));
+        if (!img->bgrx) {
+            printf("Error: Can't allocate pixel memory!\n");
+            return 0;
+        }
+        for (int r = 0; r < img->height; r++) {
+            pack_bgrx(&img->pixels[(size_t)r * img->width],
+                      (uint8_t*)&img->bgrx[(size_t)r * img->width], img->width);
+        }
+    } else if (layout == LAYOUT_PLANAR) {
+        img->planar = alloc_aligned(total * 3);
+        if (!img->planar) {
+            printf("Error: Can't allocate pixel memory!\n");
+            return 0;
+        }
+        uint8_t* b = image_plane(img, 0);
+        uint8_t* g = image_plane(img, 1);
+        uint8_t* rd = image_plane(img, 2);
+        for (size_t i = 0; i < total; i++) {
+            b[i] = img->pixels[i].blue;
+            g[i] = img->pixels[i].green;
+            rd[i] = img->pixels[i].red;
+        }
+    } else {
+        return 1;
+    }
+    img->pixels = NULL;
+    img->layout = layout;
+    return 1;
+}
+
+// Switch the image to another layout. Returns 0 if out of memory.
+int convert_layout(Image* img, PixelLayout layout) {
+    if (img->layout == layout) {
+        return 1;
+    }
+    size_t total = (size_t)img->width * img->height;
+    
+    // Everything goes through packed, so at most two steps
+    if (img->layout != LAYOUT_PACKED) {
+        Pixel* packed = malloc(total * sizeof(Pixel));
+        if (!packed) {
+            printf("Error: Can't allocate pixel memory!\n");
+            return 0;
+        }
+        for (int r = 0; r < img->height; r++) {
+            layout_row_to_packed(img, r, &packed[(size_t)r * img->width]);
+        }
+        free(img->planar);
+        free(img->bgrx);
+        img->planar = NULL;
+        img->bgrx = NULL;
+        img->pixels = packed;
+        img->layout = LAYOUT_PACKED;
+    }
+    
+    Pixel* packed = img->pixels;
+    if (!layout_from_packed(img, layout)) {
+        return 0;
+    }
+    if (layout != LAYOUT_PACKED) {
+        free(packed);
+    }
+    return 1;
+}
+
+static Image* read_bmp_file(char* filename, Pixel* reuse, size_t reuse_bytes) {
+    progress("Loading %s...\n", filename);
     
     FILE* file = fopen(filename, "rb");
     if (!file) {
@@ -60,39 +726,28 @@ Image* load_bmp(char* filename) {
         return NULL;
     }
     
-    // Read BMP headers
-    fread(&img->header, sizeof(BMPHeader), 1, file);
-    fread(&img->info, sizeof(BMPInfoHeader), 1, file);
-    
-    // Check if it's a valid BMP
-    if (img->header.type != 0x4D42) {  // "BM" in hex
-        printf("Error: Not a BMP file!\n");
-        free(img);
-        fclose(file);
-        return NULL;
-    }
-    
-    // Only handle 24-bit BMPs (no compression)
-    if (img->info.bits != 24 || img->info.compression != 0) {
-        printf("Error: Only 24-bit uncompressed BMPs supported!\n");
+    if (!read_bmp_headers(file, &img->header, &img->info)) {
         free(img);
         fclose(file);
         return NULL;
     }
+    img->layout = LAYOUT_PACKED;
+    img->planar = NULL;
+    img->bgrx = NULL;
     
-    // Get image dimensions
+    // Get image dimensions (negative height means rows are stored top-down)
     img->width = img->info.width;
-    img->height = img->info.height;
+    img->height = abs(img->info.height);
     
     // Calculate padding (BMP rows must be multiple of 4 bytes)
     img->padding = (4 - (img->width * 3) % 4) % 4;
     
-    printf("Image: %dx%d pixels, %d bytes padding per row\n", 
-           img->width, img->height, img->padding);
+    progress("Image: %dx%d pixels, %d-bit, compression %u\n", 
+           img->width, img->height, img->info.bits, img->info.compression);
     
     // Allocate memory for pixels
-    int total_pixels = img->width * img->height;
-    img->pixels = malloc(total_pixels * sizeof(Pixel));
+    size_t pixel_bytes = (size_t)img->width * img->height * sizeof(Pixel);
+    img->pixels = (reuse && reuse_bytes >= pixel_bytes) ? reuse : malloc(pixel_bytes);
     if (!img->pixels) {
         printf("Error: Can't allocate pixel memory!\n");
         free(img);
@@ -100,68 +755,325 @@ Image* load_bmp(char* filename) {
         return NULL;
     }
     
-    // Go to pixel data location
-    fseek(file, img->header.offset, SEEK_SET);
-    
-    // Read pixels row by row (BMP stores bottom-to-top!)
-    for (int row = img->height - 1; row >= 0; row--) {
-        // Read one row of pixels
-        for (int col = 0; col < img->width; col++) {
-            int pos = row * img->width + col;  // Position in 1D array
-            fread(&img->pixels[pos], sizeof(Pixel), 1, file);
+    if (!read_bmp_pixels(file, img)) {
+        if (img->pixels != reuse) {
+            free(img->pixels);
         }
-        // Skip padding bytes
-        fseek(file, img->padding, SEEK_CUR);
+        free(img);
+        fclose(file);
+        return NULL;
     }
     
     fclose(file);
-    printf("Image loaded successfully!\n");
+    
+    // Internally everything is 24-bit now
+    set_image_size(img, img->width, img->height);
+    // A reuse buffer the image doesn't end up keeping stays the caller's
+    int converted = img->pixels == reuse ? layout_from_packed(img, load_layout)
+                                         : convert_layout(img, load_layout);
+    if (!converted) {
+        if (img->pixels != reuse) {
+            free(img->pixels);
+        }
+        free(img);
+        return NULL;
+    }
+    progress("Image loaded successfully!\n");
     return img;
 }
 
-// Function to save BMP file
-void save_bmp(char* filename, Image* img) {
-    printf("Saving %s...\n", filename);
-    
-    FILE* file = fopen(filename, "wb");
-    if (!file) {
+// Function to read BMP file. If reuse is big enough for the pixels it
+// becomes the pixel array, otherwise a new one is allocated. The caller
+// still owns reuse unless img->pixels comes back pointing at it (a
+// planar or BGRX load only borrows it while converting).
+Image* load_bmp_into(char* filename, Pixel* reuse, size_t reuse_bytes) {
+    TRACE_BEGIN(span);
+    Image* img = read_bmp_file(filename, reuse, reuse_bytes);
+    TRACE_END(span, "load_bmp", img ? (size_t)img->width * img->height * sizeof(Pixel) : 0);
+    return img;
+}
+
+Image* load_bmp(char* filename) {
+    return load_bmp_into(filename, NULL, 0);
+}
+
+// ---------------------------------------------------------------
+// Band writer: the producer fills bands of finished rows and queues
+// them, a writer thread does the fwrite calls. The queue is bounded,
+// so a slow disk holds the producer back instead of buffering the
+// whole image in memory.
+// ---------------------------------------------------------------
+
+#define WRITER_BAND_ROWS 64    // Rows per queued band
+#define WRITER_QUEUE_BANDS 4   // Bands in flight between producer and writer
+
+typedef struct {
+    FILE* file;
+    size_t band_bytes;                  // Capacity of one slot
+    uint8_t* slots[WRITER_QUEUE_BANDS];
+    size_t used[WRITER_QUEUE_BANDS];    // Bytes queued in each slot
+    int head;                           // Oldest queued slot (the one being written)
+    int count;                          // Slots queued, including the one being written
+    int threaded;                       // 0 writes inline on submit
+    int durable;                        // fsync before close
+    int finished;
+    int error;
+    double producer_wait;               // Seconds the producer waited for a free slot
+    double writer_wait;                 // Seconds the writer waited for a band
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+} BandWriter;
+
+static void* band_writer_thread(void* arg) {
+    BandWriter* w = arg;
+    while (1) {
+        pthread_mutex_lock(&w->lock);
+        double t0 = now_seconds();
+        while (w->count == 0 && !w->finished) {
+            pthread_cond_wait(&w->changed, &w->lock);
+        }
+        w->writer_wait += now_seconds() - t0;
+        if (w->count == 0) {
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+        int slot = w->head;
+        pthread_mutex_unlock(&w->lock);
+        
+        // The slot stays counted while we write it, so the producer can't reuse it
+        int ok = fwrite(w->slots[slot], 1, w->used[slot], w->file) == w->used[slot];
+        
+        pthread_mutex_lock(&w->lock);
+        w->error = w->error || !ok;
+        w->head = (w->head + 1) % WRITER_QUEUE_BANDS;
+        w->count--;
+        pthread_cond_broadcast(&w->changed);
+        pthread_mutex_unlock(&w->lock);
+    }
+    return NULL;
+}
+
+// Create the file, write 'head' (headers) and start the writer thread
+BandWriter* band_writer_open(char* filename, const void* head, size_t head_bytes,
+                             size_t band_bytes, int threaded) {
+    BandWriter* w = calloc(1, sizeof(BandWriter));
+    if (!w) {
+        printf("Error: Can't allocate memory!\n");
+        return NULL;
+    }
+    w->file = fopen(filename, "wb");
+    if (!w->file) {
         printf("Error: Can't create output file!\n");
+        free(w);
+        return NULL;
+    }
+    w->band_bytes = band_bytes;
+    w->threaded = threaded;
+    int ok = fwrite(head, 1, head_bytes, w->file) == head_bytes;
+    // Zeroed so row padding goes out as zeros
+    for (int i = 0; i < (threaded ? WRITER_QUEUE_BANDS : 1) && ok; i++) {
+        w->slots[i] = calloc(band_bytes, 1);
+        ok = w->slots[i] != NULL;
+    }
+    if (!ok) {
+        printf("Error: Can't start writing %s!\n", filename);
+        for (int i = 0; i < WRITER_QUEUE_BANDS; i++) {
+            free(w->slots[i]);
+        }
+        fclose(w->file);
+        free(w);
+        return NULL;
+    }
+    if (threaded) {
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->changed, NULL);
+        if (pthread_create(&w->thread, NULL, band_writer_thread, w) != 0) {
+            // No writer thread: write inline on submit instead
+            pthread_mutex_destroy(&w->lock);
+            pthread_cond_destroy(&w->changed);
+            w->threaded = 0;
+        }
+    }
+    return w;
+}
+
+// Next free band to fill, waiting if the queue is full
+uint8_t* band_writer_next(BandWriter* w) {
+    if (!w->threaded) {
+        return w->slots[0];
+    }
+    pthread_mutex_lock(&w->lock);
+    double t0 = now_seconds();
+    while (w->count == WRITER_QUEUE_BANDS) {
+        pthread_cond_wait(&w->changed, &w->lock);
+    }
+    w->producer_wait += now_seconds() - t0;
+    uint8_t* band = w->slots[(w->head + w->count) % WRITER_QUEUE_BANDS];
+    pthread_mutex_unlock(&w->lock);
+    return band;
+}
+
+// Queue the band from band_writer_next with 'bytes' of data in it
+void band_writer_submit(BandWriter* w, size_t bytes) {
+    if (!w->threaded) {
+        w->error = w->error || fwrite(w->slots[0], 1, bytes, w->file) != bytes;
         return;
     }
+    pthread_mutex_lock(&w->lock);
+    w->used[(w->head + w->count) % WRITER_QUEUE_BANDS] = bytes;
+    w->count++;
+    pthread_cond_broadcast(&w->changed);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Drain the queue, close the file and free the writer. The wait totals are
+// stored if asked for. Returns 1 if every write succeeded.
+int band_writer_close(BandWriter* w, double* producer_wait, double* writer_wait) {
+    if (w->threaded) {
+        pthread_mutex_lock(&w->lock);
+        w->finished = 1;
+        pthread_cond_broadcast(&w->changed);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->changed);
+    }
+    if (producer_wait) *producer_wait = w->producer_wait;
+    if (writer_wait) *writer_wait = w->writer_wait;
+    int ok = !w->error && fflush(w->file) == 0;
+    if (ok && w->durable) {
+        ok = fsync(fileno(w->file)) == 0;
+    }
+    ok = fclose(w->file) == 0 && ok;
+    for (int i = 0; i < WRITER_QUEUE_BANDS; i++) {
+        free(w->slots[i]);
+    }
+    free(w);
+    return ok;
+}
+
+// Operation on rows [first, first + count) of an image
+typedef void (*BandOp)(Image* img, int first, int count);
+
+static int write_bmp_file(char* filename, Image* img, BandOp op, double* op_seconds,
+                          int threaded, int durable);
+
+// Function to save BMP file, as 24-bit or 32-bit BGRX (see output_bits).
+// Images taller than one band are written by a writer thread while the
+// next bands are being converted. With a single CPU there is nothing to
+// overlap with, so the writes stay inline.
+int save_bmp(char* filename, Image* img) {
+    TRACE_BEGIN(span);
+    int threaded = img->height > WRITER_BAND_ROWS && sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    int ok = write_bmp_file(filename, img, NULL, NULL, threaded, 0);
+    TRACE_END(span, "save_bmp", ((size_t)(output_bits == 32 ? 32 : 24) * img->width + 31) / 32 * 4 * img->height);
+    return ok;
+}
+
+// save_bmp for a row-local operation that hasn't been run yet: each band
+// is processed right before it is queued, so the operation works on the
+// next band while the writer thread writes the last one. The trace gets
+// the operation's band time as a span named after it (placed first) and
+// the rest as save_bmp.
+int save_bmp_rows(char* filename, Image* img, BandOp op, const char* name) {
+    double start = now_seconds();
+    double op_seconds = 0.0;
+    int threaded = img->height > WRITER_BAND_ROWS && sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    int ok = write_bmp_file(filename, img, op, &op_seconds, threaded, 0);
+    TRACE_SPAN(name, start, start + op_seconds, (size_t)img->width * img->height * sizeof(Pixel));
+    TRACE_SPAN("save_bmp", start + op_seconds, now_seconds(),
+               ((size_t)(output_bits == 32 ? 32 : 24) * img->width + 31) / 32 * 4 * img->height);
+    return ok;
+}
+
+static int write_bmp_file(char* filename, Image* img, BandOp op, double* op_seconds,
+                          int threaded, int durable) {
+    progress("Saving %s...\n", filename);
     
-    // Write headers
-    fwrite(&img->header, sizeof(BMPHeader), 1, file);
-    fwrite(&img->info, sizeof(BMPInfoHeader), 1, file);
+    // Fresh headers: plain uncompressed, pixel data right after them
+    int bits = output_bits == 32 ? 32 : 24;
+    size_t stride = ((size_t)bits * img->width + 31) / 32 * 4;
+    BMPHeader header = img->header;
+    BMPInfoHeader info = img->info;
+    info.size = sizeof(BMPInfoHeader);
+    info.width = img->width;
+    info.height = img->height;
+    info.planes = 1;
+    info.bits = bits;
+    info.compression = BI_RGB;
+    info.imagesize = (uint32_t)(stride * img->height);
+    info.ncolours = 0;
+    info.importantcolours = 0;
+    header.type = 0x4D42;
+    header.reserved = 0;
+    header.offset = sizeof(BMPHeader) + sizeof(BMPInfoHeader);
+    header.size = header.offset + info.imagesize;
     
-    // Write pixels row by row (bottom-to-top)
-    uint8_t padding_bytes[3] = {0, 0, 0};
+    uint8_t head[sizeof(BMPHeader) + sizeof(BMPInfoHeader)];
+    memcpy(head, &header, sizeof(BMPHeader));
+    memcpy(head + sizeof(BMPHeader), &info, sizeof(BMPInfoHeader));
     
-    for (int row = img->height - 1; row >= 0; row--) {
-        // Write one row of pixels
-        for (int col = 0; col < img->width; col++) {
-            int pos = row * img->width + col;
-            fwrite(&img->pixels[pos], sizeof(Pixel), 1, file);
+    Pixel* packed = malloc((size_t)img->width * sizeof(Pixel));
+    if (!packed) {
+        printf("Error: Can't allocate row buffer!\n");
+        return 0;
+    }
+    BandWriter* writer = band_writer_open(filename, head, sizeof(head), stride * WRITER_BAND_ROWS,
+                                          threaded);
+    if (!writer) {
+        free(packed);
+        return 0;
+    }
+    writer->durable = durable;
+    
+    // Rows go out bottom-to-top, padding included, a band at a time
+    for (int top = img->height - 1; top >= 0; top -= WRITER_BAND_ROWS) {
+        int rows = top + 1 < WRITER_BAND_ROWS ? top + 1 : WRITER_BAND_ROWS;
+        if (op) {
+            double t0 = now_seconds();
+            op(img, top - rows + 1, rows);
+            *op_seconds += now_seconds() - t0;
+        }
+        uint8_t* band = band_writer_next(writer);
+        for (int i = 0; i < rows; i++) {
+            int r = top - i;
+            uint8_t* row = band + i * stride;
+            if (bits == 32 && img->layout == LAYOUT_BGRX) {
+                memcpy(row, &img->bgrx[(size_t)r * img->width], (size_t)img->width * 4);
+            } else if (bits == 32) {
+                layout_row_to_packed(img, r, packed);
+                pack_bgrx(packed, row, img->width);
+            } else {
+                layout_row_to_packed(img, r, (Pixel*)row);
+            }
         }
-        // Write padding bytes
-        fwrite(padding_bytes, 1, img->padding, file);
+        band_writer_submit(writer, rows * stride);
     }
+    free(packed);
     
-    fclose(file);
-    printf("Image saved successfully!\n");
+    if (!band_writer_close(writer, NULL, NULL)) {
+        printf("Error: Can't write output file!\n");
+        return 0;
+    }
+    progress("Image saved successfully!\n");
+    return 1;
 }
 
-// Convert to grayscale
-void make_grayscale(Image* img) {
-    printf("Converting to grayscale...\n");
-    
-    int total_pixels = img->width * img->height;
-    
-    // Process each pixel
-    for (int i = 0; i < total_pixels; i++) {
-        Pixel* p = &img->pixels[i];  // Pointer to current pixel
+// Luminance formula behind grayscale, and every operation that works
+// on brightness (edges, threshold, image hashes)
+static inline uint8_t luminance(int red, int green, int blue) {
+    return (uint8_t)(0.3 * red + 0.59 * green + 0.11 * blue);
+}
+
+// Row kernels: each one works on a single row so the same code can run
+// on a whole image or on a band of rows in streaming mode
+void grayscale_row(Pixel* row, int width) {
+    for (int col = 0; col < width; col++) {
+        Pixel* p = &row[col];  // Pointer to current pixel
         
         // Calculate grayscale using luminance formula
-        uint8_t gray = (uint8_t)(0.3 * p->red + 0.59 * p->green + 0.11 * p->blue);
+        uint8_t gray = luminance(p->red, p->green, p->blue);
         
         // Set all color channels to gray value
         p->red = gray;
@@ -170,15 +1082,9 @@ void make_grayscale(Image* img) {
     }
 }
 
-// Invert all colors
-void invert_colors(Image* img) {
-    printf("Inverting colors...\n");
-    
-    int total_pixels = img->width * img->height;
-    
-    // Process each pixel
-    for (int i = 0; i < total_pixels; i++) {
-        Pixel* p = &img->pixels[i];  // Pointer to current pixel
+void invert_row(Pixel* row, int width) {
+    for (int col = 0; col < width; col++) {
+        Pixel* p = &row[col];  // Pointer to current pixel
         
         // Invert each color channel
         p->red = 255 - p->red;
@@ -187,45 +1093,4224 @@ void invert_colors(Image* img) {
     }
 }
 
-// Mirror horizontally
-void mirror_horizontal(Image* img) {
-    printf("Mirroring horizontally...\n");
-    
-    // Process each row
-    for (int row = 0; row < img->height; row++) {
-        // Swap pixels from left and right
-        for (int col = 0; col < img->width / 2; col++) {
-            // Calculate positions in 1D array
-            int left_pos = row * img->width + col;
-            int right_pos = row * img->width + (img->width - 1 - col);
-            
-            // Swap pixels using pointers
-            Pixel temp = img->pixels[left_pos];
-            img->pixels[left_pos] = img->pixels[right_pos];
-            img->pixels[right_pos] = temp;
-        }
+void mirror_row(Pixel* row, int width) {
+    // Swap pixels from left and right
+    for (int col = 0; col < width / 2; col++) {
+        Pixel temp = row[col];
+        row[col] = row[width - 1 - col];
+        row[width - 1 - col] = temp;
     }
 }
 
-// Free allocated memory
-void free_image(Image* img) {
-    if (img) {
-        if (img->pixels) {
-            free(img->pixels);  // Free pixel array first
+// Band versions of the row operations: rows [first, first + count) of
+// an image in any layout. save_bmp_rows runs them one writer band at a
+// time, the whole-image versions below run them on every row.
+static void grayscale_rows(Image* img, int first, int count) {
+    size_t start = (size_t)first * img->width;
+    size_t total = start + (size_t)count * img->width;
+    
+    if (img->layout == LAYOUT_PLANAR) {
+        uint8_t* b = image_plane(img, 0);
+        uint8_t* g = image_plane(img, 1);
+        uint8_t* r = image_plane(img, 2);
+        for (size_t i = start; i < total; i++) {
+            uint8_t gray = luminance(r[i], g[i], b[i]);
+            b[i] = g[i] = r[i] = gray;
         }
-        free(img);  // Then free image structure
+        return;
     }
-    printf("Memory freed.\n");
-}
-
-int main(int argc, char* argv[]) {
-    printf("Simple BMP Image Processor\n");
+    if (img->layout == LAYOUT_BGRX) {
+        for (size_t i = start; i < total; i++) {
+            uint32_t px = img->bgrx[i];
+            uint8_t gray = luminance((px >> 16) & 0xFF, (px >> 8) & 0xFF, px & 0xFF);
+            img->bgrx[i] = gray * 0x010101u;
+        }
+        return;
+    }
+    
+    for (int row = first; row < first + count; row++) {
+        grayscale_row(&img->pixels[(size_t)row * img->width], img->width);
+    }
+}
+
+static void invert_rows(Image* img, int first, int count) {
+    size_t start = (size_t)first * img->width;
+    size_t total = start + (size_t)count * img->width;
+    
+    if (img->layout == LAYOUT_PLANAR) {
+        for (int c = 0; c < 3; c++) {
+            uint8_t* p = image_plane(img, c);
+            for (size_t i = start; i < total; i++) {
+                p[i] = 255 - p[i];
+            }
+        }
+        return;
+    }
+    if (img->layout == LAYOUT_BGRX) {
+        for (size_t i = start; i < total; i++) {
+            img->bgrx[i] ^= 0x00FFFFFF;
+        }
+        return;
+    }
+    
+    for (int row = first; row < first + count; row++) {
+        invert_row(&img->pixels[(size_t)row * img->width], img->width);
+    }
+}
+
+static void mirror_rows(Image* img, int first, int count) {
+    int w = img->width;
+    
+    if (img->layout != LAYOUT_PACKED) {
+        for (int row = first; row < first + count; row++) {
+            if (img->layout == LAYOUT_BGRX) {
+                uint32_t* p = &img->bgrx[(size_t)row * w];
+                for (int col = 0; col < w / 2; col++) {
+                    uint32_t temp = p[col];
+                    p[col] = p[w - 1 - col];
+                    p[w - 1 - col] = temp;
+                }
+                continue;
+            }
+            for (int c = 0; c < 3; c++) {
+                uint8_t* p = image_plane(img, c) + (size_t)row * w;
+                for (int col = 0; col < w / 2; col++) {
+                    uint8_t temp = p[col];
+                    p[col] = p[w - 1 - col];
+                    p[w - 1 - col] = temp;
+                }
+            }
+        }
+        return;
+    }
+    
+    for (int row = first; row < first + count; row++) {
+        mirror_row(&img->pixels[(size_t)row * w], w);
+    }
+}
+
+// Convert to grayscale
+void make_grayscale(Image* img) {
+    progress("Converting to grayscale...\n");
+    grayscale_rows(img, 0, img->height);
+}
+
+// Invert all colors
+void invert_colors(Image* img) {
+    progress("Inverting colors...\n");
+    invert_rows(img, 0, img->height);
+}
+
+// Mirror horizontally
+void mirror_horizontal(Image* img) {
+    progress("Mirroring horizontally...\n");
+    mirror_rows(img, 0, img->height);
+}
+
+// Free allocated memory
+void free_image(Image* img) {
+    TRACE_BEGIN(span);
+    size_t bytes = img ? (size_t)img->width * img->height * sizeof(Pixel) : 0;
+    if (img) {
+        if (img->pixels) {
+            free(img->pixels);  // Free pixel array first
+        }
+        free(img->planar);
+        free(img->bgrx);
+        free(img);  // Then free image structure
+    }
+    TRACE_END(span, "free_image", bytes);
+    progress("Memory freed.\n");
+}
+
+// ---------------------------------------------------------------
+// Streaming mode: for row-local operations we never need the whole
+// image, so read a band of rows, transform it and write it out.
+// Memory is O(width) instead of O(width * height).
+// ---------------------------------------------------------------
+
+#define STREAM_BAND_ROWS 64  // Rows per band
+
+typedef void (*RowOp)(Pixel* row, int width);
+
+typedef struct {
+    uint8_t* data;  // Raw rows exactly as stored in the file (with padding)
+    int rows;       // Rows in this band, 0 marks the end of the file
+    int full;       // Set by the reader, cleared once the band is written
+} StreamBand;
+
+typedef struct {
+    FILE* file;
+    int height;
+    size_t row_bytes;
+    StreamBand bands[2];  // Double buffer: read one band while we process the other
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} StreamReader;
+
+// Reader thread: keeps the next band loaded while the main thread works
+static void* stream_reader(void* arg) {
+    StreamReader* r = arg;
+    int rows_left = r->height;
+    int slot = 0;
+    
+    while (1) {
+        StreamBand* band = &r->bands[slot];
+        
+        // Wait until the main thread is done with this buffer
+        pthread_mutex_lock(&r->lock);
+        while (band->full) {
+            pthread_cond_wait(&r->changed, &r->lock);
+        }
+        pthread_mutex_unlock(&r->lock);
+        
+        int want = rows_left < STREAM_BAND_ROWS ? rows_left : STREAM_BAND_ROWS;
+        int got = want > 0 ? (int)fread(band->data, r->row_bytes, want, r->file) : 0;
+        
+        pthread_mutex_lock(&r->lock);
+        band->rows = got;
+        band->full = 1;
+        if (got != want) {
+            r->error = 1;
+        }
+        pthread_cond_broadcast(&r->changed);
+        pthread_mutex_unlock(&r->lock);
+        
+        if (got == 0) {
+            break;  // Empty band tells the main thread we're finished
+        }
+        rows_left -= got;
+        slot ^= 1;
+    }
+    return NULL;
+}
+
+// Apply a row operation from input file to output file, one band at a time
+int stream_bmp(char* input_file, char* output_file, RowOp op) {
+    progress("Streaming %s -> %s (%d rows per band)...\n",
+             input_file, output_file, STREAM_BAND_ROWS);
+    
+    FILE* in = fopen(input_file, "rb");
+    if (!in) {
+        printf("Error: Can't open file!\n");
+        return 0;
+    }
+    
+    BMPHeader header;
+    BMPInfoHeader info;
+    if (!read_bmp_headers(in, &header, &info)) {
+        fclose(in);
+        return 0;
+    }
+    if (info.bits != 24 || info.compression != BI_RGB) {
+        printf("Error: Streaming needs a 24-bit uncompressed BMP!\n");
+        fclose(in);
+        return 0;
+    }
+    
+    int width = info.width;
+    int height = abs(info.height);
+    int padding = (4 - (width * 3) % 4) % 4;
+    size_t row_bytes = (size_t)width * sizeof(Pixel) + padding;
+    
+    double start = now_seconds();
+    
+    // Copy everything before the pixel data unchanged (headers, palette, gaps)
+    uint8_t* head = malloc(header.offset);
+    if (!head) {
+        printf("Error: Can't allocate memory!\n");
+        fclose(in);
+        return 0;
+    }
+    fseek(in, 0, SEEK_SET);
+    if (fread(head, 1, header.offset, in) != header.offset) {
+        printf("Error: Can't copy BMP headers!\n");
+        free(head);
+        fclose(in);
+        return 0;
+    }
+    BandWriter* out = band_writer_open(output_file, head, header.offset,
+                                       row_bytes * STREAM_BAND_ROWS, 1);
+    free(head);
+    if (!out) {
+        fclose(in);
+        return 0;
+    }
+    
+    StreamReader reader = {0};
+    reader.file = in;
+    reader.height = height;
+    reader.row_bytes = row_bytes;
+    for (int i = 0; i < 2; i++) {
+        reader.bands[i].data = malloc(row_bytes * STREAM_BAND_ROWS);
+    }
+    if (!reader.bands[0].data || !reader.bands[1].data) {
+        printf("Error: Can't allocate band memory!\n");
+        free(reader.bands[0].data);
+        free(reader.bands[1].data);
+        fclose(in);
+        band_writer_close(out, NULL, NULL);
+        return 0;
+    }
+    pthread_mutex_init(&reader.lock, NULL);
+    pthread_cond_init(&reader.changed, NULL);
+    
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stream_reader, &reader) != 0) {
+        printf("Error: Can't start the reader thread!\n");
+        pthread_mutex_destroy(&reader.lock);
+        pthread_cond_destroy(&reader.changed);
+        free(reader.bands[0].data);
+        free(reader.bands[1].data);
+        fclose(in);
+        band_writer_close(out, NULL, NULL);
+        return 0;
+    }
+    
+    int ok = 1;
+    int slot = 0;
+    while (1) {
+        StreamBand* band = &reader.bands[slot];
+        
+        // Wait for the reader to fill this buffer
+        pthread_mutex_lock(&reader.lock);
+        while (!band->full) {
+            pthread_cond_wait(&reader.changed, &reader.lock);
+        }
+        pthread_mutex_unlock(&reader.lock);
+        
+        if (band->rows == 0) {
+            break;
+        }
+        
+        // Transform into a writer band, padding bytes are carried over untouched
+        uint8_t* dst = band_writer_next(out);
+        memcpy(dst, band->data, row_bytes * band->rows);
+        for (int r = 0; r < band->rows; r++) {
+            op((Pixel*)(dst + r * row_bytes), width);
+        }
+        band_writer_submit(out, row_bytes * band->rows);
+        
+        // Hand the buffer back to the reader
+        pthread_mutex_lock(&reader.lock);
+        band->full = 0;
+        pthread_cond_broadcast(&reader.changed);
+        pthread_mutex_unlock(&reader.lock);
+        slot ^= 1;
+    }
+    
+    pthread_join(thread, NULL);
+    if (reader.error) {
+        printf("Error: Input file ended early!\n");
+        ok = 0;
+    }
+    
+    pthread_mutex_destroy(&reader.lock);
+    pthread_cond_destroy(&reader.changed);
+    free(reader.bands[0].data);
+    free(reader.bands[1].data);
+    fclose(in);
+    
+    double producer_wait, writer_wait;
+    if (!band_writer_close(out, &producer_wait, &writer_wait)) {
+        printf("Error: Can't write output file!\n");
+        ok = 0;
+    }
+    
+    if (ok) {
+        progress("Image streamed successfully!\n");
+        printf("End-to-end %.3f ms (compute waited %.3f ms for the writer, writer idle %.3f ms)\n",
+               (now_seconds() - start) * 1e3, producer_wait * 1e3, writer_wait * 1e3);
+    }
+    return ok;
+}
+
+// ---------------------------------------------------------------
+// Convolution engine: blur, sharpen, edge detection
+// Separable kernels run as two 1-D passes, box blur uses running sums,
+// and the vertical passes work in column strips that fit in L2.
+// ---------------------------------------------------------------
+
+#define L2_CACHE_BYTES (256 * 1024)  // Working set target for blocked passes
+#define MAX_KERNEL_RADIUS 64
+
+typedef struct {
+    int size;        // Width and height (always odd)
+    float* weights;  // size * size values, row-major
+} Kernel;
+
+// Swap in a newly computed pixel array
+void replace_pixels(Image* img, Pixel* pixels) {
+    free(img->pixels);
+    img->pixels = pixels;
+}
+
+static inline uint8_t clamp_u8(float v) {
+    if (v <= 0.0f) return 0;
+    if (v >= 255.0f) return 255;
+    return (uint8_t)(v + 0.5f);
+}
+
+static inline int clamp_int(int v, int lo, int hi) {
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+Kernel* create_kernel(int size, const float* weights) {
+    if (size < 1 || size % 2 == 0 || size / 2 > MAX_KERNEL_RADIUS) {
+        printf("Error: Kernel size must be odd and at most %d!\n", 2 * MAX_KERNEL_RADIUS + 1);
+        return NULL;
+    }
+    
+    Kernel* k = malloc(sizeof(Kernel));
+    if (!k) {
+        return NULL;
+    }
+    k->size = size;
+    k->weights = malloc(size * size * sizeof(float));
+    if (!k->weights) {
+        free(k);
+        return NULL;
+    }
+    if (weights) {
+        memcpy(k->weights, weights, size * size * sizeof(float));
+    }
+    return k;
+}
+
+void free_kernel(Kernel* k) {
+    if (k) {
+        free(k->weights);
+        free(k);
+    }
+}
+
+// Normalized Gaussian with sigma = radius / 2
+Kernel* gaussian_kernel(int radius) {
+    Kernel* k = create_kernel(2 * radius + 1, NULL);
+    if (!k) {
+        return NULL;
+    }
+    
+    float sigma = radius > 0 ? radius / 2.0f : 0.5f;
+    float g[2 * MAX_KERNEL_RADIUS + 1];
+    float total = 0.0f;
+    for (int i = -radius; i <= radius; i++) {
+        g[i + radius] = expf(-(i * i) / (2.0f * sigma * sigma));
+        total += g[i + radius];
+    }
+    for (int y = 0; y < k->size; y++) {
+        for (int x = 0; x < k->size; x++) {
+            k->weights[y * k->size + x] = g[y] * g[x] / (total * total);
+        }
+    }
+    return k;
+}
+
+// A kernel is separable when it is the outer product col * row.
+// Returns 1 and fills both factors if so.
+int kernel_is_separable(const Kernel* k, float* col, float* row) {
+    int n = k->size;
+    
+    // Use the largest weight as the pivot to keep the division stable
+    int pivot = 0;
+    for (int i = 1; i < n * n; i++) {
+        if (fabsf(k->weights[i]) > fabsf(k->weights[pivot])) {
+            pivot = i;
+        }
+    }
+    float pv = k->weights[pivot];
+    if (pv == 0.0f) {
+        return 0;
+    }
+    
+    int py = pivot / n;
+    int px = pivot % n;
+    for (int i = 0; i < n; i++) {
+        col[i] = k->weights[i * n + px];
+        row[i] = k->weights[py * n + i] / pv;
+    }
+    
+    float tolerance = fabsf(pv) * 1e-5f;
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+            if (fabsf(k->weights[y * n + x] - col[y] * row[x]) > tolerance) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Copy the image into float rows with r clamped pixels of border on each side,
+// so the inner loops never need bounds checks
+static float* make_padded_rows(const Pixel* src, int width, int height, int r) {
+    int stride = (width + 2 * r) * 3;
+    float* buf = malloc((size_t)stride * height * sizeof(float));
+    if (!buf) {
+        return NULL;
+    }
+    
+    for (int y = 0; y < height; y++) {
+        float* dst = buf + (size_t)y * stride;
+        for (int x = -r; x < width + r; x++) {
+            const Pixel* p = &src[y * width + clamp_int(x, 0, width - 1)];
+            float* d = dst + (x + r) * 3;
+            d[0] = p->blue;
+            d[1] = p->green;
+            d[2] = p->red;
+        }
+    }
+    return buf;
+}
+
+// Columns per strip so (rows touched) * strip stays inside L2
+static int strip_columns(int rows_touched, int width) {
+    int cols = L2_CACHE_BYTES / ((rows_touched + 1) * 3 * (int)sizeof(float));
+    if (cols < 16) cols = 16;
+    if (cols > width) cols = width;
+    return cols;
+}
+
+// Generic 2-D path for kernels that don't factor
+static Pixel* convolve_2d(const Pixel* src, int width, int height, const Kernel* k) {
+    int n = k->size;
+    int r = n / 2;
+    int stride = (width + 2 * r) * 3;
+    
+    float* padded = make_padded_rows(src, width, height, r);
+    Pixel* out = malloc((size_t)width * height * sizeof(Pixel));
+    int strip = strip_columns(n, width);
+    float* acc = malloc(strip * 3 * sizeof(float));
+    if (!padded || !out || !acc) {
+        free(padded);
+        free(out);
+        free(acc);
+        return NULL;
+    }
+    
+    for (int x0 = 0; x0 < width; x0 += strip) {
+        int cols = (x0 + strip <= width ? strip : width - x0) * 3;
+        for (int y = 0; y < height; y++) {
+            memset(acc, 0, cols * sizeof(float));
+            for (int ky = 0; ky < n; ky++) {
+                const float* srow = padded + (size_t)clamp_int(y + ky - r, 0, height - 1) * stride + x0 * 3;
+                for (int kx = 0; kx < n; kx++) {
+                    float w = k->weights[ky * n + kx];
+                    if (w == 0.0f) continue;
+                    const float* s = srow + kx * 3;
+                    for (int i = 0; i < cols; i++) {
+                        acc[i] += w * s[i];
+                    }
+                }
+            }
+            Pixel* d = &out[y * width + x0];
+            for (int i = 0; i < cols / 3; i++) {
+                d[i].blue = clamp_u8(acc[i * 3]);
+                d[i].green = clamp_u8(acc[i * 3 + 1]);
+                d[i].red = clamp_u8(acc[i * 3 + 2]);
+            }
+        }
+    }
+    
+    free(padded);
+    free(acc);
+    return out;
+}
+
+// Separable path: horizontal 1-D pass into a float buffer, then a
+// vertical 1-D pass in L2-sized column strips
+static Pixel* convolve_separable(const Pixel* src, int width, int height,
+                                 const float* col, const float* row, int n) {
+    int r = n / 2;
+    int stride = (width + 2 * r) * 3;
+    int row_floats = width * 3;
+    
+    float* padded = make_padded_rows(src, width, height, r);
+    float* tmp = malloc((size_t)row_floats * height * sizeof(float));
+    Pixel* out = malloc((size_t)width * height * sizeof(Pixel));
+    int strip = strip_columns(n, width);
+    float* acc = malloc(strip * 3 * sizeof(float));
+    if (!padded || !tmp || !out || !acc) {
+        free(padded);
+        free(tmp);
+        free(out);
+        free(acc);
+        return NULL;
+    }
+    
+    // Horizontal pass
+    for (int y = 0; y < height; y++) {
+        const float* s = padded + (size_t)y * stride;
+        float* d = tmp + (size_t)y * row_floats;
+        memset(d, 0, row_floats * sizeof(float));
+        for (int kx = 0; kx < n; kx++) {
+            float w = row[kx];
+            const float* sk = s + kx * 3;
+            for (int i = 0; i < row_floats; i++) {
+                d[i] += w * sk[i];
+            }
+        }
+    }
+    free(padded);
+    
+    // Vertical pass
+    for (int x0 = 0; x0 < width; x0 += strip) {
+        int cols = (x0 + strip <= width ? strip : width - x0) * 3;
+        for (int y = 0; y < height; y++) {
+            memset(acc, 0, cols * sizeof(float));
+            for (int ky = 0; ky < n; ky++) {
+                float w = col[ky];
+                const float* s = tmp + (size_t)clamp_int(y + ky - r, 0, height - 1) * row_floats + x0 * 3;
+                for (int i = 0; i < cols; i++) {
+                    acc[i] += w * s[i];
+                }
+            }
+            Pixel* d = &out[y * width + x0];
+            for (int i = 0; i < cols / 3; i++) {
+                d[i].blue = clamp_u8(acc[i * 3]);
+                d[i].green = clamp_u8(acc[i * 3 + 1]);
+                d[i].red = clamp_u8(acc[i * 3 + 2]);
+            }
+        }
+    }
+    
+    free(tmp);
+    free(acc);
+    return out;
+}
+
+// Convolve pixels with any kernel, picking the fastest path
+Pixel* convolve_pixels(const Pixel* src, int width, int height, const Kernel* k) {
+    float col[2 * MAX_KERNEL_RADIUS + 1];
+    float row[2 * MAX_KERNEL_RADIUS + 1];
+    
+    if (k->size > 1 && kernel_is_separable(k, col, row)) {
+        return convolve_separable(src, width, height, col, row, k->size);
+    }
+    return convolve_2d(src, width, height, k);
+}
+
+// Reference implementation: every tap of every pixel, with bounds checks.
+// Only used to check and benchmark the fast paths.
+Pixel* convolve_naive(const Pixel* src, int width, int height, const Kernel* k) {
+    int n = k->size;
+    int r = n / 2;
+    Pixel* out = malloc((size_t)width * height * sizeof(Pixel));
+    if (!out) {
+        return NULL;
+    }
+    
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float b = 0.0f, g = 0.0f, rd = 0.0f;
+            for (int ky = 0; ky < n; ky++) {
+                for (int kx = 0; kx < n; kx++) {
+                    int sy = clamp_int(y + ky - r, 0, height - 1);
+                    int sx = clamp_int(x + kx - r, 0, width - 1);
+                    const Pixel* p = &src[sy * width + sx];
+                    float w = k->weights[ky * n + kx];
+                    b += w * p->blue;
+                    g += w * p->green;
+                    rd += w * p->red;
+                }
+            }
+            out[y * width + x].blue = clamp_u8(b);
+            out[y * width + x].green = clamp_u8(g);
+            out[y * width + x].red = clamp_u8(rd);
+        }
+    }
+    return out;
+}
+
+// Apply a kernel to the whole image
+int convolve(Image* img, const Kernel* k) {
+    Pixel* out = convolve_pixels(img->pixels, img->width, img->height, k);
+    if (!out) {
+        printf("Error: Can't allocate convolution buffers!\n");
+        return 0;
+    }
+    replace_pixels(img, out);
+    return 1;
+}
+
+// Box blur with running sums: cost per pixel doesn't depend on radius
+Pixel* box_blur_pixels(const Pixel* src, int width, int height, int radius) {
+    int row_vals = width * 3;
+    uint32_t* hsum = malloc((size_t)row_vals * height * sizeof(uint32_t));
+    uint32_t* colsum = calloc(row_vals, sizeof(uint32_t));
+    Pixel* out = malloc((size_t)width * height * sizeof(Pixel));
+    if (!hsum || !colsum || !out) {
+        free(hsum);
+        free(colsum);
+        free(out);
+        return NULL;
+    }
+    
+    // Horizontal running sums, edges clamped
+    for (int y = 0; y < height; y++) {
+        const uint8_t* s = (const uint8_t*)&src[y * width];
+        uint32_t* d = hsum + (size_t)y * row_vals;
+        for (int c = 0; c < 3; c++) {
+            uint32_t sum = 0;
+            for (int x = -radius; x <= radius; x++) {
+                sum += s[clamp_int(x, 0, width - 1) * 3 + c];
+            }
+            for (int x = 0; x < width; x++) {
+                d[x * 3 + c] = sum;
+                int add = clamp_int(x + radius + 1, 0, width - 1);
+                int sub = clamp_int(x - radius, 0, width - 1);
+                sum += s[add * 3 + c] - s[sub * 3 + c];
+            }
+        }
+    }
+    
+    // Vertical running sums: add the row entering the window, drop the one leaving.
+    // Walks whole rows so memory access stays sequential.
+    for (int y = -radius; y <= radius; y++) {
+        const uint32_t* s = hsum + (size_t)clamp_int(y, 0, height - 1) * row_vals;
+        for (int i = 0; i < row_vals; i++) {
+            colsum[i] += s[i];
+        }
+    }
+    uint32_t area = (2 * radius + 1) * (2 * radius + 1);
+    for (int y = 0; y < height; y++) {
+        uint8_t* d = (uint8_t*)&out[y * width];
+        const uint32_t* add = hsum + (size_t)clamp_int(y + radius + 1, 0, height - 1) * row_vals;
+        const uint32_t* sub = hsum + (size_t)clamp_int(y - radius, 0, height - 1) * row_vals;
+        for (int i = 0; i < row_vals; i++) {
+            d[i] = (uint8_t)((colsum[i] + area / 2) / area);
+            colsum[i] += add[i] - sub[i];
+        }
+    }
+    
+    free(hsum);
+    free(colsum);
+    return out;
+}
+
+void box_blur(Image* img, int radius) {
+    progress("Box blur (radius %d)...\n", radius);
+    Pixel* out = box_blur_pixels(img->pixels, img->width, img->height, radius);
+    if (!out) {
+        printf("Error: Can't allocate blur buffers!\n");
+        return;
+    }
+    replace_pixels(img, out);
+}
+
+void gaussian_blur(Image* img, int radius) {
+    progress("Gaussian blur (radius %d)...\n", radius);
+    Kernel* k = gaussian_kernel(radius);
+    if (k) {
+        convolve(img, k);
+        free_kernel(k);
+    }
+}
+
+void sharpen(Image* img) {
+    progress("Sharpening...\n");
+    const float w[9] = { 0, -1,  0,
+                        -1,  5, -1,
+                         0, -1,  0 };
+    Kernel* k = create_kernel(3, w);
+    if (k) {
+        convolve(img, k);
+        free_kernel(k);
+    }
+}
+
+// Sobel edge detection on luminance. Both Sobel kernels are separable,
+// so one horizontal pass gives the difference and smoothing terms and
+// one vertical pass combines them.
+void sobel_edges(Image* img) {
+    progress("Detecting edges...\n");
+    
+    int width = img->width;
+    int height = img->height;
+    size_t total = (size_t)width * height;
+    int16_t* lum = malloc(total * sizeof(int16_t));
+    int16_t* dx = malloc(total * sizeof(int16_t));  // [-1 0 1] across
+    int16_t* sx = malloc(total * sizeof(int16_t));  // [1 2 1] across
+    if (!lum || !dx || !sx) {
+        printf("Error: Can't allocate edge buffers!\n");
+        free(lum);
+        free(dx);
+        free(sx);
+        return;
+    }
+    
+    for (size_t i = 0; i < total; i++) {
+        Pixel* p = &img->pixels[i];
+        lum[i] = luminance(p->red, p->green, p->blue);
+    }
+    
+    for (int y = 0; y < height; y++) {
+        const int16_t* l = lum + (size_t)y * width;
+        for (int x = 0; x < width; x++) {
+            int left = l[x > 0 ? x - 1 : 0];
+            int right = l[x < width - 1 ? x + 1 : width - 1];
+            dx[(size_t)y * width + x] = (int16_t)(right - left);
+            sx[(size_t)y * width + x] = (int16_t)(left + 2 * l[x] + right);
+        }
+    }
+    
+    for (int y = 0; y < height; y++) {
+        const int16_t* dup = dx + (size_t)(y > 0 ? y - 1 : 0) * width;
+        const int16_t* dmid = dx + (size_t)y * width;
+        const int16_t* ddown = dx + (size_t)(y < height - 1 ? y + 1 : height - 1) * width;
+        const int16_t* sup = sx + (size_t)(y > 0 ? y - 1 : 0) * width;
+        const int16_t* sdown = sx + (size_t)(y < height - 1 ? y + 1 : height - 1) * width;
+        Pixel* d = &img->pixels[(size_t)y * width];
+        for (int x = 0; x < width; x++) {
+            float gx = dup[x] + 2 * dmid[x] + ddown[x];
+            float gy = sdown[x] - sup[x];
+            uint8_t mag = clamp_u8(sqrtf(gx * gx + gy * gy));
+            d[x].blue = mag;
+            d[x].green = mag;
+            d[x].red = mag;
+        }
+    }
+    
+    free(lum);
+    free(dx);
+    free(sx);
+}
+
+// Compare the fast paths against the naive 2-D loop on this image
+void benchmark_convolution(Image* img, int radius) {
+    printf("Benchmarking convolution (radius %d)...\n", radius);
+    
+    Kernel* k = gaussian_kernel(radius);
+    if (!k) {
+        return;
+    }
+    double mp = (double)img->width * img->height / 1e6;
+    
+    double t0 = now_seconds();
+    Pixel* naive = convolve_naive(img->pixels, img->width, img->height, k);
+    double t1 = now_seconds();
+    Pixel* fast = convolve_pixels(img->pixels, img->width, img->height, k);
+    double t2 = now_seconds();
+    Pixel* box = box_blur_pixels(img->pixels, img->width, img->height, radius);
+    double t3 = now_seconds();
+    
+    if (naive && fast && box) {
+        int max_diff = 0;
+        size_t total = (size_t)img->width * img->height * 3;
+        for (size_t i = 0; i < total; i++) {
+            int diff = abs(((uint8_t*)naive)[i] - ((uint8_t*)fast)[i]);
+            if (diff > max_diff) max_diff = diff;
+        }
+        
+        printf("%-22s %10s %12s %9s\n", "Method", "Time (ms)", "MPixels/s", "Speedup");
+        printf("%-22s %10.2f %12.2f %8.2fx\n", "Naive 2-D gaussian",
+               (t1 - t0) * 1e3, mp / (t1 - t0), 1.0);
+        printf("%-22s %10.2f %12.2f %8.2fx\n", "Separable gaussian",
+               (t2 - t1) * 1e3, mp / (t2 - t1), (t1 - t0) / (t2 - t1));
+        printf("%-22s %10.2f %12.2f %8.2fx\n", "Box (running sums)",
+               (t3 - t2) * 1e3, mp / (t3 - t2), (t1 - t0) / (t3 - t2));
+        printf("Max difference naive vs separable: %d\n", max_diff);
+        
+        // Keep the separable result as the output image
+        replace_pixels(img, fast);
+        fast = NULL;
+    } else {
+        printf("Error: Can't allocate benchmark buffers!\n");
+    }
+    
+    free(naive);
+    free(fast);
+    free(box);
+    free_kernel(k);
+}
+
+// ---------------------------------------------------------------
+// Resize: nearest, bilinear and Lanczos-3
+// Filter weights are computed once per output column/row in 14-bit
+// fixed point, then applied as a horizontal pass and a vertical pass.
+// Big reductions are first halved with a 2x2 box filter.
+// ---------------------------------------------------------------
+
+#define RESIZE_BITS 14  // Fixed-point weight precision
+
+typedef enum { RESIZE_NEAREST, RESIZE_BILINEAR, RESIZE_LANCZOS } ResizeFilter;
+
+// Precomputed contributions along one axis
+typedef struct {
+    int taps;          // Weights stored per output (max contributors)
+    int* start;        // First source index for each output
+    int* count;        // Number of contributors for each output
+    int16_t* weights;  // out_size * taps fixed-point weights
+} ResampleAxis;
+
+static double filter_support(ResizeFilter f) {
+    return f == RESIZE_LANCZOS ? 3.0 : 1.0;
+}
+
+static double sinc(double x) {
+    if (x == 0.0) return 1.0;
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+static double filter_weight(ResizeFilter f, double x) {
+    x = fabs(x);
+    if (f == RESIZE_LANCZOS) {
+        return x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+    }
+    return x < 1.0 ? 1.0 - x : 0.0;  // Triangle for bilinear
+}
+
+void free_resample_axis(ResampleAxis* axis) {
+    free(axis->start);
+    free(axis->count);
+    free(axis->weights);
+}
+
+// Work out which source pixels feed each output pixel and how much.
+// When shrinking, the filter is stretched by the scale so it averages
+// over every source pixel instead of skipping some (no aliasing).
+int build_resample_axis(ResampleAxis* axis, int in_size, int out_size, ResizeFilter f) {
+    double scale = (double)in_size / out_size;
+    double filterscale = scale > 1.0 ? scale : 1.0;
+    double support = filter_support(f) * filterscale;
+    
+    axis->taps = (int)ceil(support) * 2 + 1;
+    axis->start = malloc(out_size * sizeof(int));
+    axis->count = malloc(out_size * sizeof(int));
+    axis->weights = calloc((size_t)out_size * axis->taps, sizeof(int16_t));
+    double* w = malloc(axis->taps * sizeof(double));
+    if (!axis->start || !axis->count || !axis->weights || !w) {
+        free_resample_axis(axis);
+        free(w);
+        return 0;
+    }
+    
+    for (int i = 0; i < out_size; i++) {
+        double center = (i + 0.5) * scale;
+        int lo = (int)(center - support + 0.5);
+        int hi = (int)(center + support + 0.5);
+        if (lo < 0) lo = 0;
+        if (hi > in_size) hi = in_size;
+        if (hi - lo > axis->taps) hi = lo + axis->taps;
+        
+        double total = 0.0;
+        for (int k = 0; k < hi - lo; k++) {
+            w[k] = filter_weight(f, (lo + k - center + 0.5) / filterscale);
+            total += w[k];
+        }
+        
+        // Normalize and round to fixed point, making sure the weights
+        // add up to exactly 1.0 so flat areas stay flat
+        int16_t* fw = &axis->weights[(size_t)i * axis->taps];
+        int fixed_total = 0;
+        int biggest = 0;
+        for (int k = 0; k < hi - lo; k++) {
+            double v = total != 0.0 ? w[k] / total : 0.0;
+            fw[k] = (int16_t)lround(v * (1 << RESIZE_BITS));
+            fixed_total += fw[k];
+            if (fw[k] > fw[biggest]) biggest = k;
+        }
+        fw[biggest] += (1 << RESIZE_BITS) - fixed_total;
+        
+        axis->start[i] = lo;
+        axis->count[i] = hi - lo;
+    }
+    
+    free(w);
+    return 1;
+}
+
+static inline uint8_t fixed_to_u8(int32_t v) {
+    v = (v + (1 << (RESIZE_BITS - 1))) >> RESIZE_BITS;
+    return v < 0 ? 0 : (v > 255 ? 255 : (uint8_t)v);
+}
+
+// Horizontal pass: each output pixel mixes a few neighbours in its row
+static void resample_horizontal(const uint8_t* src, int in_w, uint8_t* dst, int out_w,
+                                int rows, const ResampleAxis* ax) {
+    for (int y = 0; y < rows; y++) {
+        const uint8_t* s = src + (size_t)y * in_w * 3;
+        uint8_t* d = dst + (size_t)y * out_w * 3;
+        for (int x = 0; x < out_w; x++) {
+            const int16_t* w = &ax->weights[(size_t)x * ax->taps];
+            const uint8_t* p = s + ax->start[x] * 3;
+            int32_t b = 0, g = 0, r = 0;
+            for (int k = 0; k < ax->count[x]; k++) {
+                b += w[k] * p[k * 3];
+                g += w[k] * p[k * 3 + 1];
+                r += w[k] * p[k * 3 + 2];
+            }
+            d[x * 3] = fixed_to_u8(b);
+            d[x * 3 + 1] = fixed_to_u8(g);
+            d[x * 3 + 2] = fixed_to_u8(r);
+        }
+    }
+}
+
+// Vertical pass: each output row is a weighted sum of whole source rows,
+// so it runs on contiguous bytes. SSE2 does 16 bytes at a time using
+// madd on interleaved pairs of rows.
+static void resample_vertical_row(const uint8_t* src, size_t row_bytes, uint8_t* dst,
+                                  int start, int count, const int16_t* w) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (RESIZE_BITS - 1));
+    for (; i + 16 <= row_bytes; i += 16) {
+        __m128i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+        for (int k = 0; k < count; k += 2) {
+            const uint8_t* r0 = src + (size_t)(start + k) * row_bytes + i;
+            __m128i a = _mm_loadu_si128((const __m128i*)r0);
+            __m128i b = zero;
+            int16_t w1 = 0;
+            if (k + 1 < count) {
+                b = _mm_loadu_si128((const __m128i*)(r0 + row_bytes));
+                w1 = w[k + 1];
+            }
+            // Both weights as one 32-bit lane, built unsigned since w1 may be negative
+            __m128i wk = _mm_set1_epi32((int)((uint32_t)(uint16_t)w[k] | ((uint32_t)(uint16_t)w1 << 16)));
+
+            // Interleave bytes of both rows so madd forms a*w0 + b*w1
+            __m128i lo = _mm_unpacklo_epi8(a, b);
+            __m128i hi = _mm_unpackhi_epi8(a, b);
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), wk));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), wk));
+            acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), wk));
+            acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), wk));
+        }
+        acc0 = _mm_srai_epi32(acc0, RESIZE_BITS);
+        acc1 = _mm_srai_epi32(acc1, RESIZE_BITS);
+        acc2 = _mm_srai_epi32(acc2, RESIZE_BITS);
+        acc3 = _mm_srai_epi32(acc3, RESIZE_BITS);
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(acc0, acc1),
+                                          _mm_packs_epi32(acc2, acc3));
+        _mm_storeu_si128((__m128i*)(dst + i), packed);
+    }
+#endif
+    for (; i < row_bytes; i++) {
+        int32_t v = 0;
+        for (int k = 0; k < count; k++) {
+            v += w[k] * src[(size_t)(start + k) * row_bytes + i];
+        }
+        dst[i] = fixed_to_u8(v);
+    }
+}
+
+// Shrink by 2 in x and/or y by averaging blocks (edges clamped)
+static Pixel* halve_pixels(const Pixel* src, int w, int h, int fx, int fy, int* out_w, int* out_h) {
+    int nw = (w + fx - 1) / fx;
+    int nh = (h + fy - 1) / fy;
+    Pixel* out = malloc((size_t)nw * nh * sizeof(Pixel));
+    if (!out) {
+        return NULL;
+    }
+    
+    int area = fx * fy;
+    for (int y = 0; y < nh; y++) {
+        const Pixel* r0 = &src[(size_t)(y * fy) * w];
+        const Pixel* r1 = &src[(size_t)clamp_int(y * fy + fy - 1, 0, h - 1) * w];
+        for (int x = 0; x < nw; x++) {
+            int x0 = x * fx;
+            int x1 = clamp_int(x0 + fx - 1, 0, w - 1);
+            Pixel* d = &out[(size_t)y * nw + x];
+            if (area == 1) {
+                *d = r0[x0];
+                continue;
+            }
+            int b = r0[x0].blue + r0[x1].blue + r1[x0].blue + r1[x1].blue;
+            int g = r0[x0].green + r0[x1].green + r1[x0].green + r1[x1].green;
+            int r = r0[x0].red + r0[x1].red + r1[x0].red + r1[x1].red;
+            // Two of the four taps are duplicates when only one axis halves
+            d->blue = (uint8_t)((b + 2) / 4);
+            d->green = (uint8_t)((g + 2) / 4);
+            d->red = (uint8_t)((r + 2) / 4);
+        }
+    }
+    *out_w = nw;
+    *out_h = nh;
+    return out;
+}
+
+// Resize pixels to out_w x out_h. Returns a new array or NULL.
+Pixel* resize_pixels(const Pixel* src, int in_w, int in_h, int out_w, int out_h,
+                     ResizeFilter f, int allow_halving) {
+    if (f == RESIZE_NEAREST) {
+        Pixel* out = malloc((size_t)out_w * out_h * sizeof(Pixel));
+        int* xmap = malloc(out_w * sizeof(int));
+        if (!out || !xmap) {
+            free(out);
+            free(xmap);
+            return NULL;
+        }
+        for (int x = 0; x < out_w; x++) {
+            xmap[x] = (int)((x + 0.5) * in_w / out_w);
+        }
+        for (int y = 0; y < out_h; y++) {
+            const Pixel* s = &src[(size_t)((int)((y + 0.5) * in_h / out_h)) * in_w];
+            Pixel* d = &out[(size_t)y * out_w];
+            for (int x = 0; x < out_w; x++) {
+                d[x] = s[xmap[x]];
+            }
+        }
+        free(xmap);
+        return out;
+    }
+    
+    // Halve with a cheap box filter while at least 2x reduction remains
+    Pixel* reduced = NULL;
+    while (allow_halving) {
+        int fx = in_w / 2 >= out_w * 2 ? 2 : 1;
+        int fy = in_h / 2 >= out_h * 2 ? 2 : 1;
+        if (fx == 1 && fy == 1) {
+            break;
+        }
+        Pixel* next = halve_pixels(src, in_w, in_h, fx, fy, &in_w, &in_h);
+        free(reduced);
+        if (!next) {
+            return NULL;
+        }
+        reduced = next;
+        src = reduced;
+    }
+    
+    ResampleAxis ax = {0}, ay = {0};
+    if (!build_resample_axis(&ax, in_w, out_w, f) ||
+        !build_resample_axis(&ay, in_h, out_h, f)) {
+        free_resample_axis(&ax);
+        free(reduced);
+        return NULL;
+    }
+    
+    // Only the source rows some output row needs go through the horizontal pass
+    int first_row = ay.start[0];
+    int last_row = ay.start[out_h - 1] + ay.count[out_h - 1];
+    size_t out_row_bytes = (size_t)out_w * 3;
+    uint8_t* tmp = malloc(out_row_bytes * (last_row - first_row));
+    Pixel* out = malloc((size_t)out_w * out_h * sizeof(Pixel));
+    if (tmp && out) {
+        resample_horizontal((const uint8_t*)&src[(size_t)first_row * in_w], in_w,
+                            tmp, out_w, last_row - first_row, &ax);
+        for (int y = 0; y < out_h; y++) {
+            resample_vertical_row(tmp, out_row_bytes, (uint8_t*)&out[(size_t)y * out_w],
+                                  ay.start[y] - first_row, ay.count[y],
+                                  &ay.weights[(size_t)y * ay.taps]);
+        }
+    } else {
+        free(out);
+        out = NULL;
+    }
+    
+    free(tmp);
+    free(reduced);
+    free_resample_axis(&ax);
+    free_resample_axis(&ay);
+    return out;
+}
+
+int resize_image(Image* img, int width, int height, ResizeFilter f) {
+    progress("Resizing %dx%d -> %dx%d...\n", img->width, img->height, width, height);
+    Pixel* out = resize_pixels(img->pixels, img->width, img->height, width, height, f, 1);
+    if (!out) {
+        printf("Error: Can't allocate resize buffers!\n");
+        return 0;
+    }
+    replace_pixels(img, out);
+    set_image_size(img, width, height);
+    return 1;
+}
+
+// Reference resize: evaluates the 2-D filter in floating point for
+// every output pixel, no precomputation. Used by the benchmark only.
+Pixel* resize_reference(const Pixel* src, int in_w, int in_h, int out_w, int out_h, ResizeFilter f) {
+    Pixel* out = malloc((size_t)out_w * out_h * sizeof(Pixel));
+    if (!out) {
+        return NULL;
+    }
+    
+    double sx = (double)in_w / out_w;
+    double sy = (double)in_h / out_h;
+    double fsx = sx > 1.0 ? sx : 1.0;
+    double fsy = sy > 1.0 ? sy : 1.0;
+    double supx = filter_support(f) * fsx;
+    double supy = filter_support(f) * fsy;
+    
+    for (int y = 0; y < out_h; y++) {
+        double cy = (y + 0.5) * sy;
+        int y0 = clamp_int((int)(cy - supy + 0.5), 0, in_h);
+        int y1 = clamp_int((int)(cy + supy + 0.5), 0, in_h);
+        for (int x = 0; x < out_w; x++) {
+            double cx = (x + 0.5) * sx;
+            int x0 = clamp_int((int)(cx - supx + 0.5), 0, in_w);
+            int x1 = clamp_int((int)(cx + supx + 0.5), 0, in_w);
+            double b = 0, g = 0, r = 0, total = 0;
+            for (int j = y0; j < y1; j++) {
+                double wy = filter_weight(f, (j - cy + 0.5) / fsy);
+                for (int i = x0; i < x1; i++) {
+                    double w = wy * filter_weight(f, (i - cx + 0.5) / fsx);
+                    const Pixel* p = &src[(size_t)j * in_w + i];
+                    b += w * p->blue;
+                    g += w * p->green;
+                    r += w * p->red;
+                    total += w;
+                }
+            }
+            Pixel* d = &out[(size_t)y * out_w + x];
+            d->blue = clamp_u8((float)(b / total));
+            d->green = clamp_u8((float)(g / total));
+            d->red = clamp_u8((float)(r / total));
+        }
+    }
+    return out;
+}
+
+// Worst per-channel difference and PSNR between two pixel arrays
+static void compare_pixels(const Pixel* a, const Pixel* b, size_t count, int* max_diff, double* psnr) {
+    const uint8_t* pa = (const uint8_t*)a;
+    const uint8_t* pb = (const uint8_t*)b;
+    double sq = 0.0;
+    *max_diff = 0;
+    for (size_t i = 0; i < count * 3; i++) {
+        int d = abs(pa[i] - pb[i]);
+        if (d > *max_diff) *max_diff = d;
+        sq += d * d;
+    }
+    double mse = sq / (count * 3);
+    *psnr = mse > 0.0 ? 10.0 * log10(255.0 * 255.0 / mse) : INFINITY;
+}
+
+// Time the fast resize against the reference at 4x and 16x reductions
+void benchmark_resize(Image* img, ResizeFilter f) {
+    printf("Benchmarking resize...\n");
+    printf("%-10s %-12s %12s %12s %12s %9s %8s\n", "Reduction", "Output",
+           "Ref (ms)", "Fast (ms)", "Halved (ms)", "Speedup", "PSNR");
+    
+    int factors[2] = {4, 16};
+    for (int i = 0; i < 2; i++) {
+        int ow = img->width / factors[i];
+        int oh = img->height / factors[i];
+        if (ow < 1 || oh < 1) {
+            continue;
+        }
+        
+        double t0 = now_seconds();
+        Pixel* ref = resize_reference(img->pixels, img->width, img->height, ow, oh, f);
+        double t1 = now_seconds();
+        Pixel* fast = resize_pixels(img->pixels, img->width, img->height, ow, oh, f, 0);
+        double t2 = now_seconds();
+        Pixel* halved = resize_pixels(img->pixels, img->width, img->height, ow, oh, f, 1);
+        double t3 = now_seconds();
+        
+        if (ref && fast && halved) {
+            int max_diff;
+            double psnr;
+            compare_pixels(ref, fast, (size_t)ow * oh, &max_diff, &psnr);
+            char size[32];
+            snprintf(size, sizeof(size), "%dx%d", ow, oh);
+            printf("%-10d %-12s %12.2f %12.2f %12.2f %8.2fx %8.1f\n", factors[i], size,
+                   (t1 - t0) * 1e3, (t2 - t1) * 1e3, (t3 - t2) * 1e3,
+                   (t1 - t0) / (t3 - t2), psnr);
+        } else {
+            printf("Error: Can't allocate benchmark buffers!\n");
+        }
+        free(ref);
+        free(fast);
+        free(halved);
+    }
+}
+
+// ---------------------------------------------------------------
+// Statistics: per-channel histograms, min/max/mean, auto-levels
+// Each thread counts into 4 interleaved sub-histograms so neighbouring
+// pixels with the same value don't stall on the same counter, then
+// the sub-histograms and threads are merged at the end.
+// ---------------------------------------------------------------
+
+#define HIST_SUBS 4            // Sub-histograms per channel
+#define STATS_MIN_ROWS 64      // Don't start a thread for less than this
+
+typedef struct {
+    uint64_t hist[3][256];     // Blue, green, red (BMP order)
+    uint64_t count;            // Pixels counted
+    uint8_t min[3];
+    uint8_t max[3];
+    double mean[3];
+} ImageStats;
+
+typedef struct {
+    const Pixel* pixels;
+    size_t begin;
+    size_t end;
+    uint64_t hist[3][256];     // This thread's merged result
+    int started;               // Ran on its own thread
+} HistogramTask;
+
+static void* histogram_worker(void* arg) {
+    HistogramTask* task = arg;
+    uint32_t (*sub)[3][256] = calloc(HIST_SUBS, sizeof(*sub));
+    if (!sub) {
+        return (void*)1;
+    }
+    
+    // Four pixels per step, each one into its own sub-histogram
+    const uint8_t* p = (const uint8_t*)&task->pixels[task->begin];
+    size_t n = task->end - task->begin;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4, p += 12) {
+        sub[0][0][p[0]]++; sub[0][1][p[1]]++;  sub[0][2][p[2]]++;
+        sub[1][0][p[3]]++; sub[1][1][p[4]]++;  sub[1][2][p[5]]++;
+        sub[2][0][p[6]]++; sub[2][1][p[7]]++;  sub[2][2][p[8]]++;
+        sub[3][0][p[9]]++; sub[3][1][p[10]]++; sub[3][2][p[11]]++;
+    }
+    for (; i < n; i++, p += 3) {
+        sub[0][0][p[0]]++;
+        sub[0][1][p[1]]++;
+        sub[0][2][p[2]]++;
+    }
+    
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 256; v++) {
+            task->hist[c][v] = (uint64_t)sub[0][c][v] + sub[1][c][v] + sub[2][c][v] + sub[3][c][v];
+        }
+    }
+    free(sub);
+    return NULL;
+}
+
+static void finish_stats(ImageStats* stats, size_t total);
+
+// Histograms for the whole image in one pass, split across threads
+int compute_stats(const Image* img, ImageStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    size_t total = (size_t)img->width * img->height;
+    
+    if (img->layout != LAYOUT_PACKED) {
+        // Planar: each plane is its own byte stream. BGRX: one word per pixel.
+        uint32_t (*sub)[3][256] = calloc(HIST_SUBS, sizeof(*sub));
+        if (!sub) {
+            return 0;
+        }
+        for (int c = 0; c < 3; c++) {
+            if (img->layout == LAYOUT_PLANAR) {
+                const uint8_t* p = image_plane(img, c);
+                size_t i = 0;
+                for (; i + 4 <= total; i += 4) {
+                    sub[0][c][p[i]]++;
+                    sub[1][c][p[i + 1]]++;
+                    sub[2][c][p[i + 2]]++;
+                    sub[3][c][p[i + 3]]++;
+                }
+                for (; i < total; i++) {
+                    sub[0][c][p[i]]++;
+                }
+            } else {
+                for (size_t i = 0; i < total; i++) {
+                    sub[i & 3][c][(img->bgrx[i] >> (8 * c)) & 0xFF]++;
+                }
+            }
+        }
+        for (int c = 0; c < 3; c++) {
+            for (int v = 0; v < 256; v++) {
+                stats->hist[c][v] = (uint64_t)sub[0][c][v] + sub[1][c][v] + sub[2][c][v] + sub[3][c][v];
+            }
+        }
+        free(sub);
+        finish_stats(stats, total);
+        return 1;
+    }
+    
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = img->height / STATS_MIN_ROWS;
+    if (threads > max_threads) threads = max_threads;
+    if (threads < 1) threads = 1;
+    
+    HistogramTask* tasks = calloc(threads, sizeof(HistogramTask));
+    pthread_t* ids = malloc(threads * sizeof(pthread_t));
+    if (!tasks || !ids) {
+        free(tasks);
+        free(ids);
+        return 0;
+    }
+    
+    for (int t = 0; t < threads; t++) {
+        tasks[t].pixels = img->pixels;
+        tasks[t].begin = total * t / threads;
+        tasks[t].end = total * (t + 1) / threads;
+    }
+    // The calling thread takes the first share itself, and any share
+    // whose thread couldn't be started
+    int ok = 1;
+    for (int t = 1; t < threads; t++) {
+        tasks[t].started = pthread_create(&ids[t], NULL, histogram_worker, &tasks[t]) == 0;
+        if (!tasks[t].started) {
+            ok = histogram_worker(&tasks[t]) == NULL && ok;
+        }
+    }
+    ok = histogram_worker(&tasks[0]) == NULL && ok;
+    for (int t = 1; t < threads; t++) {
+        if (!tasks[t].started) continue;
+        void* result;
+        pthread_join(ids[t], &result);
+        ok = ok && result == NULL;
+    }
+    
+    for (int t = 0; t < threads; t++) {
+        for (int c = 0; c < 3; c++) {
+            for (int v = 0; v < 256; v++) {
+                stats->hist[c][v] += tasks[t].hist[c][v];
+            }
+        }
+    }
+    free(tasks);
+    free(ids);
+    finish_stats(stats, total);
+    return ok;
+}
+
+// Everything else falls out of the histogram
+static void finish_stats(ImageStats* stats, size_t total) {
+    stats->count = total;
+    for (int c = 0; c < 3; c++) {
+        uint64_t sum = 0;
+        int lo = 255, hi = 0;
+        for (int v = 0; v < 256; v++) {
+            if (stats->hist[c][v]) {
+                if (v < lo) lo = v;
+                hi = v;
+                sum += stats->hist[c][v] * v;
+            }
+        }
+        stats->min[c] = total ? lo : 0;
+        stats->max[c] = total ? hi : 0;
+        stats->mean[c] = total ? (double)sum / total : 0.0;
+    }
+}
+
+void print_stats(const ImageStats* stats) {
+    const char* names[3] = {"Blue", "Green", "Red"};
+    printf("%-8s %5s %5s %9s %8s\n", "Channel", "Min", "Max", "Mean", "Median");
+    for (int c = 2; c >= 0; c--) {
+        uint64_t seen = 0;
+        int median = 0;
+        for (int v = 0; v < 256; v++) {
+            seen += stats->hist[c][v];
+            if (seen * 2 >= stats->count) {
+                median = v;
+                break;
+            }
+        }
+        printf("%-8s %5d %5d %9.2f %8d\n", names[c], stats->min[c], stats->max[c],
+               stats->mean[c], median);
+    }
+}
+
+// Apply one 256-entry lookup table per channel
+void apply_channel_luts(Image* img, const uint8_t lut[3][256]) {
+    uint8_t* p = (uint8_t*)img->pixels;
+    size_t total = (size_t)img->width * img->height;
+    
+    if (img->layout == LAYOUT_PLANAR) {
+        for (int c = 0; c < 3; c++) {
+            uint8_t* plane = image_plane(img, c);
+            for (size_t i = 0; i < total; i++) {
+                plane[i] = lut[c][plane[i]];
+            }
+        }
+        return;
+    }
+    if (img->layout == LAYOUT_BGRX) {
+        for (size_t i = 0; i < total; i++) {
+            uint32_t px = img->bgrx[i];
+            img->bgrx[i] = lut[0][px & 0xFF] | (uint32_t)lut[1][(px >> 8) & 0xFF] << 8 |
+                           (uint32_t)lut[2][(px >> 16) & 0xFF] << 16;
+        }
+        return;
+    }
+    
+    // Same table for every channel: treat the image as a flat byte array
+    if (memcmp(lut[0], lut[1], 256) == 0 && memcmp(lut[1], lut[2], 256) == 0) {
+        const uint8_t* t = lut[0];
+        size_t bytes = total * 3;
+        size_t i = 0;
+        for (; i + 8 <= bytes; i += 8) {
+            p[i] = t[p[i]];         p[i + 1] = t[p[i + 1]];
+            p[i + 2] = t[p[i + 2]]; p[i + 3] = t[p[i + 3]];
+            p[i + 4] = t[p[i + 4]]; p[i + 5] = t[p[i + 5]];
+            p[i + 6] = t[p[i + 6]]; p[i + 7] = t[p[i + 7]];
+        }
+        for (; i < bytes; i++) {
+            p[i] = t[p[i]];
+        }
+        return;
+    }
+    
+    for (size_t i = 0; i < total; i++, p += 3) {
+        p[0] = lut[0][p[0]];
+        p[1] = lut[1][p[1]];
+        p[2] = lut[2][p[2]];
+    }
+}
+
+// Build per-channel tables stretching [low, high] to [0, 255], where
+// low/high skip the darkest and brightest clip_percent of pixels
+void build_autolevels_luts(const ImageStats* stats, double clip_percent, uint8_t lut[3][256]) {
+    uint64_t clip = (uint64_t)(stats->count * clip_percent / 100.0);
+    
+    for (int c = 0; c < 3; c++) {
+        int lo = 0, hi = 255;
+        uint64_t seen = 0;
+        while (lo < 255 && seen + stats->hist[c][lo] <= clip) {
+            seen += stats->hist[c][lo++];
+        }
+        seen = 0;
+        while (hi > 0 && seen + stats->hist[c][hi] <= clip) {
+            seen += stats->hist[c][hi--];
+        }
+        
+        for (int v = 0; v < 256; v++) {
+            if (hi <= lo) {
+                lut[c][v] = (uint8_t)v;  // Flat channel, leave it alone
+            } else {
+                lut[c][v] = (uint8_t)clamp_int(((v - lo) * 255 + (hi - lo) / 2) / (hi - lo), 0, 255);
+            }
+        }
+    }
+}
+
+void show_stats(Image* img) {
+    progress("Computing statistics...\n");
+    ImageStats stats;
+    if (!compute_stats(img, &stats)) {
+        printf("Error: Can't allocate histogram memory!\n");
+        return;
+    }
+    print_stats(&stats);
+}
+
+void auto_levels(Image* img, double clip_percent) {
+    progress("Auto levels (clipping %.2f%%)...\n", clip_percent);
+    ImageStats stats;
+    if (!compute_stats(img, &stats)) {
+        printf("Error: Can't allocate histogram memory!\n");
+        return;
+    }
+    uint8_t lut[3][256];
+    build_autolevels_luts(&stats, clip_percent, lut);
+    apply_channel_luts(img, lut);
+}
+
+// ---------------------------------------------------------------
+// Tone curves: any chain of per-channel tone steps is folded into one
+// 256-entry table per channel, then applied in a single pass. Each step
+// rounds to 8 bits like it would on its own, so the folded table gives
+// exactly what running the steps one after another would.
+// Steps are written [channel.]name[=value], for example
+//   curves gamma=2.2 contrast=1.3 r.brightness=-10 posterize=8
+// ---------------------------------------------------------------
+
+typedef struct {
+    uint8_t map[3][256];  // Output value so far for each input value (B, G, R)
+} ToneCurve;
+
+void tone_curve_init(ToneCurve* curve) {
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 256; v++) {
+            curve->map[c][v] = (uint8_t)v;
+        }
+    }
+}
+
+// Parse one step and fold it into the curve. Returns 0 if it's not understood.
+int tone_curve_add(ToneCurve* curve, const char* step) {
+    int channels[3] = {1, 1, 1};
+    if (step[0] != '\0' && step[1] == '.') {
+        int c = step[0] == 'b' ? 0 : step[0] == 'g' ? 1 : step[0] == 'r' ? 2 : -1;
+        if (c < 0) {
+            return 0;
+        }
+        channels[0] = channels[1] = channels[2] = 0;
+        channels[c] = 1;
+        step += 2;
+    }
+    
+    // Either name or name=value (a finite number), with nothing left over
+    char name[32];
+    float value = 0.0f;
+    int end = 0;
+    int has_value = 0;
+    if (sscanf(step, "%31[a-z]=%f%n", name, &value, &end) == 2 && step[end] == '\0' &&
+        isfinite(value)) {
+        has_value = 1;
+    } else if (sscanf(step, "%31[a-z]%n", name, &end) != 1 || step[end] != '\0') {
+        return 0;
+    }
+    
+    enum { GAMMA, BRIGHTNESS, CONTRAST, THRESHOLD, INVERT, POSTERIZE } kind;
+    if (strcmp(name, "gamma") == 0 && has_value && value > 0.0f) kind = GAMMA;
+    else if (strcmp(name, "brightness") == 0 && has_value) kind = BRIGHTNESS;
+    else if (strcmp(name, "contrast") == 0 && has_value && value >= 0.0f) kind = CONTRAST;
+    else if (strcmp(name, "threshold") == 0) kind = THRESHOLD;
+    else if (strcmp(name, "invert") == 0 && !has_value) kind = INVERT;
+    else if (strcmp(name, "posterize") == 0 && has_value && value >= 2.0f && value <= 256.0f) kind = POSTERIZE;
+    else return 0;
+    if (kind == THRESHOLD && !has_value) value = 128.0f;
+    
+    for (int c = 0; c < 3; c++) {
+        if (!channels[c]) continue;
+        for (int v = 0; v < 256; v++) {
+            float x = (float)curve->map[c][v];
+            switch (kind) {
+                case GAMMA:      x = 255.0f * powf(x / 255.0f, 1.0f / value); break;
+                case BRIGHTNESS: x = x + value; break;
+                case CONTRAST:   x = (x - 127.5f) * value + 127.5f; break;
+                case THRESHOLD:  x = x >= value ? 255.0f : 0.0f; break;
+                case INVERT:     x = 255.0f - x; break;
+                case POSTERIZE: {
+                    float levels = floorf(value) - 1.0f;
+                    x = roundf(roundf(x / 255.0f * levels) * 255.0f / levels);
+                    break;
+                }
+            }
+            // Clamp and round after every step, just like applying them one by one
+            curve->map[c][v] = clamp_u8(x);
+        }
+    }
+    return 1;
+}
+
+void tone_curve_compile(const ToneCurve* curve, uint8_t lut[3][256]) {
+    memcpy(lut, curve->map, sizeof(curve->map));
+}
+
+// curves <step> [step...]
+int apply_curves(Image* img, int argc, char* argv[]) {
+    if (argc < 1) {
+        printf("Usage: curves [b.|g.|r.]<step>[=value] ...\n");
+        printf("Steps: gamma=G brightness=B contrast=C threshold[=T] invert posterize=N\n");
+        return 0;
+    }
+    
+    ToneCurve curve;
+    tone_curve_init(&curve);
+    for (int i = 0; i < argc; i++) {
+        if (!tone_curve_add(&curve, argv[i])) {
+            printf("Unknown curve step: %s\n", argv[i]);
+            return 0;
+        }
+    }
+    
+    progress("Applying %d curve step(s) as one lookup table...\n", argc);
+    uint8_t lut[3][256];
+    tone_curve_compile(&curve, lut);
+    apply_channel_luts(img, lut);
+    return 1;
+}
+
+// ---------------------------------------------------------------
+// Rotate, transpose and vertical flip
+// Turning rows into columns walks one side of the copy with a stride
+// of a whole row, which misses the cache on every pixel. Working in
+// 32x32 tiles keeps both the source and destination tile in L1.
+// Square images and 180/flip are done in place.
+// ---------------------------------------------------------------
+
+#define ROTATE_TILE 32
+
+typedef enum { TURN_TRANSPOSE, TURN_CW90, TURN_CCW90 } TurnMode;
+
+// Where source pixel (x, y) lands in the w-by-h -> h-by-w output
+static inline size_t turn_index(TurnMode mode, int x, int y, int w, int h) {
+    switch (mode) {
+        case TURN_CW90:  return (size_t)x * h + (h - 1 - y);
+        case TURN_CCW90: return (size_t)(w - 1 - x) * h + y;
+        default:         return (size_t)x * h + y;
+    }
+}
+
+// Tiled out-of-place turn
+Pixel* turn_pixels_tiled(const Pixel* src, int w, int h, TurnMode mode) {
+    Pixel* dst = malloc((size_t)w * h * sizeof(Pixel));
+    if (!dst) {
+        return NULL;
+    }
+    
+    for (int ty = 0; ty < h; ty += ROTATE_TILE) {
+        int y_end = ty + ROTATE_TILE < h ? ty + ROTATE_TILE : h;
+        for (int tx = 0; tx < w; tx += ROTATE_TILE) {
+            int x_end = tx + ROTATE_TILE < w ? tx + ROTATE_TILE : w;
+            for (int x = tx; x < x_end; x++) {
+                for (int y = ty; y < y_end; y++) {
+                    dst[turn_index(mode, x, y, w, h)] = src[(size_t)y * w + x];
+                }
+            }
+        }
+    }
+    return dst;
+}
+
+// Straightforward version, kept for the benchmark
+Pixel* turn_pixels_naive(const Pixel* src, int w, int h, TurnMode mode) {
+    Pixel* dst = malloc((size_t)w * h * sizeof(Pixel));
+    if (!dst) {
+        return NULL;
+    }
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            dst[turn_index(mode, x, y, w, h)] = src[(size_t)y * w + x];
+        }
+    }
+    return dst;
+}
+
+// In-place transpose of an n-by-n image, swapping tile pairs across the diagonal
+static void transpose_square_in_place(Pixel* p, int n) {
+    for (int ty = 0; ty < n; ty += ROTATE_TILE) {
+        int y_end = ty + ROTATE_TILE < n ? ty + ROTATE_TILE : n;
+        for (int tx = ty; tx < n; tx += ROTATE_TILE) {
+            int x_end = tx + ROTATE_TILE < n ? tx + ROTATE_TILE : n;
+            for (int y = ty; y < y_end; y++) {
+                // On diagonal tiles only touch the upper triangle
+                for (int x = (tx == ty ? y + 1 : tx); x < x_end; x++) {
+                    Pixel temp = p[(size_t)y * n + x];
+                    p[(size_t)y * n + x] = p[(size_t)x * n + y];
+                    p[(size_t)x * n + y] = temp;
+                }
+            }
+        }
+    }
+}
+
+// Swap whole rows top to bottom, in place
+static void flip_rows(uint8_t* base, size_t row_bytes, int rows, uint8_t* temp) {
+    for (int top = 0, bottom = rows - 1; top < bottom; top++, bottom--) {
+        uint8_t* a = base + (size_t)top * row_bytes;
+        uint8_t* b = base + (size_t)bottom * row_bytes;
+        memcpy(temp, a, row_bytes);
+        memcpy(a, b, row_bytes);
+        memcpy(b, temp, row_bytes);
+    }
+}
+
+void flip_vertical(Image* img) {
+    progress("Flipping vertically...\n");
+    
+    uint8_t* temp = malloc((size_t)img->width * 4);
+    if (!temp) {
+        printf("Error: Can't allocate memory!\n");
+        return;
+    }
+    if (img->layout == LAYOUT_PLANAR) {
+        for (int c = 0; c < 3; c++) {
+            flip_rows(image_plane(img, c), img->width, img->height, temp);
+        }
+    } else if (img->layout == LAYOUT_BGRX) {
+        flip_rows((uint8_t*)img->bgrx, (size_t)img->width * 4, img->height, temp);
+    } else {
+        flip_rows((uint8_t*)img->pixels, (size_t)img->width * sizeof(Pixel), img->height, temp);
+    }
+    free(temp);
+}
+
+// 180 degrees is just the pixel array reversed, in place
+void rotate_180(Image* img) {
+    size_t total = (size_t)img->width * img->height;
+    if (img->layout == LAYOUT_PLANAR) {
+        for (int c = 0; c < 3; c++) {
+            uint8_t* p = image_plane(img, c);
+            for (size_t i = 0, j = total - 1; i < j; i++, j--) {
+                uint8_t temp = p[i];
+                p[i] = p[j];
+                p[j] = temp;
+            }
+        }
+        return;
+    }
+    if (img->layout == LAYOUT_BGRX) {
+        for (size_t i = 0, j = total - 1; i < j; i++, j--) {
+            uint32_t temp = img->bgrx[i];
+            img->bgrx[i] = img->bgrx[j];
+            img->bgrx[j] = temp;
+        }
+        return;
+    }
+    for (size_t i = 0, j = total - 1; i < j; i++, j--) {
+        Pixel temp = img->pixels[i];
+        img->pixels[i] = img->pixels[j];
+        img->pixels[j] = temp;
+    }
+}
+
+// Transpose or quarter turn, in place when the image is square
+int turn_image(Image* img, TurnMode mode) {
+    int w = img->width;
+    int h = img->height;
+    if (!convert_layout(img, LAYOUT_PACKED)) {
+        return 0;
+    }
+    
+    if (w == h) {
+        transpose_square_in_place(img->pixels, w);
+        if (mode == TURN_CW90) {
+            for (int row = 0; row < h; row++) {
+                mirror_row(&img->pixels[(size_t)row * w], w);
+            }
+        } else if (mode == TURN_CCW90) {
+            int q = quiet;
+            quiet = 1;
+            flip_vertical(img);
+            quiet = q;
+        }
+        return 1;
+    }
+    
+    Pixel* out = turn_pixels_tiled(img->pixels, w, h, mode);
+    if (!out) {
+        printf("Error: Can't allocate rotation buffer!\n");
+        return 0;
+    }
+    replace_pixels(img, out);
+    set_image_size(img, h, w);
+    return 1;
+}
+
+// rotate 90|180|270 (clockwise)
+int rotate_image(Image* img, int degrees) {
+    progress("Rotating %d degrees clockwise...\n", degrees);
+    switch (degrees) {
+        case 90:  return turn_image(img, TURN_CW90);
+        case 180: rotate_180(img); return 1;
+        case 270: return turn_image(img, TURN_CCW90);
+        default:
+            printf("Usage: rotate 90|180|270\n");
+            return 0;
+    }
+}
+
+void transpose_image(Image* img) {
+    progress("Transposing...\n");
+    turn_image(img, TURN_TRANSPOSE);
+}
+
+// Naive vs tiled quarter turns on the loaded image (try an 8K one)
+void benchmark_rotate(Image* img) {
+    printf("Benchmarking rotation on %dx%d...\n", img->width, img->height);
+    printf("%-12s %12s %12s %9s\n", "Operation", "Naive (ms)", "Tiled (ms)", "Speedup");
+    
+    const char* names[3] = {"transpose", "rotate 90", "rotate 270"};
+    TurnMode modes[3] = {TURN_TRANSPOSE, TURN_CW90, TURN_CCW90};
+    for (int i = 0; i < 3; i++) {
+        double t0 = now_seconds();
+        Pixel* naive = turn_pixels_naive(img->pixels, img->width, img->height, modes[i]);
+        double t1 = now_seconds();
+        Pixel* tiled = turn_pixels_tiled(img->pixels, img->width, img->height, modes[i]);
+        double t2 = now_seconds();
+        
+        if (naive && tiled) {
+            size_t bytes = (size_t)img->width * img->height * sizeof(Pixel);
+            printf("%-12s %12.2f %12.2f %8.2fx%s\n", names[i], (t1 - t0) * 1e3, (t2 - t1) * 1e3,
+                   (t1 - t0) / (t2 - t1), memcmp(naive, tiled, bytes) ? "  MISMATCH" : "");
+        } else {
+            printf("Error: Can't allocate benchmark buffers!\n");
+        }
+        free(naive);
+        free(tiled);
+    }
+}
+
+// ---------------------------------------------------------------
+// Layout benchmark: time the operations that have their own code for
+// each layout and show which layout wins for each one
+// ---------------------------------------------------------------
+
+#define LAYOUT_BENCH_REPS 5
+
+static void bench_curves(Image* img) {
+    uint8_t lut[3][256];
+    for (int v = 0; v < 256; v++) {
+        lut[0][v] = (uint8_t)(255 - v);
+        lut[1][v] = (uint8_t)(v / 2);
+        lut[2][v] = (uint8_t)(v | 0x0F);
+    }
+    apply_channel_luts(img, lut);
+}
+
+static void bench_stats(Image* img) {
+    ImageStats stats;
+    compute_stats(img, &stats);
+}
+
+// Deep copy of a packed image
+Image* clone_image(const Image* src) {
+    Image* img = malloc(sizeof(Image));
+    if (!img) {
+        return NULL;
+    }
+    *img = *src;
+    size_t bytes = (size_t)src->width * src->height * sizeof(Pixel);
+    img->pixels = malloc(bytes);
+    if (!img->pixels) {
+        free(img);
+        return NULL;
+    }
+    memcpy(img->pixels, src->pixels, bytes);
+    return img;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void benchmark_layouts(Image* img) {
+    if (!convert_layout(img, LAYOUT_PACKED)) {
+        return;
+    }
+    printf("Benchmarking layouts on %dx%d (median of %d runs)...\n",
+           img->width, img->height, LAYOUT_BENCH_REPS);
+    printf("%-12s %12s %12s %12s   %s\n", "Operation", "packed (ms)", "planar (ms)", "bgrx (ms)", "Winner");
+    
+    const char* names[] = {"grayscale", "invert", "mirror", "curves", "stats", "flip", "rotate 180"};
+    void (*ops[])(Image*) = {make_grayscale, invert_colors, mirror_horizontal, bench_curves,
+                             bench_stats, flip_vertical, rotate_180};
+    int count = sizeof(ops) / sizeof(ops[0]);
+    
+    int q = quiet;
+    quiet = 1;
+    for (int i = 0; i < count; i++) {
+        double median[3];
+        for (int layout = LAYOUT_PACKED; layout <= LAYOUT_BGRX; layout++) {
+            double times[LAYOUT_BENCH_REPS];
+            for (int rep = 0; rep < LAYOUT_BENCH_REPS; rep++) {
+                Image* copy = clone_image(img);
+                if (!copy || !convert_layout(copy, layout)) {
+                    quiet = q;
+                    printf("Error: Can't allocate benchmark image!\n");
+                    if (copy) free_image(copy);
+                    return;
+                }
+                double t0 = now_seconds();
+                ops[i](copy);
+                times[rep] = now_seconds() - t0;
+                free_image(copy);
+            }
+            qsort(times, LAYOUT_BENCH_REPS, sizeof(double), compare_doubles);
+            median[layout] = times[LAYOUT_BENCH_REPS / 2];
+        }
+        int best = 0;
+        for (int layout = 1; layout < 3; layout++) {
+            if (median[layout] < median[best]) best = layout;
+        }
+        printf("%-12s %12.3f %12.3f %12.3f   %s\n", names[i], median[0] * 1e3,
+               median[1] * 1e3, median[2] * 1e3, layout_name(best));
+    }
+    quiet = q;
+}
+
+// End-to-end save latency with the writer inline and on its own thread.
+// The temporary file is fsync'd so the disk is really part of the time.
+void benchmark_save(Image* img, int reps) {
+    char path[] = "/tmp/imageProcessor-save-XXXXXX";
+    int fd = mkstemp(path);
+    double* times = malloc(reps * sizeof(double));
+    if (fd < 0 || !times) {
+        printf("Error: Can't create a temporary file for the benchmark!\n");
+        if (fd >= 0) {
+            close(fd);
+            unlink(path);
+        }
+        free(times);
+        return;
+    }
+    close(fd);
+    
+    size_t bytes = ((size_t)(output_bits == 32 ? 32 : 24) * img->width + 31) / 32 * 4 * img->height;
+    printf("Saving %dx%d (%.1f MB, %s layout), median of %d, fsync included\n", img->width,
+           img->height, bytes / 1048576.0, layout_name(img->layout), reps);
+    const char* modes[2] = {"inline writes", "writer thread"};
+    double median[2];
+    int q = quiet;
+    int ok = 1;
+    for (int threaded = 0; threaded < 2 && ok; threaded++) {
+        quiet = 1;
+        for (int rep = 0; rep < reps && ok; rep++) {
+            double t0 = now_seconds();
+            ok = write_bmp_file(path, img, NULL, NULL, threaded, 1);
+            times[rep] = now_seconds() - t0;
+        }
+        quiet = q;
+        if (!ok) {
+            break;
+        }
+        qsort(times, reps, sizeof(double), compare_doubles);
+        median[threaded] = times[reps / 2];
+        printf("%-14s %9.3f ms  %8.1f MB/s\n", modes[threaded], median[threaded] * 1e3,
+               bytes / 1048576.0 / median[threaded]);
+    }
+    if (ok) {
+        printf("Writer thread speedup: %.2fx\n", median[0] / median[1]);
+    }
+    unlink(path);
+    free(times);
+}
+
+// ---------------------------------------------------------------
+// Perceptual hashes and image diff. Both hashes start from the same
+// luma as grayscale, averaged down to a tiny image: dHash compares
+// neighbours in a 9x8 image, pHash thresholds the lowest 8x8 DCT
+// frequencies of a 32x32 one. Similar images differ in few bits.
+// ---------------------------------------------------------------
+
+#define PHASH_SIZE 32   // Side of the image the DCT runs on
+#define PHASH_FREQS 8   // Low frequencies kept per axis
+
+// Area downscale of the image's grayscale to w x h cells. When the image
+// is smaller than the target a cell just takes the nearest pixel.
+static void downscale_luma(const Image* img, float* out, int w, int h) {
+    for (int oy = 0; oy < h; oy++) {
+        int y0 = (int)((long long)oy * img->height / h);
+        int y1 = (int)((long long)(oy + 1) * img->height / h);
+        if (y1 <= y0) y1 = y0 + 1;
+        for (int ox = 0; ox < w; ox++) {
+            int x0 = (int)((long long)ox * img->width / w);
+            int x1 = (int)((long long)(ox + 1) * img->width / w);
+            if (x1 <= x0) x1 = x0 + 1;
+            float sum = 0.0f;
+            for (int y = y0; y < y1; y++) {
+                const Pixel* p = &img->pixels[(size_t)y * img->width];
+                for (int x = x0; x < x1; x++) {
+                    sum += luminance(p[x].red, p[x].green, p[x].blue);
+                }
+            }
+            out[oy * w + ox] = sum / ((float)(y1 - y0) * (x1 - x0));
+        }
+    }
+}
+
+// Bit set where a cell is brighter than its right neighbour
+uint64_t dhash_image(const Image* img) {
+    float cells[9 * 8];
+    downscale_luma(img, cells, 9, 8);
+    uint64_t hash = 0;
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            hash = hash << 1 | (cells[y * 9 + x] > cells[y * 9 + x + 1]);
+        }
+    }
+    return hash;
+}
+
+static int compare_floats(const void* a, const void* b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+static float dct_basis[PHASH_FREQS][PHASH_SIZE];  // cos((2x+1)u*pi/2N)
+static pthread_once_t dct_basis_once = PTHREAD_ONCE_INIT;
+
+static void fill_dct_basis(void) {
+    for (int u = 0; u < PHASH_FREQS; u++) {
+        for (int x = 0; x < PHASH_SIZE; x++) {
+            dct_basis[u][x] = (float)cos((2 * x + 1) * u * M_PI / (2 * PHASH_SIZE));
+        }
+    }
+}
+
+// Bit set where a low-frequency DCT coefficient is above the median
+uint64_t phash_image(const Image* img) {
+    pthread_once(&dct_basis_once, fill_dct_basis);
+    
+    float luma[PHASH_SIZE * PHASH_SIZE];
+    downscale_luma(img, luma, PHASH_SIZE, PHASH_SIZE);
+    
+    // Separable DCT, keeping only the frequencies we need
+    float rows[PHASH_SIZE][PHASH_FREQS];
+    for (int y = 0; y < PHASH_SIZE; y++) {
+        for (int u = 0; u < PHASH_FREQS; u++) {
+            float sum = 0.0f;
+            for (int x = 0; x < PHASH_SIZE; x++) {
+                sum += luma[y * PHASH_SIZE + x] * dct_basis[u][x];
+            }
+            rows[y][u] = sum;
+        }
+    }
+    float coeffs[PHASH_FREQS * PHASH_FREQS];
+    for (int v = 0; v < PHASH_FREQS; v++) {
+        for (int u = 0; u < PHASH_FREQS; u++) {
+            float sum = 0.0f;
+            for (int y = 0; y < PHASH_SIZE; y++) {
+                sum += rows[y][u] * dct_basis[v][y];
+            }
+            coeffs[v * PHASH_FREQS + u] = sum;
+        }
+    }
+    
+    // The DC term only tracks overall brightness, so leave it out of the median
+    float sorted[PHASH_FREQS * PHASH_FREQS - 1];
+    memcpy(sorted, coeffs + 1, sizeof(sorted));
+    qsort(sorted, PHASH_FREQS * PHASH_FREQS - 1, sizeof(float), compare_floats);
+    float median = sorted[(PHASH_FREQS * PHASH_FREQS - 1) / 2];
+    
+    uint64_t hash = 0;
+    for (int i = 0; i < PHASH_FREQS * PHASH_FREQS; i++) {
+        hash = hash << 1 | (coeffs[i] > median);
+    }
+    return hash;
+}
+
+static inline int hash_distance(uint64_t a, uint64_t b) {
+    return __builtin_popcountll(a ^ b);
+}
+
+void show_hashes(Image* img) {
+    printf("pHash %016llx\n", (unsigned long long)phash_image(img));
+    printf("dHash %016llx\n", (unsigned long long)dhash_image(img));
+}
+
+typedef struct {
+    uint64_t sum_abs;   // Sum of |a - b| over every channel byte
+    uint64_t sum_sq;    // Sum of (a - b)^2
+    int max;
+    size_t count;
+} DiffStats;
+
+// Compare n bytes and leave |a - b| in a
+static void diff_bytes(uint8_t* a, const uint8_t* b, size_t n, DiffStats* stats) {
+    size_t i = 0;
+    uint64_t sum_abs = 0, sum_sq = 0;
+    int max = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sad = zero, sq = zero, top = zero;
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        sad = _mm_add_epi64(sad, _mm_sad_epu8(d, zero));
+        top = _mm_max_epu8(top, d);
+        __m128i lo = _mm_unpacklo_epi8(d, zero);
+        __m128i hi = _mm_unpackhi_epi8(d, zero);
+        __m128i s32 = _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi));
+        sq = _mm_add_epi64(sq, _mm_add_epi64(_mm_unpacklo_epi32(s32, zero),
+                                             _mm_unpackhi_epi32(s32, zero)));
+        _mm_storeu_si128((__m128i*)(a + i), d);
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, sad);
+    sum_abs = lanes[0] + lanes[1];
+    _mm_storeu_si128((__m128i*)lanes, sq);
+    sum_sq = lanes[0] + lanes[1];
+    uint8_t tops[16];
+    _mm_storeu_si128((__m128i*)tops, top);
+    for (int k = 0; k < 16; k++) {
+        if (tops[k] > max) max = tops[k];
+    }
+#endif
+    for (; i < n; i++) {
+        int d = abs(a[i] - b[i]);
+        sum_abs += d;
+        sum_sq += (uint64_t)(d * d);
+        if (d > max) max = d;
+        a[i] = (uint8_t)d;
+    }
+    stats->sum_abs = sum_abs;
+    stats->sum_sq = sum_sq;
+    stats->max = max;
+    stats->count = n;
+}
+
+// diff operation: report how far img is from another image and turn img
+// into the per-channel absolute difference, scaled by gain
+int diff_image(Image* img, char* other_file, int gain) {
+    int q = quiet;
+    quiet = 1;
+    Image* other = load_bmp(other_file);
+    quiet = q;
+    if (!other || !convert_layout(other, LAYOUT_PACKED)) {
+        printf("Error: Can't load %s to compare with!\n", other_file);
+        if (other) free_image(other);
+        return 0;
+    }
+    if (other->width != img->width || other->height != img->height) {
+        printf("Error: Sizes differ (%dx%d vs %dx%d)!\n", img->width, img->height,
+               other->width, other->height);
+        free_image(other);
+        return 0;
+    }
+    
+    // Hash distances first, diff_bytes overwrites img
+    int phash_bits = hash_distance(phash_image(img), phash_image(other));
+    int dhash_bits = hash_distance(dhash_image(img), dhash_image(other));
+    
+    DiffStats stats;
+    size_t n = (size_t)img->width * img->height * sizeof(Pixel);
+    double start = now_seconds();
+    diff_bytes((uint8_t*)img->pixels, (const uint8_t*)other->pixels, n, &stats);
+    double elapsed = now_seconds() - start;
+    
+    double mse = (double)stats.sum_sq / stats.count;
+    printf("Mean abs diff: %.4f  Max: %d  MSE: %.4f\n", (double)stats.sum_abs / stats.count,
+           stats.max, mse);
+    if (mse > 0.0) {
+        printf("PSNR: %.2f dB\n", 10.0 * log10(255.0 * 255.0 / mse));
+    } else {
+        printf("PSNR: inf (identical)\n");
+    }
+    printf("pHash distance: %d  dHash distance: %d (of 64 bits)\n", phash_bits, dhash_bits);
+    progress("Compared %.1f MB in %.3f ms\n", n / 1048576.0, elapsed * 1e3);
+    
+    if (gain > 1) {
+        uint8_t* p = (uint8_t*)img->pixels;
+        for (size_t i = 0; i < n; i++) {
+            int v = p[i] * gain;
+            p[i] = (uint8_t)(v > 255 ? 255 : v);
+        }
+    }
+    free_image(other);
+    return 1;
+}
+
+// ---------------------------------------------------------------
+// Integral image (summed-area table) of the luma and the adaptive
+// threshold built on it. Once the table exists, the sum over any
+// rectangle costs four lookups whatever its size.
+// ---------------------------------------------------------------
+
+#define INTEGRAL_MIN_ROWS 64          // Don't start a thread for less than this
+#define INTEGRAL_LINE 8               // uint64_t sums per 64-byte cache line
+#define THRESHOLD_DEFAULT_PERCENT 15
+#define THRESHOLD_BENCH_WINDOW 15
+
+typedef struct {
+    int width, height;
+    size_t stride;  // Sums per row: width + 1 rounded up to whole cache lines
+    uint64_t* sum;  // (height+1) rows of stride; sum[y][x] covers rows < y and columns < x
+} IntegralImage;
+
+typedef struct {
+    IntegralImage* ii;
+    const uint8_t* values;
+    int begin, end;  // Rows for the first pass, table columns for the second
+    int started;     // Ran on its own thread
+} IntegralTask;
+
+// Sum of [x0, x1) x [y0, y1)
+static inline uint64_t integral_rect(const IntegralImage* ii, int x0, int y0, int x1, int y1) {
+    size_t s = ii->stride;
+    return ii->sum[y1 * s + x1] - ii->sum[y0 * s + x1] - ii->sum[y1 * s + x0] + ii->sum[y0 * s + x0];
+}
+
+// Same luma as grayscale, one byte per pixel
+uint8_t* luma_plane(const Image* img) {
+    size_t total = (size_t)img->width * img->height;
+    uint8_t* luma = malloc(total ? total : 1);
+    if (luma) {
+        for (size_t i = 0; i < total; i++) {
+            const Pixel* p = &img->pixels[i];
+            luma[i] = luminance(p->red, p->green, p->blue);
+        }
+    }
+    return luma;
+}
+
+// First pass: running sum along each row in the band
+static void* integral_rows_worker(void* arg) {
+    IntegralTask* task = arg;
+    size_t s = task->ii->stride;
+    for (int y = task->begin; y < task->end; y++) {
+        const uint8_t* v = task->values + (size_t)y * task->ii->width;
+        uint64_t* out = task->ii->sum + (y + 1) * s;
+        uint64_t run = 0;
+        out[0] = 0;
+        for (int x = 0; x < task->ii->width; x++) {
+            run += v[x];
+            out[x + 1] = run;
+        }
+    }
+    return NULL;
+}
+
+// Second pass: add each row to the one below, over a band of columns.
+// Walking down rows keeps the inner loop contiguous and vectorisable.
+static void* integral_cols_worker(void* arg) {
+    IntegralTask* task = arg;
+    size_t s = task->ii->stride;
+    for (int y = 2; y <= task->ii->height; y++) {
+        uint64_t* row = task->ii->sum + y * s;
+        const uint64_t* above = row - s;
+        for (int x = task->begin; x < task->end; x++) {
+            row[x] += above[x];
+        }
+    }
+    return NULL;
+}
+
+// Run one pass over 'count' rows or columns split across threads, with
+// band boundaries rounded down to multiples of 'align'
+static void integral_pass(void* (*worker)(void*), IntegralImage* ii, const uint8_t* values,
+                          int count, int align, int threads, IntegralTask* tasks, pthread_t* ids) {
+    for (int t = 0; t < threads; t++) {
+        tasks[t].ii = ii;
+        tasks[t].values = values;
+        tasks[t].begin = (int)((long long)count * t / threads) / align * align;
+        tasks[t].end = t + 1 == threads ? count : (int)((long long)count * (t + 1) / threads) / align * align;
+    }
+    // The calling thread takes the first share itself, and any share
+    // whose thread couldn't be started
+    for (int t = 1; t < threads; t++) {
+        tasks[t].started = pthread_create(&ids[t], NULL, worker, &tasks[t]) == 0;
+        if (!tasks[t].started) {
+            worker(&tasks[t]);
+        }
+    }
+    worker(&tasks[0]);
+    for (int t = 1; t < threads; t++) {
+        if (tasks[t].started) {
+            pthread_join(ids[t], NULL);
+        }
+    }
+}
+
+// Build the table for a width x height plane of bytes: row prefix sums,
+// then column prefix sums, each pass split across threads
+IntegralImage* build_integral(const uint8_t* values, int width, int height) {
+    IntegralImage* ii = malloc(sizeof(IntegralImage));
+    if (!ii) {
+        return NULL;
+    }
+    ii->width = width;
+    ii->height = height;
+    // Rows are whole cache lines and the table starts on one, so column
+    // bands split on INTEGRAL_LINE boundaries never share a line
+    ii->stride = ((size_t)width + INTEGRAL_LINE) / INTEGRAL_LINE * INTEGRAL_LINE;
+    void* sum = NULL;
+    if (posix_memalign(&sum, INTEGRAL_LINE * sizeof(uint64_t),
+                       ii->stride * (height + 1) * sizeof(uint64_t)) != 0) {
+        sum = NULL;
+    }
+    ii->sum = sum;
+    
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = height / INTEGRAL_MIN_ROWS;
+    if (threads > max_threads) threads = max_threads;
+    if (threads < 1) threads = 1;
+    IntegralTask* tasks = calloc(threads, sizeof(IntegralTask));
+    pthread_t* ids = malloc(threads * sizeof(pthread_t));
+    if (!ii->sum || !tasks || !ids) {
+        free(ii->sum);
+        free(ii);
+        free(tasks);
+        free(ids);
+        return NULL;
+    }
+    
+    memset(ii->sum, 0, ii->stride * sizeof(uint64_t));  // Row 0 is all zeros
+    integral_pass(integral_rows_worker, ii, values, height, 1, threads, tasks, ids);
+    integral_pass(integral_cols_worker, ii, values, width + 1, INTEGRAL_LINE, threads, tasks, ids);
+    
+    free(tasks);
+    free(ids);
+    return ii;
+}
+
+void free_integral(IntegralImage* ii) {
+    if (ii) {
+        free(ii->sum);
+        free(ii);
+    }
+}
+
+// Bradley's rule: a pixel is black if it is more than 'percent' darker
+// than the mean of the window around it (clipped at the edges)
+static inline uint8_t bradley_pixel(int value, uint64_t sum, int area, int percent) {
+    return (uint64_t)value * area * 100 <= sum * (uint64_t)(100 - percent) ? 0 : 255;
+}
+
+static void threshold_integral(const IntegralImage* ii, const uint8_t* luma, uint8_t* out,
+                               int window, int percent) {
+    int half = window / 2;
+    for (int y = 0; y < ii->height; y++) {
+        int y0 = y - half < 0 ? 0 : y - half;
+        int y1 = y + half + 1 > ii->height ? ii->height : y + half + 1;
+        for (int x = 0; x < ii->width; x++) {
+            int x0 = x - half < 0 ? 0 : x - half;
+            int x1 = x + half + 1 > ii->width ? ii->width : x + half + 1;
+            size_t i = (size_t)y * ii->width + x;
+            out[i] = bradley_pixel(luma[i], integral_rect(ii, x0, y0, x1, y1),
+                                   (x1 - x0) * (y1 - y0), percent);
+        }
+    }
+}
+
+// Reference version that sums every window directly, O(window^2) per pixel
+static void threshold_naive(const uint8_t* luma, uint8_t* out, int width, int height,
+                            int window, int percent) {
+    int half = window / 2;
+    for (int y = 0; y < height; y++) {
+        int y0 = y - half < 0 ? 0 : y - half;
+        int y1 = y + half + 1 > height ? height : y + half + 1;
+        for (int x = 0; x < width; x++) {
+            int x0 = x - half < 0 ? 0 : x - half;
+            int x1 = x + half + 1 > width ? width : x + half + 1;
+            uint64_t sum = 0;
+            for (int wy = y0; wy < y1; wy++) {
+                for (int wx = x0; wx < x1; wx++) {
+                    sum += luma[(size_t)wy * width + wx];
+                }
+            }
+            size_t i = (size_t)y * width + x;
+            out[i] = bradley_pixel(luma[i], sum, (x1 - x0) * (y1 - y0), percent);
+        }
+    }
+}
+
+// threshold [window] [percent]: black and white image from Bradley's rule
+int adaptive_threshold(Image* img, int window, int percent) {
+    if (window <= 0) {
+        int side = img->width > img->height ? img->width : img->height;
+        window = side / 8 | 1;
+    }
+    progress("Adaptive threshold (window %d, %d%%)...\n", window, percent);
+    
+    uint8_t* luma = luma_plane(img);
+    IntegralImage* ii = luma ? build_integral(luma, img->width, img->height) : NULL;
+    if (!ii) {
+        printf("Error: Can't allocate memory for integral image!\n");
+        free(luma);
+        return 0;
+    }
+    // The result overwrites the luma plane in place: each pixel only reads its own value
+    threshold_integral(ii, luma, luma, window, percent);
+    size_t total = (size_t)img->width * img->height;
+    for (size_t i = 0; i < total; i++) {
+        img->pixels[i].red = img->pixels[i].green = img->pixels[i].blue = luma[i];
+    }
+    free_integral(ii);
+    free(luma);
+    return 1;
+}
+
+// Time the table build and the threshold against summing every window
+void benchmark_threshold(Image* img, int window) {
+    printf("Adaptive threshold on %dx%d, window %d\n", img->width, img->height, window);
+    size_t total = (size_t)img->width * img->height;
+    uint8_t* luma = luma_plane(img);
+    uint8_t* fast = malloc(total ? total : 1);
+    uint8_t* slow = malloc(total ? total : 1);
+    if (!luma || !fast || !slow) {
+        printf("Error: Can't allocate benchmark buffers!\n");
+        free(luma);
+        free(fast);
+        free(slow);
+        return;
+    }
+    
+    double t0 = now_seconds();
+    IntegralImage* ii = build_integral(luma, img->width, img->height);
+    double t1 = now_seconds();
+    if (!ii) {
+        printf("Error: Can't allocate memory for integral image!\n");
+        free(luma);
+        free(fast);
+        free(slow);
+        return;
+    }
+    threshold_integral(ii, luma, fast, window, THRESHOLD_DEFAULT_PERCENT);
+    double t2 = now_seconds();
+    threshold_naive(luma, slow, img->width, img->height, window, THRESHOLD_DEFAULT_PERCENT);
+    double t3 = now_seconds();
+    
+    // The table must agree with a direct sum of the whole image
+    uint64_t direct = 0;
+    for (size_t i = 0; i < total; i++) {
+        direct += luma[i];
+    }
+    int same = memcmp(fast, slow, total) == 0 &&
+               integral_rect(ii, 0, 0, img->width, img->height) == direct;
+    
+    double mpix = total / 1e6;
+    printf("Integral build:     %9.3f ms  (%.0f Mpixel/s)\n", (t1 - t0) * 1e3, mpix / (t1 - t0));
+    printf("Threshold (table):  %9.3f ms\n", (t2 - t1) * 1e3);
+    printf("Threshold (naive):  %9.3f ms\n", (t3 - t2) * 1e3);
+    printf("Speedup: %.1fx, outputs %s\n", (t3 - t2) / (t2 - t0), same ? "match" : "DIFFER");
+    
+    free_integral(ii);
+    free(luma);
+    free(fast);
+    free(slow);
+}
+
+int crop_image(Image* img, char* spec);
+
+// Read an optional integer argument for an operation
+int op_int_arg(int argc, char* argv[], int index, int fallback) {
+    return index < argc ? atoi(argv[index]) : fallback;
+}
+
+static int apply_operation(Image* img, char* operation, int argc, char* argv[]) {
+    // These have their own planar and BGRX code, everything else works on packed pixels
+    const char* layout_aware[] = {"grayscale", "invert", "mirror", "stats", "autolevels",
+                                  "curves", "flip", "rotate", "layoutbench", "savebench"};
+    int aware = 0;
+    for (size_t i = 0; i < sizeof(layout_aware) / sizeof(layout_aware[0]); i++) {
+        aware = aware || strcmp(operation, layout_aware[i]) == 0;
+    }
+    if (!aware && !convert_layout(img, LAYOUT_PACKED)) {
+        return 0;
+    }
+    
+    if (strcmp(operation, "grayscale") == 0) {
+        make_grayscale(img);
+    }
+    else if (strcmp(operation, "invert") == 0) {
+        invert_colors(img);
+    }
+    else if (strcmp(operation, "mirror") == 0) {
+        mirror_horizontal(img);
+    }
+    else if (strcmp(operation, "blur") == 0) {
+        gaussian_blur(img, clamp_int(op_int_arg(argc, argv, 0, 2), 0, MAX_KERNEL_RADIUS));
+    }
+    else if (strcmp(operation, "boxblur") == 0) {
+        box_blur(img, clamp_int(op_int_arg(argc, argv, 0, 2), 0, 1000));
+    }
+    else if (strcmp(operation, "sharpen") == 0) {
+        sharpen(img);
+    }
+    else if (strcmp(operation, "edges") == 0) {
+        sobel_edges(img);
+    }
+    else if (strcmp(operation, "convolve") == 0) {
+        // Arbitrary kernel: size followed by size*size weights, row by row
+        int size = op_int_arg(argc, argv, 0, 0);
+        Kernel* k = NULL;
+        // Bound size before squaring it, so a huge value can't overflow
+        if (size > 0 && size <= 2 * MAX_KERNEL_RADIUS + 1 && argc == 1 + size * size) {
+            k = create_kernel(size, NULL);
+        }
+        if (!k) {
+            printf("Usage: convolve <size> <size*size weights>\n");
+            return 0;
+        }
+        for (int i = 0; i < size * size; i++) {
+            k->weights[i] = (float)atof(argv[1 + i]);
+        }
+        progress("Convolving with %dx%d kernel...\n", size, size);
+        int ok = convolve(img, k);
+        free_kernel(k);
+        return ok;
+    }
+    else if (strcmp(operation, "resize") == 0 || strcmp(operation, "resizebench") == 0) {
+        // resize WxH [nearest|bilinear|lanczos], resizebench [filter]
+        int bench = strcmp(operation, "resizebench") == 0;
+        int arg = bench ? 0 : 1;
+        int width = 0, height = 0;
+        ResizeFilter filter = RESIZE_LANCZOS;
+        if (arg < argc) {
+            if (strcmp(argv[arg], "nearest") == 0) filter = RESIZE_NEAREST;
+            else if (strcmp(argv[arg], "bilinear") == 0) filter = RESIZE_BILINEAR;
+            else if (strcmp(argv[arg], "lanczos") != 0) width = -1;
+        }
+        if (!bench && (argc < 1 || sscanf(argv[0], "%dx%d", &width, &height) != 2)) {
+            width = -1;
+        }
+        if (width < 0 || (!bench && (width < 1 || height < 1))) {
+            printf("Usage: resize <W>x<H> [nearest|bilinear|lanczos]\n");
+            return 0;
+        }
+        if (bench) {
+            benchmark_resize(img, filter);
+        } else {
+            return resize_image(img, width, height, filter);
+        }
+    }
+    else if (strcmp(operation, "stats") == 0) {
+        show_stats(img);
+    }
+    else if (strcmp(operation, "autolevels") == 0) {
+        double clip = argc > 0 ? atof(argv[0]) : 0.5;
+        auto_levels(img, clip < 0.0 ? 0.0 : (clip > 49.0 ? 49.0 : clip));
+    }
+    else if (strcmp(operation, "curves") == 0) {
+        return apply_curves(img, argc, argv);
+    }
+    else if (strcmp(operation, "rotate") == 0) {
+        return rotate_image(img, op_int_arg(argc, argv, 0, 0));
+    }
+    else if (strcmp(operation, "transpose") == 0) {
+        transpose_image(img);
+    }
+    else if (strcmp(operation, "flip") == 0) {
+        flip_vertical(img);
+    }
+    else if (strcmp(operation, "rotatebench") == 0) {
+        benchmark_rotate(img);
+    }
+    else if (strcmp(operation, "layoutbench") == 0) {
+        benchmark_layouts(img);
+    }
+    else if (strcmp(operation, "crop") == 0) {
+        if (argc < 1) {
+            printf("Usage: crop X,Y,WxH\n");
+            return 0;
+        }
+        return crop_image(img, argv[0]);
+    }
+    else if (strcmp(operation, "hash") == 0) {
+        show_hashes(img);
+    }
+    else if (strcmp(operation, "diff") == 0) {
+        if (argc < 1) {
+            printf("Usage: diff <other.bmp> [gain]\n");
+            return 0;
+        }
+        return diff_image(img, argv[0], clamp_int(op_int_arg(argc, argv, 1, 1), 1, 255));
+    }
+    else if (strcmp(operation, "threshold") == 0) {
+        return adaptive_threshold(img, op_int_arg(argc, argv, 0, 0),
+                                  clamp_int(op_int_arg(argc, argv, 1, THRESHOLD_DEFAULT_PERCENT), 0, 100));
+    }
+    else if (strcmp(operation, "thresholdbench") == 0) {
+        benchmark_threshold(img, clamp_int(op_int_arg(argc, argv, 0, THRESHOLD_BENCH_WINDOW), 1, 1001));
+    }
+    else if (strcmp(operation, "savebench") == 0) {
+        benchmark_save(img, clamp_int(op_int_arg(argc, argv, 0, 5), 1, 1000));
+    }
+    else if (strcmp(operation, "convbench") == 0) {
+        benchmark_convolution(img, clamp_int(op_int_arg(argc, argv, 0, 2), 0, MAX_KERNEL_RADIUS));
+    }
+    else {
+        printf("Unknown operation: %s\n", operation);
+        printf("Use: grayscale, invert, mirror, blur, boxblur, sharpen, edges,\n");
+        printf("     convolve, convbench, resize, resizebench, stats, autolevels, curves,\n");
+        printf("     rotate, transpose, flip, crop, hash, diff, threshold, thresholdbench,\n");
+        printf("     rotatebench, layoutbench or savebench\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Run a named operation on a loaded image. argv holds the arguments
+// that follow the operation name. Returns 1 on success.
+int run_operation(Image* img, char* operation, int argc, char* argv[]) {
+    TRACE_BEGIN(span);
+    size_t bytes = (size_t)img->width * img->height * sizeof(Pixel);
+    int ok = apply_operation(img, operation, argc, argv);
+    TRACE_END(span, operation, bytes);
+    return ok;
+}
+
+// Run an operation and save the result. Row-local operations are run
+// band by band as the file is written (see save_bmp_rows) instead of
+// finishing the whole image first.
+int run_and_save(Image* img, char* output_file, char* operation, int argc, char* argv[]) {
+    BandOp op = NULL;
+    if (argc == 0 && strcmp(operation, "grayscale") == 0) {
+        op = grayscale_rows;
+    } else if (argc == 0 && strcmp(operation, "invert") == 0) {
+        op = invert_rows;
+    } else if (argc == 0 && strcmp(operation, "mirror") == 0) {
+        op = mirror_rows;
+    }
+    if (op) {
+        return save_bmp_rows(output_file, img, op, operation);
+    }
+    return run_operation(img, operation, argc, argv) && save_bmp(output_file, img);
+}
+
+// ---------------------------------------------------------------
+// Tiled region cache: crops are decoded one tile at a time straight
+// from the file, so only the tiles covering the rectangle are read.
+// Decoded tiles stay in an LRU list under a byte budget, so repeated
+// or overlapping regions in the same session come from memory.
+// ---------------------------------------------------------------
+
+#define TILE_SIZE 128
+#define TILE_MAX_BUCKETS 4096
+#define REGION_DEFAULT_CACHE_MB 64
+#define REGION_MAX_ARGS 64
+
+typedef struct Tile {
+    int tx, ty;                 // Tile coordinates
+    int width, height;          // Smaller along the right and bottom edges
+    Pixel* pixels;
+    struct Tile* newer;         // LRU list, newest is the most recently used
+    struct Tile* older;
+    struct Tile* next_in_bucket;
+} Tile;
+
+typedef struct {
+    FILE* file;
+    BMPHeader header;
+    BMPInfoHeader info;
+    RowFormat format;
+    int width, height;
+    int bottom_up;
+    size_t stride;              // Bytes per stored row, padding included
+    int tiles_x, tiles_y;
+    Tile** buckets;             // Hash of tile index -> tile
+    int bucket_count;
+    Tile* newest;
+    Tile* oldest;
+    size_t budget;              // Bytes of decoded pixels we may keep
+    size_t used;
+    uint64_t hits, misses, evictions;
+    uint64_t bytes_read;
+} TileCache;
+
+// Parse "X,Y,WxH" and clip it to the image. Returns 0 if nothing is left.
+static int parse_region(const char* spec, int width, int height, int* x, int* y, int* w, int* h) {
+    int end = 0;
+    if (sscanf(spec, "%d,%d,%dx%d%n", x, y, w, h, &end) != 4 || spec[end] != '\0') {
+        printf("Error: Region must look like X,Y,WxH (got %s)!\n", spec);
+        return 0;
+    }
+    if (*x < 0) { *w += *x; *x = 0; }
+    if (*y < 0) { *h += *y; *y = 0; }
+    if (*x + *w > width) *w = width - *x;
+    if (*y + *h > height) *h = height - *y;
+    if (*w <= 0 || *h <= 0) {
+        printf("Error: Region %s is outside the %dx%d image!\n", spec, width, height);
+        return 0;
+    }
+    return 1;
+}
+
+// Blank 24-bit image with canonical headers
+static Image* new_image(int width, int height) {
+    Image* img = calloc(1, sizeof(Image));
+    if (!img) {
+        return NULL;
+    }
+    img->pixels = malloc((size_t)width * height * sizeof(Pixel));
+    if (!img->pixels) {
+        free(img);
+        return NULL;
+    }
+    img->header.type = 0x4D42;
+    img->info.planes = 1;
+    img->info.bits = 24;
+    img->info.xresolution = img->info.yresolution = 2835;
+    set_image_size(img, width, height);
+    return img;
+}
+
+// crop operation on an image that is already in memory (batch mode)
+int crop_image(Image* img, char* spec) {
+    int x, y, w, h;
+    if (!parse_region(spec, img->width, img->height, &x, &y, &w, &h)) {
+        return 0;
+    }
+    Pixel* cropped = malloc((size_t)w * h * sizeof(Pixel));
+    if (!cropped) {
+        printf("Error: Can't allocate memory for crop!\n");
+        return 0;
+    }
+    for (int r = 0; r < h; r++) {
+        memcpy(&cropped[(size_t)r * w], &img->pixels[(size_t)(y + r) * img->width + x],
+               (size_t)w * sizeof(Pixel));
+    }
+    replace_pixels(img, cropped);
+    set_image_size(img, w, h);
+    return 1;
+}
+
+TileCache* tile_cache_open(char* filename, size_t budget) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        printf("Error: Can't open file %s\n", filename);
+        return NULL;
+    }
+    TileCache* cache = calloc(1, sizeof(TileCache));
+    if (!cache) {
+        fclose(file);
+        return NULL;
+    }
+    cache->file = file;
+    if (!read_bmp_headers(file, &cache->header, &cache->info) ||
+        !read_row_format(file, &cache->info, &cache->format)) {
+        fclose(file);
+        free(cache);
+        return NULL;
+    }
+    // Tiles need random access to rows, which RLE8 doesn't give us
+    if (cache->info.compression == BI_RLE8) {
+        printf("Error: Regions need an uncompressed BMP (this one is RLE8)!\n");
+        fclose(file);
+        free(cache);
+        return NULL;
+    }
+    
+    cache->width = cache->info.width;
+    cache->height = abs(cache->info.height);
+    cache->bottom_up = cache->info.height > 0;
+    cache->stride = ((size_t)cache->info.bits * cache->width + 31) / 32 * 4;
+    cache->tiles_x = (cache->width + TILE_SIZE - 1) / TILE_SIZE;
+    cache->tiles_y = (cache->height + TILE_SIZE - 1) / TILE_SIZE;
+    long long tiles = (long long)cache->tiles_x * cache->tiles_y;
+    cache->bucket_count = tiles < TILE_MAX_BUCKETS ? (int)tiles : TILE_MAX_BUCKETS;
+    cache->buckets = calloc(cache->bucket_count, sizeof(Tile*));
+    cache->budget = budget;
+    if (!cache->buckets) {
+        printf("Error: Can't allocate tile cache!\n");
+        fclose(file);
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+static Tile** tile_bucket(TileCache* cache, int tx, int ty) {
+    return &cache->buckets[((size_t)ty * cache->tiles_x + tx) % cache->bucket_count];
+}
+
+static void tile_unlink(TileCache* cache, Tile* tile) {
+    if (tile->newer) tile->newer->older = tile->older;
+    else cache->newest = tile->older;
+    if (tile->older) tile->older->newer = tile->newer;
+    else cache->oldest = tile->newer;
+    tile->newer = tile->older = NULL;
+}
+
+static void tile_push_newest(TileCache* cache, Tile* tile) {
+    tile->older = cache->newest;
+    tile->newer = NULL;
+    if (cache->newest) cache->newest->newer = tile;
+    cache->newest = tile;
+    if (!cache->oldest) cache->oldest = tile;
+}
+
+static void tile_evict(TileCache* cache, Tile* tile) {
+    tile_unlink(cache, tile);
+    Tile** link = tile_bucket(cache, tile->tx, tile->ty);
+    while (*link != tile) {
+        link = &(*link)->next_in_bucket;
+    }
+    *link = tile->next_in_bucket;
+    cache->used -= (size_t)tile->width * tile->height * sizeof(Pixel);
+    free(tile->pixels);
+    free(tile);
+}
+
+// Decode one tile: a seek and a short read per tile row
+static Tile* decode_tile(TileCache* cache, int tx, int ty) {
+    TRACE_BEGIN(span);
+    Tile* tile = calloc(1, sizeof(Tile));
+    if (!tile) {
+        return NULL;
+    }
+    tile->tx = tx;
+    tile->ty = ty;
+    tile->width = cache->width - tx * TILE_SIZE < TILE_SIZE ? cache->width - tx * TILE_SIZE : TILE_SIZE;
+    tile->height = cache->height - ty * TILE_SIZE < TILE_SIZE ? cache->height - ty * TILE_SIZE : TILE_SIZE;
+    tile->pixels = malloc((size_t)tile->width * tile->height * sizeof(Pixel));
+    
+    int bytes_per_pixel = cache->info.bits / 8;
+    size_t run = (size_t)tile->width * bytes_per_pixel;
+    uint8_t row[TILE_SIZE * 4];
+    int ok = tile->pixels != NULL;
+    for (int r = 0; r < tile->height && ok; r++) {
+        int y = ty * TILE_SIZE + r;
+        int stored = cache->bottom_up ? cache->height - 1 - y : y;
+        Pixel* d = &tile->pixels[(size_t)r * tile->width];
+        uint8_t* s = cache->format.bits == 24 ? (uint8_t*)d : row;
+        ok = fseek(cache->file, cache->header.offset + (long)stored * cache->stride +
+                   (long)tx * TILE_SIZE * bytes_per_pixel, SEEK_SET) == 0 &&
+             fread(s, 1, run, cache->file) == run;
+        if (ok && cache->format.bits != 24) {
+            decode_row(&cache->format, s, d, tile->width);
+        }
+    }
+    if (!ok) {
+        printf("Error: Pixel data is truncated!\n");
+        free(tile->pixels);
+        free(tile);
+        return NULL;
+    }
+    cache->bytes_read += run * tile->height;
+    TRACE_END(span, "tile_decode", run * tile->height);
+    return tile;
+}
+
+// Look a tile up, decoding it on a miss and evicting the least recently
+// used tiles until we are back under budget. The tile returned is never
+// evicted by its own insertion, even if it alone exceeds the budget.
+static Tile* tile_cache_get(TileCache* cache, int tx, int ty) {
+    Tile** bucket = tile_bucket(cache, tx, ty);
+    for (Tile* t = *bucket; t; t = t->next_in_bucket) {
+        if (t->tx == tx && t->ty == ty) {
+            cache->hits++;
+            tile_unlink(cache, t);
+            tile_push_newest(cache, t);
+            return t;
+        }
+    }
+    
+    cache->misses++;
+    Tile* tile = decode_tile(cache, tx, ty);
+    if (!tile) {
+        return NULL;
+    }
+    tile->next_in_bucket = *bucket;
+    *bucket = tile;
+    tile_push_newest(cache, tile);
+    cache->used += (size_t)tile->width * tile->height * sizeof(Pixel);
+    while (cache->used > cache->budget && cache->oldest != tile) {
+        tile_evict(cache, cache->oldest);
+        cache->evictions++;
+    }
+    return tile;
+}
+
+// Assemble the rectangle (already clipped) from the tiles that cover it
+Image* tile_cache_region(TileCache* cache, int x, int y, int w, int h) {
+    Image* img = new_image(w, h);
+    if (!img) {
+        printf("Error: Can't allocate memory for region!\n");
+        return NULL;
+    }
+    for (int ty = y / TILE_SIZE; ty <= (y + h - 1) / TILE_SIZE; ty++) {
+        for (int tx = x / TILE_SIZE; tx <= (x + w - 1) / TILE_SIZE; tx++) {
+            Tile* tile = tile_cache_get(cache, tx, ty);
+            if (!tile) {
+                free_image(img);
+                return NULL;
+            }
+            // Overlap of this tile with the region, in image coordinates
+            int x0 = tx * TILE_SIZE > x ? tx * TILE_SIZE : x;
+            int y0 = ty * TILE_SIZE > y ? ty * TILE_SIZE : y;
+            int x1 = tx * TILE_SIZE + tile->width < x + w ? tx * TILE_SIZE + tile->width : x + w;
+            int y1 = ty * TILE_SIZE + tile->height < y + h ? ty * TILE_SIZE + tile->height : y + h;
+            for (int row = y0; row < y1; row++) {
+                memcpy(&img->pixels[(size_t)(row - y) * w + (x0 - x)],
+                       &tile->pixels[(size_t)(row - ty * TILE_SIZE) * tile->width + (x0 - tx * TILE_SIZE)],
+                       (size_t)(x1 - x0) * sizeof(Pixel));
+            }
+        }
+    }
+    return img;
+}
+
+void tile_cache_report(const TileCache* cache) {
+    uint64_t lookups = cache->hits + cache->misses;
+    printf("Tile cache: %llu lookups, %llu hits, %llu misses (%.1f%% hit ratio), %llu evictions\n",
+           (unsigned long long)lookups, (unsigned long long)cache->hits,
+           (unsigned long long)cache->misses, lookups ? 100.0 * cache->hits / lookups : 0.0,
+           (unsigned long long)cache->evictions);
+    printf("            %.2f MB read from file, %.2f of %.2f MB budget held\n",
+           cache->bytes_read / 1048576.0, cache->used / 1048576.0, cache->budget / 1048576.0);
+}
+
+void tile_cache_close(TileCache* cache) {
+    while (cache->oldest) {
+        tile_evict(cache, cache->oldest);
+    }
+    fclose(cache->file);
+    free(cache->buckets);
+    free(cache);
+}
+
+// Crop one region through the cache, optionally run an operation on it, and save it
+static int process_region(TileCache* cache, char* spec, char* output, char* operation,
+                          int argc, char* argv[]) {
+    int x, y, w, h;
+    if (!parse_region(spec, cache->width, cache->height, &x, &y, &w, &h)) {
+        return 0;
+    }
+    Image* img = tile_cache_region(cache, x, y, w, h);
+    if (!img) {
+        return 0;
+    }
+    int ok = convert_layout(img, load_layout) &&
+             (!operation || run_operation(img, operation, argc, argv)) &&
+             save_bmp(output, img);
+    free_image(img);
+    return ok;
+}
+
+// input.bmp output.bmp crop X,Y,WxH: only the covering tiles are decoded
+int crop_file(char* input, char* output, char* spec) {
+    // RLE8 rows can't be found without decoding everything before them
+    FILE* file = fopen(input, "rb");
+    BMPHeader header;
+    BMPInfoHeader info;
+    int rle = file && fread(&header, sizeof(header), 1, file) == 1 &&
+              fread(&info, sizeof(info), 1, file) == 1 && info.compression == BI_RLE8;
+    if (file) {
+        fclose(file);
+    }
+    if (rle) {
+        Image* img = load_bmp(input);
+        int ok = img && run_operation(img, "crop", 1, &spec) && save_bmp(output, img);
+        if (img) {
+            free_image(img);
+        }
+        return ok;
+    }
+    
+    TileCache* cache = tile_cache_open(input, (size_t)REGION_DEFAULT_CACHE_MB << 20);
+    if (!cache) {
+        return 0;
+    }
+    int ok = process_region(cache, spec, output, NULL, 0, NULL);
+    if (!quiet) {
+        tile_cache_report(cache);
+    }
+    tile_cache_close(cache);
+    return ok;
+}
+
+// --regions [-m MB] <input.bmp> [X,Y,WxH out.bmp]...
+// Without region pairs the requests come from stdin, one per line:
+//   X,Y,WxH out.bmp [operation [args]]
+int run_regions(int argc, char* argv[]) {
+    int cache_mb = REGION_DEFAULT_CACHE_MB;
+    int arg = 0;
+    if (arg + 1 < argc && strcmp(argv[arg], "-m") == 0) {
+        cache_mb = atoi(argv[arg + 1]);
+        arg += 2;
+    }
+    if (arg >= argc || (argc - arg - 1) % 2 != 0 || cache_mb < 1) {
+        printf("Usage: --regions [-m MB] <input.bmp> [X,Y,WxH out.bmp]...\n");
+        printf("With no regions, reads 'X,Y,WxH out.bmp [operation [args]]' lines from stdin\n");
+        return 0;
+    }
+    
+    size_t budget = (size_t)cache_mb << 20;
+    TileCache* cache = tile_cache_open(argv[arg], budget);
+    if (!cache) {
+        return 0;
+    }
+    progress("Regions of %s (%dx%d, %dx%d tiles of %d), cache budget %zu MB\n", argv[arg],
+             cache->width, cache->height, cache->tiles_x, cache->tiles_y, TILE_SIZE, budget >> 20);
+    
+    int failed = 0;
+    if (arg + 1 < argc) {
+        for (int i = arg + 1; i < argc; i += 2) {
+            failed += !process_region(cache, argv[i], argv[i + 1], NULL, 0, NULL);
+        }
+    } else {
+        char line[1024];
+        while (fgets(line, sizeof(line), stdin)) {
+            char* words[REGION_MAX_ARGS];
+            int count = 0;
+            for (char* word = strtok(line, " \t\r\n"); word && count < REGION_MAX_ARGS;
+                 word = strtok(NULL, " \t\r\n")) {
+                words[count++] = word;
+            }
+            if (count == 0 || words[0][0] == '#') {
+                continue;
+            }
+            if (count < 2) {
+                printf("Error: Expected 'X,Y,WxH out.bmp [operation [args]]'\n");
+                failed++;
+                continue;
+            }
+            failed += !process_region(cache, words[0], words[1], count > 2 ? words[2] : NULL,
+                                      count > 3 ? count - 3 : 0, words + 3);
+        }
+    }
+    
+    tile_cache_report(cache);
+    tile_cache_close(cache);
+    return failed == 0;
+}
+
+// ---------------------------------------------------------------
+// Batch mode: one process handles a whole directory (or a list of
+// files) with a pool of worker threads. A memory budget caps how many
+// pixels are in flight and each worker keeps its pixel buffer between
+// images, so same-sized images never hit malloc again. A kept buffer
+// stays counted against the budget until the worker lets it go.
+// ---------------------------------------------------------------
+
+#define BATCH_DEFAULT_MEMORY_MB 512
+
+typedef struct {
+    char** inputs;        // Input file paths
+    int count;
+    char* output_dir;
+    char* operation;
+    int op_argc;
+    char** op_argv;
+    
+    pthread_mutex_t lock;
+    pthread_cond_t memory_freed;
+    int next;             // Next input to hand out
+    size_t budget;        // Max bytes of pixels in flight
+    size_t in_flight;
+    
+    // Totals for the final report
+    int done;
+    int failed;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} BatchJob;
+
+static int has_bmp_extension(const char* name) {
+    size_t len = strlen(name);
+    return len > 4 && strcasecmp(name + len - 4, ".bmp") == 0;
+}
+
+// Read just the headers to find out how much memory a file will need
+static int peek_bmp_size(char* filename, int* width, int* height) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        return 0;
+    }
+    BMPHeader header;
+    BMPInfoHeader info;
+    int ok = fread(&header, sizeof(header), 1, file) == 1 &&
+             fread(&info, sizeof(info), 1, file) == 1 &&
+             header.type == 0x4D42;
+    fclose(file);
+    *width = ok ? info.width : 0;
+    *height = ok ? abs(info.height) : 0;
+    return ok && *width > 0 && *height > 0;
+}
+
+static uint64_t file_size(const char* filename) {
+    struct stat st;
+    return stat(filename, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+// Block until the budget has room. One image is always let through
+// so a single huge file can't deadlock the batch.
+static void reserve_memory(BatchJob* job, size_t bytes) {
+    pthread_mutex_lock(&job->lock);
+    while (job->in_flight > 0 && job->in_flight + bytes > job->budget) {
+        pthread_cond_wait(&job->memory_freed, &job->lock);
+    }
+    job->in_flight += bytes;
+    pthread_mutex_unlock(&job->lock);
+}
+
+// reserve_memory without waiting: returns 0 if there's no room right now
+static int try_reserve_memory(BatchJob* job, size_t bytes) {
+    pthread_mutex_lock(&job->lock);
+    int ok = job->in_flight == 0 || job->in_flight + bytes <= job->budget;
+    if (ok) {
+        job->in_flight += bytes;
+    }
+    pthread_mutex_unlock(&job->lock);
+    return ok;
+}
+
+static void release_memory(BatchJob* job, size_t bytes) {
+    pthread_mutex_lock(&job->lock);
+    job->in_flight -= bytes;
+    pthread_cond_broadcast(&job->memory_freed);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Rough peak memory an operation needs besides the image itself: its
+// output copy plus any intermediate planes
+static size_t operation_bytes(const char* operation, int argc, char* argv[], int width, int height) {
+    size_t total = (size_t)width * height;
+    int out_w, out_h;
+    if (strcmp(operation, "blur") == 0 || strcmp(operation, "sharpen") == 0 ||
+        strcmp(operation, "convolve") == 0) {
+        return total * (2 * 3 * sizeof(float) + sizeof(Pixel));  // Padded rows and the first pass
+    }
+    if (strcmp(operation, "boxblur") == 0) {
+        return total * (3 * sizeof(uint32_t) + sizeof(Pixel));
+    }
+    if (strcmp(operation, "edges") == 0) {
+        return total * (3 * sizeof(int16_t) + sizeof(Pixel));
+    }
+    if (strcmp(operation, "threshold") == 0) {
+        return total * (sizeof(uint64_t) + 2 + sizeof(Pixel));  // Table, luma, result
+    }
+    if (strcmp(operation, "resize") == 0 && argc > 0 &&
+        sscanf(argv[0], "%dx%d", &out_w, &out_h) == 2 && out_w > 0 && out_h > 0) {
+        // Output plus the horizontally resized rows
+        return ((size_t)out_w * out_h + (size_t)out_w * height) * sizeof(Pixel);
+    }
+    return total * sizeof(Pixel);
+}
+
+// File name part of a path, which is also its name in the output directory
+static const char* path_base(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static void* batch_worker(void* arg) {
+    BatchJob* job = arg;
+    quiet = 1;
+    Pixel* buffer = NULL;   // Reused between images; its capacity stays reserved
+    size_t capacity = 0;
+    char output_file[4096];
+    
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        int index = job->next < job->count ? job->next++ : -1;
+        pthread_mutex_unlock(&job->lock);
+        if (index < 0) {
+            break;
+        }
+        
+        char* input_file = job->inputs[index];
+        snprintf(output_file, sizeof(output_file), "%s/%s", job->output_dir, path_base(input_file));
+        
+        int width, height;
+        if (!peek_bmp_size(input_file, &width, &height)) {
+            printf("Skipping %s: not a readable BMP\n", input_file);
+            pthread_mutex_lock(&job->lock);
+            job->failed++;
+            pthread_mutex_unlock(&job->lock);
+            continue;
+        }
+        
+        size_t pixel_bytes = (size_t)width * height * sizeof(Pixel);
+        if (capacity < pixel_bytes) {
+            free(buffer);  // Too small, let the loader allocate a new one
+            release_memory(job, capacity);
+            buffer = NULL;
+            capacity = 0;
+        }
+        
+        // Packed pixels unless the buffer already covers them, the planar
+        // or BGRX copy for --layout, and the operation's own memory
+        size_t total = (size_t)width * height;
+        size_t layout_bytes = load_layout == LAYOUT_BGRX ? total * sizeof(uint32_t)
+                            : load_layout == LAYOUT_PLANAR ? total * 3 : 0;
+        size_t extra = layout_bytes + operation_bytes(job->operation, job->op_argc, job->op_argv,
+                                                      width, height);
+        size_t reserved = (buffer ? 0 : pixel_bytes) + extra;
+        if (!try_reserve_memory(job, reserved)) {
+            // Don't sit on a reserved buffer while waiting for room
+            free(buffer);
+            release_memory(job, capacity);
+            buffer = NULL;
+            capacity = 0;
+            reserved = pixel_bytes + extra;
+            reserve_memory(job, reserved);
+        }
+        size_t held = capacity + reserved;  // Everything this image may use
+        
+        int ok = 0;
+        Image* img = load_bmp_into(input_file, buffer, capacity);
+        if (img) {
+            if (img->pixels == buffer) {
+                buffer = NULL;  // The image owns it now
+                capacity = 0;
+            }
+            ok = run_and_save(img, output_file, job->operation, job->op_argc, job->op_argv);
+            
+            // Keep a packed pixel array for the next file: our own if the
+            // image didn't take it, otherwise whichever the image ended with,
+            // as long as the reservation covers it. The array can be bigger
+            // than the final image (a big buffer reused for a small one, or
+            // a crop), so trim it to the size we record as reserved.
+            size_t final_bytes = (size_t)img->width * img->height * sizeof(Pixel);
+            if (!buffer && img->pixels && final_bytes > 0 && final_bytes <= held) {
+                Pixel* trimmed = realloc(img->pixels, final_bytes);
+                if (trimmed) {
+                    buffer = trimmed;
+                    capacity = final_bytes;
+                    img->pixels = NULL;
+                }
+            }
+            free(img->pixels);
+            free(img->planar);
+            free(img->bgrx);
+            free(img);
+        }
+        release_memory(job, held - capacity);  // The kept buffer stays reserved
+        
+        pthread_mutex_lock(&job->lock);
+        if (ok) {
+            job->done++;
+            job->bytes_in += file_size(input_file);
+            job->bytes_out += file_size(output_file);
+        } else {
+            printf("Failed: %s\n", input_file);
+            job->failed++;
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+    
+    free(buffer);
+    release_memory(job, capacity);
+    return NULL;
+}
+
+static void free_paths(char** paths, int count) {
+    for (int i = 0; i < count; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+// Collect input paths: every .bmp in a directory, or one path per line of a list file
+static char** collect_inputs(char* source, int* count) {
+    int capacity = 64;
+    char** paths = malloc(capacity * sizeof(char*));
+    *count = 0;
+    if (!paths) {
+        return NULL;
+    }
+    
+    DIR* dir = opendir(source);
+    FILE* list = dir ? NULL : fopen(source, "r");
+    if (!dir && !list) {
+        printf("Error: Can't open %s!\n", source);
+        free(paths);
+        return NULL;
+    }
+    
+    char line[4096];
+    while (1) {
+        char path[4096];
+        if (dir) {
+            struct dirent* entry = readdir(dir);
+            if (!entry) break;
+            if (!has_bmp_extension(entry->d_name)) continue;
+            snprintf(path, sizeof(path), "%s/%s", source, entry->d_name);
+        } else {
+            if (!fgets(line, sizeof(line), list)) break;
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0') continue;
+            snprintf(path, sizeof(path), "%s", line);
+        }
+        
+        if (*count == capacity) {
+            capacity *= 2;
+            char** bigger = realloc(paths, capacity * sizeof(char*));
+            if (!bigger) break;
+            paths = bigger;
+        }
+        paths[(*count)++] = strdup(path);
+    }
+    
+    if (dir) closedir(dir);
+    if (list) fclose(list);
+    return paths;
+}
+
+// Sorts input indexes by output name, then by list order
+static char** sort_inputs;
+static int compare_output_names(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    int order = strcmp(path_base(sort_inputs[x]), path_base(sort_inputs[y]));
+    return order ? order : (x > y) - (x < y);
+}
+
+// Inputs from a list file can share a file name (a/x.bmp and b/x.bmp) and
+// would overwrite each other's output. Keep the first of each name, fail
+// the rest. Returns 0 if memory runs out.
+static int drop_duplicate_outputs(BatchJob* job) {
+    int* order = malloc((job->count + 1) * sizeof(int));
+    char* drop = calloc(job->count + 1, 1);
+    if (!order || !drop) {
+        free(order);
+        free(drop);
+        return 0;
+    }
+    for (int i = 0; i < job->count; i++) {
+        order[i] = i;
+    }
+    sort_inputs = job->inputs;
+    qsort(order, job->count, sizeof(int), compare_output_names);
+    
+    int first = 0;
+    for (int i = 1; i < job->count; i++) {
+        if (strcmp(path_base(job->inputs[order[i]]), path_base(job->inputs[order[first]])) != 0) {
+            first = i;
+            continue;
+        }
+        printf("Failed: %s (same output name as %s)\n", job->inputs[order[i]], job->inputs[order[first]]);
+        drop[order[i]] = 1;
+        job->failed++;
+    }
+    
+    int kept = 0;
+    for (int i = 0; i < job->count; i++) {
+        if (drop[i]) {
+            free(job->inputs[i]);
+        } else {
+            job->inputs[kept++] = job->inputs[i];
+        }
+    }
+    job->count = kept;
+    free(order);
+    free(drop);
+    return 1;
+}
+
+// --batch [-j threads] [-m MB] <input dir|list> <output dir> <operation> [args]
+int run_batch(int argc, char* argv[]) {
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int memory_mb = BATCH_DEFAULT_MEMORY_MB;
+    
+    int i = 0;
+    while (i + 1 < argc && argv[i][0] == '-') {
+        if (strcmp(argv[i], "-j") == 0) {
+            threads = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            memory_mb = atoi(argv[i + 1]);
+        } else {
+            break;
+        }
+        i += 2;
+    }
+    if (argc - i < 3 || threads < 1 || memory_mb < 1) {
+        printf("Usage: --batch [-j threads] [-m MB] <input dir|list.txt> <output dir> <operation> [args]\n");
+        return 0;
+    }
+    
+    BatchJob job = {0};
+    job.inputs = collect_inputs(argv[i], &job.count);
+    if (!job.inputs) {
+        return 0;
+    }
+    job.output_dir = argv[i + 1];
+    job.operation = argv[i + 2];
+    job.op_argc = argc - i - 3;
+    job.op_argv = argv + i + 3;
+    job.budget = (size_t)memory_mb * 1024 * 1024;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.memory_freed, NULL);
+    
+    if (mkdir(job.output_dir, 0755) != 0 && errno != EEXIST) {
+        printf("Error: Can't create output directory %s!\n", job.output_dir);
+        free_paths(job.inputs, job.count);
+        return 0;
+    }
+    
+    if (!drop_duplicate_outputs(&job)) {
+        printf("Error: Can't allocate memory!\n");
+        free_paths(job.inputs, job.count);
+        return 0;
+    }
+    
+    if (threads > job.count) threads = job.count > 0 ? job.count : 1;
+    printf("Batch: %d images, %d threads, %d MB budget, operation %s\n",
+           job.count, threads, memory_mb, job.operation);
+    
+    quiet = 1;
+    double start = now_seconds();
+    pthread_t* pool = malloc(threads * sizeof(pthread_t));
+    if (!pool) {
+        printf("Error: Can't allocate memory!\n");
+        free_paths(job.inputs, job.count);
+        return 0;
+    }
+    // Workers pull images from a shared counter, so however many start
+    // get through the whole list; with none, this thread does the work
+    int started = 0;
+    for (int t = 0; t < threads; t++) {
+        if (pthread_create(&pool[started], NULL, batch_worker, &job) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        batch_worker(&job);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(pool[t], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    quiet = 0;
+    
+    double mb = (job.bytes_in + job.bytes_out) / (1024.0 * 1024.0);
+    printf("Processed %d images (%d failed) in %.3f s\n", job.done, job.failed, elapsed);
+    printf("Throughput: %.1f images/s, %.1f MB/s (read + written)\n",
+           elapsed > 0 ? job.done / elapsed : 0.0, elapsed > 0 ? mb / elapsed : 0.0);
+    
+    free(pool);
+    free_paths(job.inputs, job.count);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.memory_freed);
+    return job.failed == 0;
+}
+
+// ---------------------------------------------------------------
+// Hash index for finding near-duplicates in big collections.
+// --index hashes every image once (in parallel) into a text file.
+// --query looks hashes up with multi-index hashing: the 64-bit pHash
+// is split into four 16-bit chunks, each with its own bucket table.
+// Two hashes within r bits must agree to within r/4 bits on at least
+// one chunk, so only a few buckets need probing per query instead of
+// the whole collection.
+// ---------------------------------------------------------------
+
+#define MIH_CHUNKS 4
+#define MIH_CHUNK_BITS 16
+#define QUERY_DEFAULT_DISTANCE 8
+
+typedef struct {
+    uint64_t phash;
+    uint64_t dhash;
+    char* path;
+    int ok;
+} HashEntry;
+
+typedef struct {
+    HashEntry* entries;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+} IndexJob;
+
+static void* index_worker(void* arg) {
+    IndexJob* job = arg;
+    quiet = 1;
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        int i = job->next < job->count ? job->next++ : -1;
+        pthread_mutex_unlock(&job->lock);
+        if (i < 0) {
+            break;
+        }
+        HashEntry* e = &job->entries[i];
+        Image* img = load_bmp(e->path);
+        if (img && convert_layout(img, LAYOUT_PACKED)) {
+            e->phash = phash_image(img);
+            e->dhash = dhash_image(img);
+            e->ok = 1;
+        }
+        if (img) {
+            free_image(img);
+        }
+    }
+    return NULL;
+}
+
+// --index [-j threads] <input dir|list.txt> <index.txt>
+int run_index(int argc, char* argv[]) {
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 0;
+    if (i + 1 < argc && strcmp(argv[i], "-j") == 0) {
+        threads = atoi(argv[i + 1]);
+        i += 2;
+    }
+    if (argc - i != 2 || threads < 1) {
+        printf("Usage: --index [-j threads] <input dir|list.txt> <index.txt>\n");
+        return 0;
+    }
+    
+    int count;
+    char** paths = collect_inputs(argv[i], &count);
+    if (!paths) {
+        return 0;
+    }
+    FILE* out = fopen(argv[i + 1], "w");
+    IndexJob job = {0};
+    job.entries = calloc(count > 0 ? count : 1, sizeof(HashEntry));
+    pthread_t* pool = malloc(threads * sizeof(pthread_t));
+    if (!out || !job.entries || !pool) {
+        printf("Error: Can't create %s!\n", argv[i + 1]);
+        if (out) fclose(out);
+        free(job.entries);
+        free(pool);
+        free_paths(paths, count);
+        return 0;
+    }
+    job.count = count;
+    for (int k = 0; k < count; k++) {
+        job.entries[k].path = paths[k];
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    if (threads > count) threads = count > 0 ? count : 1;
+    
+    quiet = 1;
+    double start = now_seconds();
+    // As in run_batch: join only the workers that started, or do the work here
+    int started = 0;
+    for (int t = 0; t < threads; t++) {
+        if (pthread_create(&pool[started], NULL, index_worker, &job) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        index_worker(&job);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(pool[t], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    quiet = 0;
+    
+    int failed = 0;
+    for (int k = 0; k < count; k++) {
+        HashEntry* e = &job.entries[k];
+        if (e->ok) {
+            fprintf(out, "%016llx %016llx %s\n", (unsigned long long)e->phash,
+                    (unsigned long long)e->dhash, e->path);
+        } else {
+            printf("Failed: %s\n", e->path);
+            failed++;
+        }
+    }
+    fclose(out);
+    printf("Indexed %d images (%d failed) with %d threads in %.3f s\n", count - failed, failed,
+           threads, elapsed);
+    
+    pthread_mutex_destroy(&job.lock);
+    free(pool);
+    free(job.entries);
+    free_paths(paths, count);
+    return failed == 0;
+}
+
+typedef struct {
+    HashEntry* entries;
+    int count;
+    uint32_t* start[MIH_CHUNKS];  // Bucket b of chunk m is ids[m][start[m][b] .. start[m][b+1])
+    uint32_t* ids[MIH_CHUNKS];
+    uint32_t* seen;               // Stamp per entry so a candidate is checked once per query
+    uint32_t stamp;
+} HashIndex;
+
+static inline int mih_chunk(uint64_t hash, int m) {
+    return (int)(hash >> (m * MIH_CHUNK_BITS)) & ((1 << MIH_CHUNK_BITS) - 1);
+}
+
+void free_hash_index(HashIndex* index) {
+    for (int k = 0; k < index->count; k++) {
+        free(index->entries[k].path);
+    }
+    for (int m = 0; m < MIH_CHUNKS; m++) {
+        free(index->start[m]);
+        free(index->ids[m]);
+    }
+    free(index->entries);
+    free(index->seen);
+    free(index);
+}
+
+// Read an index file and bucket every chunk with a counting sort
+HashIndex* load_hash_index(char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        printf("Error: Can't open index %s!\n", filename);
+        return NULL;
+    }
+    HashIndex* index = calloc(1, sizeof(HashIndex));
+    if (!index) {
+        printf("Error: Can't allocate memory for index!\n");
+        fclose(file);
+        return NULL;
+    }
+    int capacity = 1024;
+    index->entries = malloc(capacity * sizeof(HashEntry));
+    int ok = index->entries != NULL;
+    
+    char line[4200];
+    while (ok && fgets(line, sizeof(line), file)) {
+        unsigned long long phash, dhash;
+        int offset = 0;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (sscanf(line, "%llx %llx %n", &phash, &dhash, &offset) != 2 || line[offset] == '\0') {
+            continue;
+        }
+        if (index->count == capacity) {
+            capacity *= 2;
+            HashEntry* bigger = realloc(index->entries, capacity * sizeof(HashEntry));
+            if (!bigger) {
+                ok = 0;
+                break;
+            }
+            index->entries = bigger;
+        }
+        HashEntry* e = &index->entries[index->count];
+        e->phash = phash;
+        e->dhash = dhash;
+        e->path = strdup(line + offset);
+        e->ok = 1;
+        ok = e->path != NULL;
+        index->count += ok;
+    }
+    fclose(file);
+    
+    index->seen = calloc(index->count > 0 ? index->count : 1, sizeof(uint32_t));
+    ok = ok && index->seen;
+    for (int m = 0; m < MIH_CHUNKS && ok; m++) {
+        index->start[m] = calloc((1 << MIH_CHUNK_BITS) + 1, sizeof(uint32_t));
+        index->ids[m] = malloc((index->count > 0 ? index->count : 1) * sizeof(uint32_t));
+        ok = index->start[m] && index->ids[m];
+        if (!ok) break;
+        uint32_t* start = index->start[m];
+        for (int k = 0; k < index->count; k++) {
+            start[mih_chunk(index->entries[k].phash, m) + 1]++;
+        }
+        for (int b = 0; b < 1 << MIH_CHUNK_BITS; b++) {
+            start[b + 1] += start[b];
+        }
+        // start[b] walks to the end of bucket b while filling, then shift back
+        for (int k = 0; k < index->count; k++) {
+            index->ids[m][start[mih_chunk(index->entries[k].phash, m)]++] = k;
+        }
+        memmove(start + 1, start, (1 << MIH_CHUNK_BITS) * sizeof(uint32_t));
+        start[0] = 0;
+    }
+    if (!ok) {
+        printf("Error: Can't allocate memory for index!\n");
+        free_hash_index(index);
+        return NULL;
+    }
+    return index;
+}
+
+typedef struct {
+    int* ids;
+    int* distances;
+    int count;
+    int capacity;
+    int failed;  // Ran out of memory, so the list is incomplete
+} HashMatches;
+
+static void check_bucket(HashIndex* index, int m, int bucket, uint64_t hash, int radius,
+                         HashMatches* matches) {
+    for (uint32_t k = index->start[m][bucket]; k < index->start[m][bucket + 1]; k++) {
+        uint32_t id = index->ids[m][k];
+        if (index->seen[id] == index->stamp) {
+            continue;
+        }
+        index->seen[id] = index->stamp;
+        int d = hash_distance(hash, index->entries[id].phash);
+        if (d > radius) {
+            continue;
+        }
+        if (matches->count == matches->capacity) {
+            int capacity = matches->capacity ? matches->capacity * 2 : 16;
+            int* ids = realloc(matches->ids, capacity * sizeof(int));
+            if (ids) {
+                matches->ids = ids;
+            }
+            int* distances = realloc(matches->distances, capacity * sizeof(int));
+            if (distances) {
+                matches->distances = distances;
+            }
+            if (!ids || !distances) {
+                matches->failed = 1;
+                return;
+            }
+            matches->capacity = capacity;
+        }
+        matches->ids[matches->count] = id;
+        matches->distances[matches->count++] = d;
+    }
+}
+
+// Probe every bucket whose chunk is within 'flips' bits of value, flipping bits from 'bit' up
+static void probe_chunk(HashIndex* index, int m, int value, int bit, int flips, uint64_t hash,
+                        int radius, HashMatches* matches) {
+    check_bucket(index, m, value, hash, radius, matches);
+    if (flips == 0) {
+        return;
+    }
+    for (int b = bit; b < MIH_CHUNK_BITS; b++) {
+        probe_chunk(index, m, value ^ (1 << b), b + 1, flips - 1, hash, radius, matches);
+    }
+}
+
+// All entries whose pHash is within radius bits of hash. Returns 0 if
+// memory ran out and the matches are incomplete.
+int query_hash_index(HashIndex* index, uint64_t hash, int radius, HashMatches* matches) {
+    matches->count = 0;
+    matches->failed = 0;
+    if (++index->stamp == 0) {
+        memset(index->seen, 0, index->count * sizeof(uint32_t));
+        index->stamp = 1;
+    }
+    int flips = radius / MIH_CHUNKS;
+    for (int m = 0; m < MIH_CHUNKS && !matches->failed; m++) {
+        probe_chunk(index, m, mih_chunk(hash, m), 0, flips, hash, radius, matches);
+    }
+    return !matches->failed;
+}
+
+// A query is a BMP to hash or a 16-digit pHash in hex
+static int query_hash(char* query, uint64_t* hash) {
+    char* end;
+    if (strlen(query) == 16 && access(query, F_OK) != 0) {
+        *hash = strtoull(query, &end, 16);
+        if (*end == '\0') {
+            return 1;
+        }
+    }
+    int q = quiet;
+    quiet = 1;
+    Image* img = load_bmp(query);
+    quiet = q;
+    if (!img || !convert_layout(img, LAYOUT_PACKED)) {
+        printf("Error: %s is neither a BMP nor a 16-digit hash!\n", query);
+        if (img) free_image(img);
+        return 0;
+    }
+    *hash = phash_image(img);
+    free_image(img);
+    return 1;
+}
+
+// --query [-d bits] <index.txt> <image.bmp|phash>... or --query [-d bits] <index.txt> --dups
+int run_query(int argc, char* argv[]) {
+    int radius = QUERY_DEFAULT_DISTANCE;
+    int i = 0;
+    if (i + 1 < argc && strcmp(argv[i], "-d") == 0) {
+        radius = atoi(argv[i + 1]);
+        i += 2;
+    }
+    if (argc - i < 2 || radius < 0 || radius > 64) {
+        printf("Usage: --query [-d bits] <index.txt> <image.bmp|phash>...\n");
+        printf("       --query [-d bits] <index.txt> --dups\n");
+        return 0;
+    }
+    
+    double start = now_seconds();
+    HashIndex* index = load_hash_index(argv[i]);
+    if (!index) {
+        return 0;
+    }
+    printf("Loaded %d hashes in %.3f s\n", index->count, now_seconds() - start);
+    
+    HashMatches matches = {0};
+    int failed = 0;
+    if (strcmp(argv[i + 1], "--dups") == 0) {
+        // Every pair within radius, each reported once
+        int pairs = 0;
+        start = now_seconds();
+        for (int k = 0; k < index->count; k++) {
+            if (!query_hash_index(index, index->entries[k].phash, radius, &matches)) {
+                printf("Error: Can't allocate memory for matches!\n");
+                failed++;
+                break;
+            }
+            for (int j = 0; j < matches.count; j++) {
+                if (matches.ids[j] > k) {
+                    printf("%2d  %s  %s\n", matches.distances[j], index->entries[k].path,
+                           index->entries[matches.ids[j]].path);
+                    pairs++;
+                }
+            }
+        }
+        printf("%d near-duplicate pairs within %d bits in %.3f ms\n", pairs, radius,
+               (now_seconds() - start) * 1e3);
+    } else {
+        for (int q = i + 1; q < argc; q++) {
+            uint64_t hash;
+            if (!query_hash(argv[q], &hash)) {
+                failed++;
+                continue;
+            }
+            start = now_seconds();
+            if (!query_hash_index(index, hash, radius, &matches)) {
+                printf("Error: Can't allocate memory for matches!\n");
+                failed++;
+                break;
+            }
+            double elapsed = now_seconds() - start;
+            printf("%s (%016llx): %d matches within %d bits in %.3f ms\n", argv[q],
+                   (unsigned long long)hash, matches.count, radius, elapsed * 1e3);
+            for (int j = 0; j < matches.count; j++) {
+                printf("  %2d  %s\n", matches.distances[j], index->entries[matches.ids[j]].path);
+            }
+        }
+    }
+    
+    free(matches.ids);
+    free(matches.distances);
+    free_hash_index(index);
+    return failed == 0;
+}
+
+// ---------------------------------------------------------------
+// Benchmark harness: generates synthetic BMPs, times load, save and
+// every operation over several runs, prints median/p95 and
+// megapixels per second, and can write JSON and compare it with a
+// stored baseline so slowdowns fail the run.
+// ---------------------------------------------------------------
+
+#define BENCH_DEFAULT_REPS 5
+#define BENCH_DEFAULT_SIZES "64x64,257x256,1023x1024,4097x4096"
+#define BENCH_MAX_SIDE 16384
+#define BENCH_MAX_RESULTS 1024
+#define BENCH_NOISE_FLOOR_MS 0.05  // Faster than this is timer noise, never a regression
+
+typedef struct {
+    char size[32];
+    char op[32];
+    double median_ms;
+    double p95_ms;
+    double mpix_per_s;
+} BenchResult;
+
+typedef struct {
+    const char* label;
+    char* op;
+    int argc;
+    char* argv[2];
+} BenchOp;
+
+// Deterministic test pattern: gradients plus noise, so every operation
+// has real work to do and runs are repeatable
+Image* create_synthetic_image(int width, int height, uint32_t seed) {
+    Image* img = new_image(width, height);
+    if (!img) {
+        return NULL;
+    }
+    
+    uint32_t state = seed * 2654435761u + 1;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            state = state * 1664525u + 1013904223u;  // LCG
+            uint8_t noise = (uint8_t)(state >> 27);
+            Pixel* p = &img->pixels[(size_t)y * width + x];
+            p->blue = (uint8_t)(x * 255 / (width > 1 ? width - 1 : 1)) ^ noise;
+            p->green = (uint8_t)(y * 255 / (height > 1 ? height - 1 : 1)) + noise;
+            p->red = (uint8_t)((x + y) * 4) ^ (uint8_t)(state >> 24);
+        }
+    }
+    return img;
+}
+
+static void summarize_times(double* times, int reps, double* median, double* p95) {
+    qsort(times, reps, sizeof(double), compare_doubles);
+    *median = times[reps / 2];
+    int rank = (int)ceil(0.95 * reps) - 1;  // Nearest-rank percentile
+    *p95 = times[rank < 0 ? 0 : rank];
+}
+
+static void add_bench_result(BenchResult* results, int* count, const char* size, const char* op,
+                             double* times, int reps, double mpix) {
+    if (*count >= BENCH_MAX_RESULTS) {
+        return;
+    }
+    BenchResult* r = &results[(*count)++];
+    snprintf(r->size, sizeof(r->size), "%s", size);
+    snprintf(r->op, sizeof(r->op), "%s", op);
+    double median, p95;
+    summarize_times(times, reps, &median, &p95);
+    r->median_ms = median * 1e3;
+    r->p95_ms = p95 * 1e3;
+    r->mpix_per_s = median > 0 ? mpix / median : 0.0;
+    printf("%-12s %-14s %12.3f %12.3f %12.1f\n", r->size, r->op, r->median_ms, r->p95_ms, r->mpix_per_s);
+}
+
+static int write_bench_json(const char* filename, const BenchResult* results, int count, int reps) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        printf("Error: Can't create %s!\n", filename);
+        return 0;
+    }
+    // One result per line, which also keeps read_bench_baseline simple
+    fprintf(file, "{\n  \"reps\": %d,\n  \"results\": [\n", reps);
+    for (int i = 0; i < count; i++) {
+        fprintf(file, "    {\"size\": \"%s\", \"op\": \"%s\", \"median_ms\": %.4f, "
+                      "\"p95_ms\": %.4f, \"mpix_per_s\": %.2f}%s\n",
+                results[i].size, results[i].op, results[i].median_ms, results[i].p95_ms,
+                results[i].mpix_per_s, i + 1 < count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    printf("Results written to %s\n", filename);
+    return 1;
+}
+
+// Read a file written by write_bench_json
+static int read_bench_baseline(const char* filename, BenchResult* results, int max) {
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        return -1;
+    }
+    char line[512];
+    int count = 0;
+    while (count < max && fgets(line, sizeof(line), file)) {
+        BenchResult* r = &results[count];
+        if (sscanf(line, " {\"size\": \"%31[^\"]\", \"op\": \"%31[^\"]\", \"median_ms\": %lf",
+                   r->size, r->op, &r->median_ms) == 3) {
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+// Number of results more than tolerance slower than the baseline
+static int compare_with_baseline(const BenchResult* results, int count, const char* filename,
+                                 double tolerance) {
+    BenchResult* base = malloc(BENCH_MAX_RESULTS * sizeof(BenchResult));
+    if (!base) {
+        return 0;
+    }
+    int base_count = read_bench_baseline(filename, base, BENCH_MAX_RESULTS);
+    if (base_count < 0) {
+        printf("No baseline at %s, skipping comparison\n", filename);
+        free(base);
+        return 0;
+    }
+    
+    printf("\nComparing with %s (tolerance %.0f%%)\n", filename, tolerance * 100);
+    int regressions = 0, compared = 0;
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < base_count; j++) {
+            if (strcmp(results[i].size, base[j].size) != 0 || strcmp(results[i].op, base[j].op) != 0) {
+                continue;
+            }
+            compared++;
+            double ratio = base[j].median_ms > 0 ? results[i].median_ms / base[j].median_ms : 1.0;
+            if (ratio > 1.0 + tolerance && results[i].median_ms > BENCH_NOISE_FLOOR_MS) {
+                printf("REGRESSION %-12s %-14s %10.3f ms vs %10.3f ms (%+.0f%%)\n",
+                       results[i].size, results[i].op, results[i].median_ms, base[j].median_ms,
+                       (ratio - 1.0) * 100);
+                regressions++;
+            }
+            break;
+        }
+    }
+    printf("%d of %d results compared, %d regression(s)\n", compared, count, regressions);
+    free(base);
+    return regressions;
+}
+
+// --bench [--sizes WxH,...] [--reps N] [--json out.json] [--baseline base.json]
+//         [--tolerance 0.25] [--dir tmpdir]
+int run_benchmarks(int argc, char* argv[]) {
+    const char* sizes = BENCH_DEFAULT_SIZES;
+    const char* json = NULL;
+    const char* baseline = NULL;
+    const char* dir = "/tmp";
+    int reps = BENCH_DEFAULT_REPS;
+    double tolerance = 0.25;
+    
+    for (int i = 0; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--sizes") == 0) sizes = argv[i + 1];
+        else if (strcmp(argv[i], "--reps") == 0) reps = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--json") == 0) json = argv[i + 1];
+        else if (strcmp(argv[i], "--baseline") == 0) baseline = argv[i + 1];
+        else if (strcmp(argv[i], "--tolerance") == 0) tolerance = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "--dir") == 0) dir = argv[i + 1];
+        else {
+            printf("Unknown benchmark option: %s\n", argv[i]);
+            return 0;
+        }
+    }
+    if (argc % 2 != 0 || reps < 1) {
+        printf("Usage: --bench [--sizes WxH,...] [--reps N] [--json out.json]\n");
+        printf("               [--baseline base.json] [--tolerance 0.25] [--dir tmpdir]\n");
+        return 0;
+    }
+    
+    BenchOp ops[] = {
+        {"grayscale", "grayscale", 0, {NULL}},
+        {"invert", "invert", 0, {NULL}},
+        {"mirror", "mirror", 0, {NULL}},
+        {"blur 2", "blur", 1, {"2"}},
+        {"boxblur 4", "boxblur", 1, {"4"}},
+        {"sharpen", "sharpen", 0, {NULL}},
+        {"edges", "edges", 0, {NULL}},
+        {"resize 1/2", "resize", 0, {NULL}},  // Size filled in per image
+        {"stats", "stats", 0, {NULL}},
+        {"autolevels", "autolevels", 0, {NULL}},
+        {"curves", "curves", 2, {"gamma=2.2", "contrast=1.2"}},
+        {"rotate 90", "rotate", 1, {"90"}},
+        {"transpose", "transpose", 0, {NULL}},
+        {"flip", "flip", 0, {NULL}},
+        {"hash", "hash", 0, {NULL}},
+        {"threshold", "threshold", 0, {NULL}},
+        {"crop 1/2", "crop", 0, {NULL}},      // Centre quarter, filled in per image
+    };
+    int op_count = sizeof(ops) / sizeof(ops[0]);
+    
+    BenchResult* results = malloc(BENCH_MAX_RESULTS * sizeof(BenchResult));
+    double* times = malloc(reps * sizeof(double));
+    if (!results || !times) {
+        printf("Error: Can't allocate memory!\n");
+        free(results);
+        free(times);
+        return 0;
+    }
+    int count = 0;
+    int ok = 1;
+    
+    printf("Benchmark: %d runs per measurement\n", reps);
+    printf("%-12s %-14s %12s %12s %12s\n", "Size", "Operation", "Median (ms)", "p95 (ms)", "MPixels/s");
+    
+    char list[1024];
+    snprintf(list, sizeof(list), "%s", sizes);
+    int q = quiet;
+    for (char* item = strtok(list, ","); item && ok; item = strtok(NULL, ",")) {
+        int w, h;
+        if (sscanf(item, "%dx%d", &w, &h) != 2 || w < 1 || h < 1 ||
+            w > BENCH_MAX_SIDE || h > BENCH_MAX_SIDE) {
+            printf("Skipping bad size %s (1..%d per side)\n", item, BENCH_MAX_SIDE);
+            continue;
+        }
+        double mpix = (double)w * h / 1e6;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/bench_%dx%d.bmp", dir, w, h);
+        
+        quiet = 1;
+        Image* source = create_synthetic_image(w, h, (uint32_t)(w * 31 + h));
+        if (!source || !save_bmp(path, source)) {
+            quiet = q;
+            printf("Error: Can't create synthetic image %s!\n", path);
+            if (source) free_image(source);
+            ok = 0;
+            break;
+        }
+        
+        // Save and load
+        for (int rep = 0; rep < reps; rep++) {
+            double t0 = now_seconds();
+            save_bmp(path, source);
+            times[rep] = now_seconds() - t0;
+        }
+        quiet = q;
+        add_bench_result(results, &count, item, "save", times, reps, mpix);
+        quiet = 1;
+        for (int rep = 0; rep < reps; rep++) {
+            double t0 = now_seconds();
+            Image* loaded = load_bmp(path);
+            times[rep] = now_seconds() - t0;
+            if (loaded) free_image(loaded);
+        }
+        quiet = q;
+        add_bench_result(results, &count, item, "load", times, reps, mpix);
+        
+        // Every operation, each run on a fresh copy
+        char half[32], centre[64];
+        snprintf(half, sizeof(half), "%dx%d", w > 1 ? w / 2 : 1, h > 1 ? h / 2 : 1);
+        snprintf(centre, sizeof(centre), "%d,%d,%s", w / 4, h / 4, half);
+        for (int i = 0; i < op_count && ok; i++) {
+            char* op_argv[2] = {ops[i].argv[0], ops[i].argv[1]};
+            int op_argc = ops[i].argc;
+            if (strcmp(ops[i].op, "resize") == 0) {
+                op_argv[0] = half;
+                op_argc = 1;
+            } else if (strcmp(ops[i].op, "crop") == 0) {
+                op_argv[0] = centre;
+                op_argc = 1;
+            }
+            
+            quiet = 1;
+            for (int rep = 0; rep < reps; rep++) {
+                Image* copy = clone_image(source);
+                if (!copy) {
+                    ok = 0;
+                    break;
+                }
+                double t0 = now_seconds();
+                if (strcmp(ops[i].op, "stats") == 0) {
+                    bench_stats(copy);  // Skip printing the table
+                } else if (strcmp(ops[i].op, "hash") == 0) {
+                    volatile uint64_t sink = phash_image(copy) ^ dhash_image(copy);
+                    (void)sink;
+                } else {
+                    run_operation(copy, ops[i].op, op_argc, op_argv);
+                }
+                times[rep] = now_seconds() - t0;
+                free_image(copy);
+            }
+            quiet = q;
+            if (ok) {
+                add_bench_result(results, &count, item, ops[i].label, times, reps, mpix);
+            }
+        }
+        
+        quiet = 1;
+        free_image(source);
+        quiet = q;
+        remove(path);
+    }
+    quiet = q;
+    
+    if (!ok) {
+        printf("Error: Benchmark ran out of memory!\n");
+    }
+    if (ok && json) {
+        ok = write_bench_json(json, results, count, reps);
+    }
+    if (ok && baseline && compare_with_baseline(results, count, baseline, tolerance) > 0) {
+        ok = 0;
+    }
+    
+    free(results);
+    free(times);
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    printf("Simple BMP Image Processor\n");
     printf("==========================\n");
     
+    // Leading options shared by every mode
+    while (argc > 2 && (strcmp(argv[1], "--bits") == 0 || strcmp(argv[1], "--layout") == 0 ||
+                        strcmp(argv[1], "--trace") == 0)) {
+        if (strcmp(argv[1], "--trace") == 0) {
+            trace_output = argv[2];
+        } else if (strcmp(argv[1], "--layout") == 0) {
+            if (!parse_layout(argv[2], &load_layout)) {
+                printf("Error: --layout must be packed, planar or bgrx!\n");
+                return 1;
+            }
+        } else {
+            output_bits = atoi(argv[2]);
+            if (output_bits != 24 && output_bits != 32) {
+                printf("Error: --bits must be 24 or 32!\n");
+                return 1;
+            }
+        }
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+    
+    // Spans are reported however main returns
+    trace_start();
+    atexit(trace_report);
+    
+    // Benchmark harness on synthetic images
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        return run_benchmarks(argc - 2, argv + 2) ? 0 : 1;
+    }
+    
+    // Batch mode handles a whole directory in one process
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+        return run_batch(argc - 2, argv + 2) ? 0 : 1;
+    }
+    
+    // Perceptual hash index for near-duplicate search
+    if (argc > 1 && strcmp(argv[1], "--index") == 0) {
+        return run_index(argc - 2, argv + 2) ? 0 : 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "--query") == 0) {
+        return run_query(argc - 2, argv + 2) ? 0 : 1;
+    }
+    
+    // Many regions of one image through a shared tile cache
+    if (argc > 1 && strcmp(argv[1], "--regions") == 0) {
+        return run_regions(argc - 2, argv + 2) ? 0 : 1;
+    }
+    
     // Check command line arguments
-    if (argc != 4) {
-        printf("Usage: %s <input.bmp> <output.bmp> <operation>\n", argv[0]);
-        printf("Operations: grayscale, invert, mirror\n");
+    if (argc < 4) {
+        printf("Usage: %s [--bits 24|32] [--layout L] [--trace T] <input.bmp> <output.bmp> <operation> [args] [stream]\n", argv[0]);
+        printf("       %s [--bits 24|32] [--layout L] [--trace T] --batch [-j threads] [-m MB] <input dir|list.txt> <output dir> <operation> [args]\n", argv[0]);
+        printf("       %s [--bits 24|32] [--layout L] --regions [-m MB] <input.bmp> [X,Y,WxH out.bmp]...\n", argv[0]);
+        printf("       %s --index [-j threads] <input dir|list.txt> <index.txt>\n", argv[0]);
+        printf("       %s --query [-d bits] <index.txt> <image.bmp|phash>...|--dups\n", argv[0]);
+        printf("       %s --bench [--sizes WxH,...] [--reps N] [--json out.json] [--baseline base.json]\n", argv[0]);
+        printf("Operations: grayscale, invert, mirror,\n");
+        printf("            blur [radius], boxblur [radius], sharpen, edges,\n");
+        printf("            convolve <size> <weights...>, convbench [radius],\n");
+        printf("            resize <W>x<H> [nearest|bilinear|lanczos], resizebench [filter],\n");
+        printf("            stats, autolevels [clip%%], curves <step> [step...],\n");
+        printf("            rotate 90|180|270, transpose, flip, rotatebench, layoutbench,\n");
+        printf("            crop X,Y,WxH (decodes only the tiles it needs),\n");
+        printf("            hash, diff <other.bmp> [gain],\n");
+        printf("            threshold [window] [percent], thresholdbench [window],\n");
+        printf("            savebench [reps]\n");
+        printf("Add 'stream' to grayscale, invert or mirror to process row bands\n");
+        printf("without loading the whole image\n");
+        printf("Reads 8-bit (plain or RLE8), 16-bit, 24-bit and 32-bit BMPs;\n");
+        printf("--bits 32 writes 4-byte aligned BGRX pixels\n");
+        printf("--layout packed|planar|bgrx picks how pixels are held in memory\n");
+        printf("--trace table|out.json reports per-stage timings (needs make TRACE=1)\n");
         printf("Example: %s photo.bmp result.bmp grayscale\n", argv[0]);
         return 1;
     }
@@ -234,6 +5319,49 @@ int main(int argc, char* argv[]) {
     char* output_file = argv[2];
     char* operation = argv[3];
     
+    // Streaming mode for row-local operations
+    if (argc == 5 && strcmp(argv[4], "stream") == 0) {
+        RowOp op = NULL;
+        if (strcmp(operation, "grayscale") == 0) {
+            op = grayscale_row;
+        }
+        else if (strcmp(operation, "invert") == 0) {
+            op = invert_row;
+        }
+        else if (strcmp(operation, "mirror") == 0) {
+            op = mirror_row;
+        }
+        else {
+            printf("Operation %s can't be streamed\n", operation);
+            printf("Use: grayscale, invert, or mirror\n");
+            return 1;
+        }
+        
+        TRACE_BEGIN(span);
+        int streamed = stream_bmp(input_file, output_file, op);
+        TRACE_END(span, "stream", 0);
+        if (!streamed) {
+            printf("Failed to process image!\n");
+            return 1;
+        }
+        printf("Processing complete!\n");
+        return 0;
+    }
+    
+    // Crops read just the tiles under the rectangle instead of the whole file
+    if (strcmp(operation, "crop") == 0) {
+        if (argc != 5) {
+            printf("Usage: %s <input.bmp> <output.bmp> crop X,Y,WxH\n", argv[0]);
+            return 1;
+        }
+        if (!crop_file(input_file, output_file, argv[4])) {
+            printf("Failed to process image!\n");
+            return 1;
+        }
+        printf("Processing complete!\n");
+        return 0;
+    }
+    
     // Load the image
     Image* my_image = load_bmp(input_file);
     if (!my_image) {
@@ -241,29 +5369,15 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
-    // Perform the requested operation
-    if (strcmp(operation, "grayscale") == 0) {
-        make_grayscale(my_image);
-    }
-    else if (strcmp(operation, "invert") == 0) {
-        invert_colors(my_image);
-    }
-    else if (strcmp(operation, "mirror") == 0) {
-        mirror_horizontal(my_image);
-    }
-    else {
-        printf("Unknown operation: %s\n", operation);
-        printf("Use: grayscale, invert, or mirror\n");
+    // Perform the requested operation and save the result
+    if (!run_and_save(my_image, output_file, operation, argc - 4, argv + 4)) {
         free_image(my_image);
         return 1;
     }
     
-    // Save the result
-    save_bmp(output_file, my_image);
-    
     // Clean up memory
     free_image(my_image);
     
     printf("Processing complete!\n");
     return 0;
-}
\ No newline at end of file
+}